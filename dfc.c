@@ -11,6 +11,17 @@ https://github.com/nfsp3k/DFC
 #include <ctype.h>
 #include <inttypes.h>
 #include <stdbool.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define DFC_X86
+#include <immintrin.h>
+#endif
 
 #ifndef u64
 #define u64 uint64_t
@@ -31,17 +42,36 @@ https://github.com/nfsp3k/DFC
 /****************************************************/
 /*         Parameters: DF size, CT size             */
 /****************************************************/
+/* Largest direct filter; DFC_CONFIG.df_bits can shrink them per instance */
 #define DF_SIZE         0x10000
 #define DF_SIZE_REAL    0x2000
+#define DF_BITS         16
+#define DF_BITS_MIN     8
+
+/* Auto df_bits gives each distinct key at least this many filter bits */
+#define DF_AUTO_BITS_PER_KEY    64
+
+/* Bits of the interleaved filter byte of a key, see DFC_BuildDFBits() */
+#define DFB_DF1         0x01
+#define DFB_CDF1        0x02
+#define DFB_4_PLUS      0x04
+#define DFB_4_1         0x08
+#define DFB_8_1         0x10
+#define DFB_8_2         0x20
 
-#define CT_TYPE1_PID_CNT_MAX    200
 #define CT1_TABLE_SIZE          256
+
+/* Upper bounds; DFC_Compile sizes CT2/CT4/CT8 from the number of keys */
+#define CT_MIN_TABLE_SIZE       16
 #define CT2_TABLE_SIZE          0x1000
 #define CT3_TABLE_SIZE          0x1000
 #define CT4_TABLE_SIZE          0x20000
 #define CT8_TABLE_SIZE          0x20000
+#define CT_MAX_TABLE_SIZE       0x1000000
 
+/* Default and largest recursive table size */
 #define RECURSIVE_CT_SIZE    4096
+#define RECURSIVE_CT_SIZE_MAX    0x10000
 
 #define BTYPE    register u16
 
@@ -53,8 +83,6 @@ https://github.com/nfsp3k/DFC
 #define BINDEX(x)    ((x) >> 3)
 #define BMASK(x)     (1 << ((x) & 0x7))
 
-#define DF_MASK    (DF_SIZE - 1)
-
 #define CT2_TABLE_SIZE_MASK    (CT2_TABLE_SIZE-1)
 #define CT3_TABLE_SIZE_MASK    (CT3_TABLE_SIZE-1)
 #define CT4_TABLE_SIZE_MASK    (CT4_TABLE_SIZE-1)
@@ -70,11 +98,11 @@ https://github.com/nfsp3k/DFC
 /****************************************************/
 /* Compact Table Structures */
 /****************************************************/
-/* Compact Table (CT1) */
+/* Compact Table (CT1): PIDs of byte c are pid[start[c]] up to pid[start[c + 1]] */
 typedef struct pid_list_
 {
-	u32 pid[CT_TYPE1_PID_CNT_MAX];
-	u16 cnt;
+	u32 start[CT1_TABLE_SIZE + 1];
+	u32 *pid;
 } CT_Type_1;
 
 /****************************************************/
@@ -131,6 +159,76 @@ typedef struct CT_Type_2_8B_
 } CT_Type_2_8B;
 /****************************************************/
 
+/****************************************************/
+/*     Flattened (CSR) Compact Tables for search    */
+/****************************************************/
+/* DFC_Compile builds the pointer-based tables above and then packs them
+ * into these: per-table bucket offsets, inline entries and one PID pool
+ * shared by all tables. Entries of bucket b are entry[bucket[b]] up to
+ * entry[bucket[b + 1]]. */
+typedef struct CT_Flat_Entry_
+{
+	u32 pat;         // 2B or 4B pattern
+	u32 pid_start;   // first PID in PIDPool
+	u32 pid_cnt;     // number of PIDs
+	u32 rec;         // recursive table index + 1, 0 if none
+} CT_Flat_Entry;
+
+typedef struct CT_Flat_8B_Entry_
+{
+	u64 pat;         // 8B pattern
+	u32 pid_start;
+	u32 pid_cnt;
+	u32 rec;
+} CT_Flat_8B_Entry;
+
+typedef struct CT_Flat_
+{
+	u32 mask;        // table size - 1
+	u32 *bucket;     // table size + 1 offsets
+	u32 entry_cnt;
+	CT_Flat_Entry *entry;
+} CT_Flat;
+
+typedef struct CT_Flat_8B_
+{
+	u32 mask;
+	u32 *bucket;
+	u32 entry_cnt;
+	CT_Flat_8B_Entry *entry;
+} CT_Flat_8B;
+
+/* Recursive tables: table r uses df[r * DF bytes] and
+ * bucket[r * (rec_ct_size + 1)], see DFC_CONFIG */
+typedef struct CT_Flat_Rec_
+{
+	u32 cnt;
+	u8 *df;
+	u32 *bucket;
+	u32 entry_cnt;
+	CT_Flat_Entry *entry;
+} CT_Flat_Rec;
+/****************************************************/
+
+/*
+*  Per-instance geometry, see DFC_NewWithConfig(). DFC_ConfigDefault()
+*  fills in the sizes DFC_New uses; 0 in df_bits or rec_ct_size lets
+*  DFC_Compile pick them from the patterns of each length class.
+*/
+typedef struct _dfc_config
+{
+	u32 df_bits;            // log2 of the bits per direct filter, DF_BITS_MIN..DF_BITS
+	u32 ct2_max;            // bucket caps of CT2/CT4/CT8, powers of two; the
+	u32 ct4_max;            // tables are sized from their keys up to these
+	u32 ct8_max;
+	u32 rec_ct_size;        // buckets of each recursive table, a power of two
+	u32 rec_boundary;       // PIDs per CT key from which the key gets a recursive table
+	u32 pattern_interval;   // >= MIN_PATTERN_INTERVAL; larger moves the CT8 key
+	                        // of long patterns towards their start
+	u32 df_interleave;      // 1: the search tests the filters through one byte
+	                        // per key, see DFC_BuildDFBits()
+} DFC_CONFIG;
+
 typedef struct _dfc_pattern
 {
 	struct _dfc_pattern *next;
@@ -144,18 +242,109 @@ typedef struct _dfc_pattern
 	u32            *sids;      // external id (unique)
 	u32             iid;       // internal id (used in DFC library only)
 
+	int             ct8_off;   // start of the 8B DF/CT8 key (n >= 8), see DFC_PickCT8Keys()
+
 } DFC_PATTERN;
 
+/* What confirming a candidate reads, one record per pattern in the
+ * compiled store; see DFC_BuildStore() */
+typedef struct _dfc_stored_pattern
+{
+	u32             n;
+	u32             nocase;
+	u32             ct8_off;
+	unsigned char   casepatrn[];    // original pattern
+} DFC_STORED_PATTERN;
+
+
+/****************************************************/
+/*               Memory and allocators              */
+/****************************************************/
+typedef enum _dfcMemoryType
+{
+	DFC_MEMORY_TYPE__NONE = 0,
+	DFC_MEMORY_TYPE__DFC,
+	DFC_MEMORY_TYPE__PATTERN,
+	DFC_MEMORY_TYPE__CT1,
+	DFC_MEMORY_TYPE__CT2,
+	DFC_MEMORY_TYPE__CT3,
+	DFC_MEMORY_TYPE__CT4,
+	DFC_MEMORY_TYPE__CT8,
+	DFC_MEMORY_TYPE__RECURSIVE,  // flattened recursive tables
+	DFC_MEMORY_TYPE__PID,        // PID pool shared by the flattened CTs
+	DFC_MEMORY_TYPE__MAX
+} dfcMemoryType;
+
+/* Live heap usage, see DFC_GetMemoryStats() */
+typedef struct _dfc_memory_stats
+{
+	u64 bytes[DFC_MEMORY_TYPE__MAX];    // bytes currently allocated
+	u64 allocs[DFC_MEMORY_TYPE__MAX];   // allocations currently live
+	u64 total_bytes;
+	u64 total_allocs;
+} DFC_MEMORY_STATS;
+
+/* Allocator hooks. old_size/size passed to realloc_fn and free_fn are the
+ * block sizes from the matching malloc_fn/realloc_fn call. If release_fn
+ * is set, DFC_Free does not free blocks one by one but calls release_fn
+ * once, which must drop everything allocated through this allocator.
+ * Every block goes through these hooks, except that an instance on a
+ * DFC_ArenaAllocator arena keeps its compile-only data in a second arena
+ * of its own, see DFC_ScratchNew(). */
+typedef struct _dfc_allocator
+{
+	void *(*malloc_fn)(void *ctx, size_t size);
+	void *(*realloc_fn)(void *ctx, void *ptr, size_t old_size, size_t size);
+	void (*free_fn)(void *ctx, void *ptr, size_t size);
+	void (*release_fn)(void *ctx);
+	void *ctx;
+} DFC_ALLOCATOR;
+/****************************************************/
 
+/*
+*  Once DFC_Compile returns nothing in here is written again until DFC_Free:
+*  the searches take it const and keep their state on the stack, in a
+*  DFC_STREAM_STATE or in a DFC_CONTEXT. One compiled instance can thus be
+*  searched by any number of threads at once.
+*/
 typedef struct
 {
-	DFC_PATTERN   ** init_hash; // To cull duplicate patterns
-	DFC_PATTERN    * dfcPatterns;
+	DFC_ALLOCATOR      allocator;
+	DFC_MEMORY_STATS   mem;     // this instance's share of DFC_GetMemoryStats()
+
+	/* Arena for what only lives until DFC_Compile returns when allocator
+	 * is an arena, used while scratch_on is set, see DFC_ScratchNew() */
+	DFC_ALLOCATOR      scratch;
+	int                scratch_on;
+
+	DFC_PATTERN   ** init_hash; // To cull duplicate patterns, open addressing
+	u32              init_hash_mask;
+	DFC_PATTERN    * dfcPatterns;   // in insertion (iid) order
+	DFC_PATTERN    * lastPattern;   // tail of dfcPatterns while adding
 	DFC_PATTERN   ** dfcMatchList;
 
 	int          numPatterns;
+	int          maxPatternLen;
+
+	/* Keys are built from case-folded bytes, see DFC_SetNocaseFolding() */
+	int          fold;
+
+	/* Byte-pair counts of the traffic sample, only kept until DFC_Compile,
+	 * see DFC_AddTrafficSample() */
+	u32         *pair_freq;
+
+	/* Geometry; df_bits and rec_ct_size are resolved by DFC_Compile */
+	DFC_CONFIG   config;
+	u32          df_mask;   // (1 << df_bits) - 1
+	u32          rec_mask;  // rec_ct_size - 1
+
+	/* Threads DFC_Compile uses, see DFC_SetCompileThreads() */
+	int          compile_threads;
+	/* Serializes a custom allocator while compile threads run */
+	pthread_mutex_t *alloc_lock;
 
-	/* Direct Filter (DF1) for all patterns */
+	/* Direct Filter (DF1) for all patterns; only the first DFC_DFBytes()
+	 * bytes of each filter are used, see DFC_DFKey() */
 	u8 DirectFilter1[DF_SIZE_REAL];
 
 	u8 cDF0[256];
@@ -168,32 +357,53 @@ typedef struct
 	u8 ADD_DF_8_1[DF_SIZE_REAL];
 	u8 ADD_DF_8_2[DF_SIZE_REAL];
 
-	/* Compact Table (CT1) for 1B patterns */
-	CT_Type_1 CompactTable1[CT1_TABLE_SIZE];
+	/* With config.df_interleave, DFB_* bits of every key: one load answers
+	 * all the filters tested with that key. NULL otherwise. */
+	u8 *DFBits;
+
+	/* Compact Table (CT1) for 1B patterns, pid is NULL if there are none */
+	CT_Type_1 CompactTable1;
 
 	/* Compact Table (CT2) for 2B patterns */
-	CT_Type_2 CompactTable2[CT2_TABLE_SIZE];
+	CT_Type_2 *CompactTable2;
 
 	/* Compact Table (CT4) for 4B ~ 7B patterns */
-	CT_Type_2 CompactTable4[CT4_TABLE_SIZE];
+	CT_Type_2 *CompactTable4;
 
 	/* Compact Table (CT8) for 8B ~ patterns */
-	CT_Type_2_8B CompactTable8[CT8_TABLE_SIZE];
+	CT_Type_2_8B *CompactTable8;
+
+	/* Flattened CT2/CT4/CT8 used by the search; the tables above are
+	 * only allocated while DFC_Compile runs, with CTx.mask + 1 buckets */
+	CT_Flat CT2;
+	CT_Flat CT4;
+	CT_Flat_8B CT8;
+	CT_Flat_Rec RecCT;
+
+	u32 PIDPoolCnt;
+	u32 *PIDPool;
+
+	/* Compiled pattern store the verification reads instead of dfcMatchList,
+	 * see DFC_BuildStore(): the record of iid is at PatternStore +
+	 * store_off[iid], its sids are SIDPool[sid_start[iid] .. sid_start[iid + 1]).
+	 * casepatrn and sids of the DFC_PATTERNs point in here once it is built */
+	u8  *PatternStore;      // 64-byte aligned inside store_mem
+	void *store_mem;
+	u32 store_size;
+	u32 *store_off;         // numPatterns + 1 entries, the last is store_size
+	u32 *SIDPool;
+	u32 *sid_start;
+
+	/* Set when the tables and the pattern store point into a blob, see
+	 * DFC_Deserialize(). Only DFBits and what DFC_GetPattern builds into
+	 * dfcMatchList are owned then; blob_map_size is set if DFC_LoadFile
+	 * mapped the blob and DFC_Free unmaps it. */
+	const void *blob;
+	size_t blob_map_size;
 
 } DFC_STRUCTURE;
 
 /****************************************************/
-typedef enum _dfcMemoryType
-{
-	DFC_MEMORY_TYPE__NONE = 0,
-	DFC_MEMORY_TYPE__DFC,
-	DFC_MEMORY_TYPE__PATTERN,
-	DFC_MEMORY_TYPE__CT1,
-	DFC_MEMORY_TYPE__CT2,
-	DFC_MEMORY_TYPE__CT3,
-	DFC_MEMORY_TYPE__CT4,
-	DFC_MEMORY_TYPE__CT8
-} dfcMemoryType;
 
 typedef enum _dfcDataType
 {
@@ -203,15 +413,230 @@ typedef enum _dfcDataType
 	DFC_CT_Type_2_2B_Array,
 	DFC_CT_Type_2_8B_Array
 } dfcDataType;
+
+/****************************************************/
+
+/****************************************************/
+/*         Candidate buffer (two-phase search)      */
+/****************************************************/
+#define DFC_CAND_MAX    256
+
+/* Which filter a candidate passed, i.e. which CT verifies it */
+typedef enum _dfcCandType
+{
+	DFC_CAND_CT1 = 0,   // cDF0
+	DFC_CAND_CT2,       // cDF1
+	DFC_CAND_CT4,       // ADD_DF_4_1
+	DFC_CAND_CT8,       // ADD_DF_8_1 and ADD_DF_8_2
+	DFC_CAND_TYPES
+} dfcCandType;
+
+typedef struct _dfc_candidates
+{
+	u32 total;
+	u32 cnt[DFC_CAND_TYPES];
+	u32 pos[DFC_CAND_TYPES][DFC_CAND_MAX];  // offset of the DF1 window
+	u32 bucket[DFC_CAND_MAX];               // CT4/CT8 bucket of each candidate
+} DFC_CANDIDATES;
+
+/* One match from DFC_SearchBatch; see DFC_GetPattern for the sids */
+typedef struct _dfc_match_record
+{
+	u32 offset;     // start of the match in buf
+	u32 iid;        // internal pattern id
+} DFC_MATCH_RECORD;
+
+/* Where the verification reports matches: Match, MatchOffset with the
+ * match start relative to buf and the pattern length, MatchStream with
+ * the start as a stream offset (base + start - buf), or rec */
+typedef struct _dfc_sink
+{
+	void (*Match)(void*, unsigned char *, u32 *, u32);
+	void (*MatchOffset)(void*, unsigned char *, u32 *, u32, u32, u32);
+	void (*MatchStream)(void*, unsigned char *, u32 *, u32, u64, u32);
+	void *r;
+	const unsigned char *buf;
+	u64 base;
+	u32 span;       // if set, only matches covering buf[span - 1] and buf[span]
+
+	DFC_MATCH_RECORD *rec;
+	u32 rec_cnt;
+	u32 rec_max;
+	int full;       // a record did not fit into rec
+	int resume;     // window to restart from once full
+} DFC_SINK;
+
+/* Per-stream carry for DFC_SearchStream, see DFC_StreamNew */
+typedef struct _dfc_stream_state
+{
+	u64 offset;             // stream offset of the next segment
+	u32 keep;               // longest pattern - 1
+	u32 carry_len;          // valid bytes in carry
+	unsigned char *carry;   // last carry_len bytes of the stream
+	unsigned char *stitch;  // carry + head of the next segment
+} DFC_STREAM_STATE;
+
+/* Counters of one DFC_CONTEXT */
+typedef struct _dfc_search_stats
+{
+	u64 searches;
+	u64 bytes;
+	u64 matches;
+} DFC_SEARCH_STATS;
+
+/* Per-thread state for searching a shared compiled DFC: the two-phase
+ * candidate buffer and counters only the owning thread writes. Cache line
+ * aligned and sized, so contexts of different threads never share a line. */
+typedef struct _dfc_context
+{
+	DFC_SEARCH_STATS stats;
+	DFC_CANDIDATES cand;
+} __attribute__((aligned(64))) DFC_CONTEXT;
+
+/****************************************************/
+/*          Compiled DFC blob (DFC_Serialize)       */
+/****************************************************/
+#define DFC_BLOB_MAGIC        0x31434644  // "DFC1"
+#define DFC_BLOB_VERSION      7
+#define DFC_BLOB_BYTE_ORDER   0x01020304
+#define DFC_BLOB_ALIGN        64
+
+typedef enum _dfcBlobSection
+{
+	DFC_BLOB_FILTERS = 0,   // DF1, cDF0-2, ADD_DF_*, in struct order
+	DFC_BLOB_CT1_PID,
+	DFC_BLOB_CT2_BUCKET,
+	DFC_BLOB_CT2_ENTRY,
+	DFC_BLOB_CT4_BUCKET,
+	DFC_BLOB_CT4_ENTRY,
+	DFC_BLOB_CT8_BUCKET,
+	DFC_BLOB_CT8_ENTRY,
+	DFC_BLOB_REC_DF,
+	DFC_BLOB_REC_BUCKET,
+	DFC_BLOB_REC_ENTRY,
+	DFC_BLOB_PID_POOL,
+	DFC_BLOB_STORE,         // PatternStore, searched in place
+	DFC_BLOB_STORE_OFF,
+	DFC_BLOB_SID_START,
+	DFC_BLOB_SID_POOL,
+	DFC_BLOB_SECTIONS
+} dfcBlobSection;
+
+/* Offsets are from the start of the blob, so it can be mapped anywhere */
+typedef struct _dfc_blob_section
+{
+	u64 off;
+	u64 size;
+} DFC_BLOB_SECTION;
+
+typedef struct _dfc_blob_header
+{
+	u32 magic;
+	u32 version;
+	u32 byte_order;
+	u32 df_size;            // DF_SIZE_REAL of the writer
+	u32 df_bits;            // DFC_CONFIG of the instance
+	u32 rec_ct_size;
+	u32 pattern_interval;
+	u32 df_interleave;
+	u32 fold;
+	u32 numPatterns;
+	u32 maxPatternLen;
+	u32 ct2_mask;
+	u32 ct4_mask;
+	u32 ct8_mask;
+	u32 ct2_entries;
+	u32 ct4_entries;
+	u32 ct8_entries;
+	u32 rec_cnt;
+	u32 rec_entries;
+	u32 pid_cnt;
+	u32 ct1_start[CT1_TABLE_SIZE + 1];
+	u64 size;               // whole blob
+	DFC_BLOB_SECTION section[DFC_BLOB_SECTIONS];
+} DFC_BLOB_HEADER;
+
+/* Most threads that can be registered with one DFC_HANDLE */
+#define DFC_HANDLE_READERS_MAX    64
+
+/* Last epoch a registered reader passed a quiescent point in, 0 if the
+ * slot is free; one cache line per reader */
+typedef struct _dfc_reader
+{
+	u64 seen;
+} __attribute__((aligned(64))) DFC_READER;
+
+/* Managed rule set: readers search the current generation, writers publish
+ * a new one and free the old after a grace period, see DFC_HandleNew */
+typedef struct _dfc_handle
+{
+	DFC_STRUCTURE *current;
+	u64 epoch;                          // bumped after each publish, starts at 1
+	pthread_mutex_t publish_lock;       // one writer at a time
+
+	pthread_t updater;                  // DFC_HandleUpdate thread
+	int updating;                       // updater not joined yet
+	int update_done;                    // updater has returned, set atomically
+	DFC_STRUCTURE *next;
+	int update_ret;
+
+	DFC_READER reader[DFC_HANDLE_READERS_MAX];
+} DFC_HANDLE;
 /****************************************************/
 
 /****************************************************/
 extern DFC_STRUCTURE * DFC_New(void);
+extern DFC_STRUCTURE * DFC_NewWithAllocator(const DFC_ALLOCATOR *allocator);
+extern void DFC_ConfigDefault(DFC_CONFIG *config);
+extern DFC_STRUCTURE * DFC_NewWithConfig(const DFC_CONFIG *config, const DFC_ALLOCATOR *allocator);
 extern void DFC_Free(DFC_STRUCTURE *dfc);
 
+extern int DFC_ArenaAllocator(DFC_ALLOCATOR *allocator, size_t chunk_size);
+
+extern void DFC_GetMemoryStats(DFC_MEMORY_STATS *stats);
+extern const char *DFC_MemoryTypeName(dfcMemoryType type);
+
+extern int DFC_SetNocaseFolding(DFC_STRUCTURE *dfc, int on);
+extern int DFC_SetCompileThreads(DFC_STRUCTURE *dfc, int threads);
+extern int DFC_AddTrafficSample(DFC_STRUCTURE *dfc, const unsigned char *buf, int buflen);
+extern int DFC_SetPairFrequency(DFC_STRUCTURE *dfc, const u32 *freq);
 extern int DFC_AddPattern(DFC_STRUCTURE *dfc, unsigned char *pat, int n, int nocase, u32 sid);
 extern int DFC_Compile(DFC_STRUCTURE *dfc);
-extern int DFC_Search(DFC_STRUCTURE *dfc, unsigned char *buf, int buflen, void* r, void (*Match)(void*, unsigned char *, u32 *, u32));
+extern int DFC_Search(const DFC_STRUCTURE *dfc, unsigned char *buf, int buflen, void* r, void (*Match)(void*, unsigned char *, u32 *, u32));
+extern int DFC_SearchTwoPhase(const DFC_STRUCTURE *dfc, unsigned char *buf, int buflen, void* r, void (*Match)(void*, unsigned char *, u32 *, u32));
+extern int DFC_SearchOffsets(const DFC_STRUCTURE *dfc, unsigned char *buf, int buflen, void* r,
+							 void (*Match)(void*, unsigned char *, u32 *, u32, u32 offset, u32 len));
+extern int DFC_SearchBatch(const DFC_STRUCTURE *dfc, unsigned char *buf, int buflen, int *pos, DFC_MATCH_RECORD *out, int out_size);
+extern DFC_PATTERN *DFC_GetPattern(const DFC_STRUCTURE *dfc, u32 iid);
+
+extern DFC_STREAM_STATE *DFC_StreamNew(const DFC_STRUCTURE *dfc);
+extern void DFC_StreamReset(DFC_STREAM_STATE *state);
+extern void DFC_StreamFree(DFC_STREAM_STATE *state);
+extern int DFC_SearchStream(const DFC_STRUCTURE *dfc, DFC_STREAM_STATE *state, unsigned char *buf, int buflen, void* r,
+							void (*Match)(void*, unsigned char *, u32 *, u32, u64 offset, u32 len));
+
+extern DFC_CONTEXT *DFC_ContextNew(void);
+extern void DFC_ContextFree(DFC_CONTEXT *ctx);
+extern int DFC_SearchCtx(const DFC_STRUCTURE *dfc, DFC_CONTEXT *ctx, unsigned char *buf, int buflen, void* r,
+						 void (*Match)(void*, unsigned char *, u32 *, u32));
+extern int DFC_SearchTwoPhaseCtx(const DFC_STRUCTURE *dfc, DFC_CONTEXT *ctx, unsigned char *buf, int buflen, void* r,
+								 void (*Match)(void*, unsigned char *, u32 *, u32));
+
+extern size_t DFC_SerializedSize(const DFC_STRUCTURE *dfc);
+extern int DFC_Serialize(const DFC_STRUCTURE *dfc, void *out, size_t out_size);
+extern DFC_STRUCTURE *DFC_Deserialize(const void *blob, size_t size);
+extern int DFC_SaveFile(const DFC_STRUCTURE *dfc, const char *path);
+extern DFC_STRUCTURE *DFC_LoadFile(const char *path);
+
+extern DFC_HANDLE *DFC_HandleNew(DFC_STRUCTURE *dfc);
+extern void DFC_HandleFree(DFC_HANDLE *h);
+extern int DFC_HandleRegister(DFC_HANDLE *h);
+extern void DFC_HandleUnregister(DFC_HANDLE *h, int slot);
+extern const DFC_STRUCTURE *DFC_HandleAcquire(DFC_HANDLE *h);
+extern void DFC_HandleQuiescent(DFC_HANDLE *h, int slot);
+extern int DFC_HandlePublish(DFC_HANDLE *h, DFC_STRUCTURE *next);
+extern int DFC_HandleUpdate(DFC_HANDLE *h, DFC_STRUCTURE *next);
+extern int DFC_HandleWaitUpdate(DFC_HANDLE *h);
 /****************************************************/
 
 #ifndef UINT32_C
@@ -219,2244 +644,5669 @@ extern int DFC_Search(DFC_STRUCTURE *dfc, unsigned char *buf, int buflen, void*
 #endif
 
 /*************************************************************************************/
-#define INIT_HASH_SIZE       65536
+#define INIT_HASH_SIZE       1024    // initial, doubles at half load
 #define RECURSIVE_BOUNDARY   5
 /*************************************************************************************/
 
 /*************************************************************************************/
-#define pattern_interval     32
-#define min_pattern_interval 32
+#define PATTERN_INTERVAL     32
+#define MIN_PATTERN_INTERVAL 32
 /*************************************************************************************/
 
 static unsigned char xlatcase[256];
 
-static int my_free(void *ptr)
+/* Bit of a 2B key in a direct filter. Filters smaller than DF_SIZE fold
+ * the high bits of the key into the low ones. */
+static inline u32 DFC_DFKey(const DFC_STRUCTURE *dfc, u32 data)
 {
-	if (ptr)
-	{
-		free(ptr);
-	}
-
-	return 0;
+	return (data ^ (data >> dfc->config.df_bits)) & dfc->df_mask;
 }
 
-static void *my_malloc(int size)
+/* Bytes of a direct filter that DFC_DFKey() can reach */
+static inline u32 DFC_DFBytes(const DFC_STRUCTURE *dfc)
 {
-	return malloc(size);
+	return (dfc->df_mask >> 3) + 1;
 }
 
-static void *my_zalloc(int size)
+/* Offset of the 8B CT8 key in a pattern of n >= 8 bytes when there is no
+ * traffic sample to pick it from */
+static inline int DFC_CT8DefaultOffset(const DFC_STRUCTURE *dfc, int n)
 {
-	void *p_new = NULL;
+	return MIN_PATTERN_INTERVAL * (n - 8) / (int)dfc->config.pattern_interval;
+}
 
-	p_new = malloc(size);
-	if (!p_new)
-	{
-		return NULL;
-	}
+/* How many candidates ahead DFC_VerifyCandidates prefetches CT4/CT8 buckets (0: off) */
+#define DFC_PREFETCH_DIST    8
+static u32 dfc_prefetch_dist = DFC_PREFETCH_DIST;
 
-	memset(p_new, 0, size);
+/* Upper bound for DFC_SetCompileThreads() */
+#define DFC_COMPILE_THREADS_MAX    64
 
-	return p_new;
+/****************************************************/
+/*          Allocation with per-type accounting     */
+/****************************************************/
+/* Every block carries its size and type in front, so frees and reallocs
+ * can be charged back to the right counters */
+typedef struct _dfc_mem_header
+{
+	size_t size;
+	dfcMemoryType type;
+	int scratch;        // from dfc->scratch, see DFC_ScratchNew
+} __attribute__((aligned(16))) DFC_MEM_HEADER;
+
+static DFC_MEMORY_STATS dfc_memory_stats;
+
+static void *libc_malloc(void *ctx, size_t size)
+{
+	return malloc(size);
 }
 
-static void *my_realloc(void *ptr, size_t size)
+static void *libc_realloc(void *ctx, void *ptr, size_t old_size, size_t size)
 {
 	return realloc(ptr, size);
 }
 
-static inline int my_strncmp(unsigned char *a, unsigned char *b, int n)
+static void libc_free(void *ctx, void *ptr, size_t size)
 {
-	int i;
-	for (i = 0; i < n ; i++)
+	free(ptr);
+}
+
+static const DFC_ALLOCATOR dfc_libc_allocator =
+{
+	libc_malloc, libc_realloc, libc_free, NULL, NULL
+};
+
+static void my_account(DFC_STRUCTURE *dfc, dfcMemoryType type, long long bytes, int allocs)
+{
+	/* Compile threads share the counters */
+	__atomic_add_fetch(&dfc->mem.bytes[type], bytes, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&dfc->mem.allocs[type], allocs, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&dfc_memory_stats.bytes[type], bytes, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&dfc_memory_stats.allocs[type], allocs, __ATOMIC_RELAXED);
+}
+
+/* lock is dfc->alloc_lock, NULL outside a parallel DFC_Compile */
+static inline void my_lock(pthread_mutex_t *lock)
+{
+	if (lock != NULL)
 	{
-		if (a[i] != b[i])
-		{
-			return -1;
-		}
+		pthread_mutex_lock(lock);
 	}
-	return 0;
 }
 
-static inline int my_strncasecmp(unsigned char *a, unsigned char *b, int n)
+static inline void my_unlock(pthread_mutex_t *lock)
 {
-	int i;
-	for (i = 0; i < n ; i++)
+	if (lock != NULL)
 	{
-		if (tolower(a[i]) != tolower(b[i]))
-		{
-			return -1;
-		}
+		pthread_mutex_unlock(lock);
 	}
-	return 0;
 }
 
-static u32 my_crc32_u8(u32 prevcrc, u8 v)
+/* Raw block with header, not yet accounted */
+static void *my_alloc_block(const DFC_ALLOCATOR *a, size_t size, dfcMemoryType type)
 {
-	int bit;
+	DFC_MEM_HEADER *h = (DFC_MEM_HEADER *)a->malloc_fn(a->ctx, sizeof(DFC_MEM_HEADER) + size);
+	if (!h)
+	{
+		return NULL;
+	}
 
-	u32 crc = prevcrc;
-	crc ^= v;
+	h->size = size;
+	h->type = type;
+	h->scratch = 0;
 
-	for (bit = 0 ; bit < 8 ; bit++)
+	return h + 1;
+}
+
+static int my_free(DFC_STRUCTURE *dfc, void *ptr)
+{
+	if (ptr)
 	{
-		if (crc & 1)
-		{
-			crc = (crc >> 1) ^ UINT32_C(0x82f63b78);
-		}
-		else
-		{
-			crc = (crc >> 1);
-		}
+		DFC_MEM_HEADER *h = (DFC_MEM_HEADER *)ptr - 1;
+		DFC_ALLOCATOR a = h->scratch ? dfc->scratch : dfc->allocator;
+		pthread_mutex_t *lock = dfc->alloc_lock;   // ptr may be dfc itself
+
+		my_account(dfc, h->type, -(long long)h->size, -1);
+		my_lock(lock);
+		a.free_fn(a.ctx, h, sizeof(DFC_MEM_HEADER) + h->size);
+		my_unlock(lock);
 	}
-	return crc;
+
+	return 0;
 }
 
-static u32 my_crc32_u16(u32 prevcrc, u16 v)
+static void *my_malloc(DFC_STRUCTURE *dfc, size_t size, dfcMemoryType type)
 {
-	u32 crc = prevcrc;
-	crc = my_crc32_u8(crc, v & 0xff);
-	crc = my_crc32_u8(crc, (v >> 8) & 0xff);
-	return crc;
+	int scratch = dfc->scratch_on && dfc->scratch.malloc_fn != NULL;
+	void *p_new;
+
+	my_lock(dfc->alloc_lock);
+	p_new = my_alloc_block(scratch ? &dfc->scratch : &dfc->allocator, size, type);
+	my_unlock(dfc->alloc_lock);
+	if (!p_new)
+	{
+		return NULL;
+	}
+
+	((DFC_MEM_HEADER *)p_new - 1)->scratch = scratch;
+
+	my_account(dfc, type, size, 1);
+
+	return p_new;
 }
 
-static u32 my_crc32_u32(u32 prevcrc, u32 v)
+static void *my_zalloc(DFC_STRUCTURE *dfc, size_t size, dfcMemoryType type)
 {
-	u32 crc = prevcrc;
-	crc = my_crc32_u16(crc, v & 0xffff);
-	crc = my_crc32_u16(crc, (v >> 16) & 0xffff);
-	return crc;
-}
+	void *p_new = NULL;
+
+	p_new = my_malloc(dfc, size, type);
+	if (!p_new)
+	{
+		return NULL;
+	}
 
+	memset(p_new, 0, size);
+
+	return p_new;
+}
 
-static u64 my_crc32_u64(u64 prevcrc, u64 v)
+/* For data that only lives until DFC_Compile, see DFC_ScratchNew() */
+static void *my_scratch_zalloc(DFC_STRUCTURE *dfc, size_t size, dfcMemoryType type)
 {
-	u64 crc = prevcrc;
-	crc = my_crc32_u32((u32) crc, v & 0xffffffff);
-	crc = my_crc32_u32((u32) crc, (v >> 32) & 0xffffffff);
-	return crc;
+	int on = dfc->scratch_on;
+	void *p_new;
+
+	dfc->scratch_on = 1;
+	p_new = my_zalloc(dfc, size, type);
+	dfc->scratch_on = on;
+
+	return p_new;
 }
 
-static void Build_pattern(DFC_PATTERN *p, u8 *flag, u8 *temp, u32 i, int j, int k)
+/* type is only used when ptr is NULL; otherwise the block keeps its type */
+static void *my_realloc(DFC_STRUCTURE *dfc, void *ptr, size_t size, dfcMemoryType type)
 {
-	if (p->nocase)
+	const DFC_ALLOCATOR *a;
+	DFC_MEM_HEADER *h;
+	size_t old_size;
+
+	if (ptr == NULL)
 	{
-		if ((p->patrn[j] >= 65 && p->patrn[j] <= 90) || (p->patrn[j] >= 97 && p->patrn[j] <= 122))
-		{
-			if (flag[k] == 0)
-			{
-				temp[k] = tolower(p->patrn[j]);
-			}
-			else
-			{
-				temp[k] = toupper(p->patrn[j]);
-			}
-		}
-		else
-		{
-			temp[k] = p->patrn[j];
-		}
+		return my_malloc(dfc, size, type);
 	}
-	else
+
+	h = (DFC_MEM_HEADER *)ptr - 1;
+	old_size = h->size;
+	a = h->scratch ? &dfc->scratch : &dfc->allocator;
+
+	my_lock(dfc->alloc_lock);
+	h = (DFC_MEM_HEADER *)a->realloc_fn(a->ctx, h, sizeof(DFC_MEM_HEADER) + old_size, sizeof(DFC_MEM_HEADER) + size);
+	my_unlock(dfc->alloc_lock);
+	if (!h)
 	{
-		temp[k] = p->casepatrn[j]; // original pattern
+		return NULL;
 	}
 
-	return ;
+	h->size = size;
+	my_account(dfc, h->type, (long long)size - (long long)old_size, 0);
+
+	return h + 1;
 }
 
-DFC_STRUCTURE * DFC_New(void)
+/****************************************************/
+/*                   Arena allocator                */
+/****************************************************/
+#define DFC_ARENA_CHUNK_SIZE    (1 << 20)
+#define DFC_ARENA_ALIGN         16
+
+typedef struct _dfc_arena_chunk
 {
-	DFC_STRUCTURE * p;
+	struct _dfc_arena_chunk *next;
+	size_t size;
+	size_t used;
+} __attribute__((aligned(DFC_ARENA_ALIGN))) DFC_ARENA_CHUNK;
 
-	int i;
-	for (i = 0; i < 256; i++)
-	{
-		xlatcase[i] = (unsigned char)toupper(i);
-	}
+typedef struct _dfc_arena
+{
+	DFC_ARENA_CHUNK *head;
+	size_t chunk_size;
+} DFC_ARENA;
 
-	p = (DFC_STRUCTURE *)my_malloc(sizeof(DFC_STRUCTURE));
-	if (p)
+#define DFC_ARENA_ROUND(x)    (((x) + DFC_ARENA_ALIGN - 1) & ~((size_t)DFC_ARENA_ALIGN - 1))
+
+static void *arena_malloc(void *ctx, size_t size)
+{
+	DFC_ARENA *arena = (DFC_ARENA *)ctx;
+	DFC_ARENA_CHUNK *c = arena->head;
+	void *p;
+
+	size = DFC_ARENA_ROUND(size);
+
+	if (c == NULL || c->size - c->used < size)
 	{
-		memset(p, 0, sizeof(DFC_STRUCTURE));
+		size_t chunk = arena->chunk_size > size ? arena->chunk_size : size;
 
-		p->init_hash = my_malloc(sizeof(DFC_PATTERN *) * INIT_HASH_SIZE);
-		if (p->init_hash == NULL)
+		c = (DFC_ARENA_CHUNK *)malloc(sizeof(DFC_ARENA_CHUNK) + chunk);
+		if (c == NULL)
 		{
-			my_free(p);
 			return NULL;
 		}
 
-		memset(p->init_hash, 0, sizeof(DFC_PATTERN *) * INIT_HASH_SIZE);
+		c->size = chunk;
+		c->used = 0;
+		c->next = arena->head;
+		arena->head = c;
 	}
 
+	p = (u8 *)(c + 1) + c->used;
+	c->used += size;
+
 	return p;
 }
 
-void DFC_Free(DFC_STRUCTURE *dfc)
+/* Grows in place when ptr is the last block of the current chunk */
+static void *arena_realloc(void *ctx, void *ptr, size_t old_size, size_t size)
 {
-	u32 j, l;
-	int i, k;
+	DFC_ARENA *arena = (DFC_ARENA *)ctx;
+	DFC_ARENA_CHUNK *c = arena->head;
+	void *p;
 
-	if (dfc == NULL)
+	if (c != NULL && (u8 *)ptr + DFC_ARENA_ROUND(old_size) == (u8 *)(c + 1) + c->used &&
+		c->used - DFC_ARENA_ROUND(old_size) + DFC_ARENA_ROUND(size) <= c->size)
 	{
-		return;
+		c->used = c->used - DFC_ARENA_ROUND(old_size) + DFC_ARENA_ROUND(size);
+		return ptr;
 	}
 
-	if (dfc->dfcPatterns != NULL)
+	p = arena_malloc(ctx, size);
+	if (p != NULL)
 	{
-		DFC_PATTERN *plist;
-		DFC_PATTERN *p_next;
+		memcpy(p, ptr, old_size < size ? old_size : size);
+	}
 
-		for (plist = dfc->dfcPatterns; plist != NULL;)
-		{
-			if (plist->patrn != NULL)
-			{
-				my_free(plist->patrn);
-			}
+	return p;
+}
 
-			if (plist->casepatrn != NULL)
-			{
-				my_free(plist->casepatrn);
-			}
+static void arena_free(void *ctx, void *ptr, size_t size)
+{
+	/* released all at once by arena_release */
+}
 
-			if (plist->sids != NULL)
-			{
-				my_free(plist->sids);
-			}
+static void arena_release(void *ctx)
+{
+	DFC_ARENA *arena = (DFC_ARENA *)ctx;
+	DFC_ARENA_CHUNK *c = arena->head;
 
-			p_next = plist->next;
-			my_free(plist);
-			plist = p_next;
-		}
+	while (c != NULL)
+	{
+		DFC_ARENA_CHUNK *next = c->next;
+		free(c);
+		c = next;
 	}
 
-	if (dfc->dfcMatchList != NULL)
+	free(arena);
+}
+
+/*
+*  Set up a bump allocator for DFC_NewWithAllocator. Blocks are never freed
+*  individually; DFC_Free releases the whole arena (and the instance) at once,
+*  so a filled-in allocator may back only one instance. The build tables of
+*  DFC_Compile come from a scratch arena of the same chunk size that is
+*  released when DFC_Compile returns, so only what the search uses stays.
+*
+* \param allocator   Filled in with the arena hooks
+* \param chunk_size  Size of each arena chunk, 0 for the default (1MB)
+*
+* \retval  0 On success.
+* \retval -1 Out of memory.
+*/
+int DFC_ArenaAllocator(DFC_ALLOCATOR *allocator, size_t chunk_size)
+{
+	DFC_ARENA *arena = (DFC_ARENA *)malloc(sizeof(DFC_ARENA));
+	if (arena == NULL)
 	{
-		my_free(dfc->dfcMatchList);
+		return -1;
 	}
 
-	for (i = 0; i < CT2_TABLE_SIZE; i++)
-	{
-		for (j = 0; j < dfc->CompactTable2[i].cnt; j++)
-		{
-			my_free(dfc->CompactTable2[i].array[j].pid);
+	arena->head = NULL;
+	arena->chunk_size = chunk_size ? chunk_size : DFC_ARENA_CHUNK_SIZE;
 
-			if (dfc->CompactTable2[i].array[j].DirectFilter != NULL)
-			{
-				my_free(dfc->CompactTable2[i].array[j].DirectFilter);
-			}
+	allocator->malloc_fn = arena_malloc;
+	allocator->realloc_fn = arena_realloc;
+	allocator->free_fn = arena_free;
+	allocator->release_fn = arena_release;
+	allocator->ctx = arena;
 
-			if (dfc->CompactTable2[i].array[j].CompactTable != NULL)
-			{
-				for (k = 0; k < RECURSIVE_CT_SIZE; k++)
-				{
-					for (l = 0; l < dfc->CompactTable2[i].array[j].CompactTable[k].cnt; l++)
-					{
-						my_free(dfc->CompactTable2[i].array[j].CompactTable[k].array[l].pid);
-					}
-					my_free(dfc->CompactTable2[i].array[j].CompactTable[k].array);
-				}
-				my_free(dfc->CompactTable2[i].array[j].CompactTable);
-			}
-		}
+	return 0;
+}
 
-		my_free(dfc->CompactTable2[i].array);
+/* Scratch arena for init_hash, pair_freq and the DFC_Compile build tables
+ * of an instance on a DFC_ArenaAllocator arena, whose frees are no-ops.
+ * Other allocators free them one by one through their own hooks and get
+ * no scratch arena. Released at the end of DFC_Compile, or by DFC_Free
+ * if never compiled */
+static int DFC_ScratchNew(DFC_STRUCTURE *dfc)
+{
+	if (dfc->allocator.malloc_fn != arena_malloc)
+	{
+		return 0;
 	}
 
-	for (i = 0; i < CT4_TABLE_SIZE; i++)
+	return DFC_ArenaAllocator(&dfc->scratch, ((DFC_ARENA *)dfc->allocator.ctx)->chunk_size);
+}
+
+/* Every scratch block must have been my_free()d */
+static void DFC_ScratchRelease(DFC_STRUCTURE *dfc)
+{
+	if (dfc->scratch.release_fn != NULL)
 	{
-		for (j = 0; j < dfc->CompactTable4[i].cnt; j++)
-		{
-			my_free(dfc->CompactTable4[i].array[j].pid);
+		dfc->scratch.release_fn(dfc->scratch.ctx);
+	}
 
-			if (dfc->CompactTable4[i].array[j].DirectFilter != NULL)
-			{
-				my_free(dfc->CompactTable4[i].array[j].DirectFilter);
-			}
+	memset(&dfc->scratch, 0, sizeof(DFC_ALLOCATOR));
+	dfc->scratch_on = 0;
+}
 
-			if (dfc->CompactTable4[i].array[j].CompactTable != NULL)
-			{
-				for (k = 0; k < RECURSIVE_CT_SIZE; k++)
-				{
-					for (l = 0; l < dfc->CompactTable4[i].array[j].CompactTable[k].cnt; l++)
-					{
-						my_free(dfc->CompactTable4[i].array[j].CompactTable[k].array[l].pid);
-					}
-					my_free(dfc->CompactTable4[i].array[j].CompactTable[k].array);
-				}
-				my_free(dfc->CompactTable4[i].array[j].CompactTable);
-			}
-		}
+void DFC_GetMemoryStats(DFC_MEMORY_STATS *stats)
+{
+	int i;
 
-		my_free(dfc->CompactTable4[i].array);
+	*stats = dfc_memory_stats;
+
+	stats->total_bytes = 0;
+	stats->total_allocs = 0;
+	for (i = 0; i < DFC_MEMORY_TYPE__MAX; i++)
+	{
+		stats->total_bytes += stats->bytes[i];
+		stats->total_allocs += stats->allocs[i];
 	}
+}
 
-	for (i = 0; i < CT8_TABLE_SIZE; i++)
+const char *DFC_MemoryTypeName(dfcMemoryType type)
+{
+	static const char *names[DFC_MEMORY_TYPE__MAX] =
 	{
-		for (j = 0; j < dfc->CompactTable8[i].cnt; j++)
-		{
-			my_free(dfc->CompactTable8[i].array[j].pid);
+		"none", "dfc", "pattern", "ct1", "ct2", "ct3", "ct4", "ct8", "recursive", "pid"
+	};
 
-			if (dfc->CompactTable8[i].array[j].DirectFilter != NULL)
+	if (type >= DFC_MEMORY_TYPE__MAX)
+	{
+		return "unknown";
+	}
+
+	return names[type];
+}
+
+/****************************************************/
+/*              Case folding (SWAR)                 */
+/****************************************************/
+/* Upper-cases the ASCII letters in 8 packed bytes, same as xlatcase[] on each */
+static inline u64 DFC_FoldCase(u64 x)
+{
+	u64 h = x & 0x7f7f7f7f7f7f7f7fULL;
+	u64 ge_a = h + 0x1f1f1f1f1f1f1f1fULL;    // high bit set if >= 'a'
+	u64 gt_z = h + 0x0505050505050505ULL;    // high bit set if > 'z'
+	u64 lower = ge_a & ~gt_z & ~x & 0x8080808080808080ULL;
+
+	return x ^ (lower >> 2);
+}
+
+/* Filter/table key at p, folded if the instance was compiled with folding */
+static inline u16 DFC_Load16(const DFC_STRUCTURE *dfc, const unsigned char *p)
+{
+	u16 v = *(u16*)p;
+	return dfc->fold ? (u16)DFC_FoldCase(v) : v;
+}
+
+static inline u32 DFC_Load32(const DFC_STRUCTURE *dfc, const unsigned char *p)
+{
+	u32 v = *(u32*)p;
+	return dfc->fold ? (u32)DFC_FoldCase(v) : v;
+}
+
+/****************************************************/
+/*   CRC32C: SSE4.2 if available, otherwise table   */
+/****************************************************/
+static u32 crc32c_table[256];
+
+static u32 sw_crc32_u8(u32 prevcrc, u8 v)
+{
+	return (prevcrc >> 8) ^ crc32c_table[(prevcrc ^ v) & 0xff];
+}
+
+static u32 sw_crc32_u16(u32 prevcrc, u16 v)
+{
+	u32 crc = prevcrc;
+	crc = sw_crc32_u8(crc, v & 0xff);
+	crc = sw_crc32_u8(crc, (v >> 8) & 0xff);
+	return crc;
+}
+
+static u32 sw_crc32_u32(u32 prevcrc, u32 v)
+{
+	u32 crc = prevcrc;
+	crc = sw_crc32_u16(crc, v & 0xffff);
+	crc = sw_crc32_u16(crc, (v >> 16) & 0xffff);
+	return crc;
+}
+
+static u64 sw_crc32_u64(u64 prevcrc, u64 v)
+{
+	u64 crc = prevcrc;
+	crc = sw_crc32_u32((u32) crc, v & 0xffffffff);
+	crc = sw_crc32_u32((u32) crc, (v >> 32) & 0xffffffff);
+	return crc;
+}
+
+#ifdef DFC_X86
+__attribute__((target("sse4.2")))
+static u32 hw_crc32_u16(u32 prevcrc, u16 v)
+{
+	return _mm_crc32_u16(prevcrc, v);
+}
+
+__attribute__((target("sse4.2")))
+static u32 hw_crc32_u32(u32 prevcrc, u32 v)
+{
+	return _mm_crc32_u32(prevcrc, v);
+}
+
+__attribute__((target("sse4.2")))
+static u64 hw_crc32_u64(u64 prevcrc, u64 v)
+{
+#ifdef __x86_64__
+	return _mm_crc32_u64(prevcrc, v);
+#else
+	u32 crc = _mm_crc32_u32((u32) prevcrc, v & 0xffffffff);
+	return _mm_crc32_u32(crc, (v >> 32) & 0xffffffff);
+#endif
+}
+#endif
+
+/* Both paths use the Castagnoli polynomial, so tables compiled with one
+ * are valid for the other. Selected once by DFC_InitCRC32(). */
+static u32 (*my_crc32_u16)(u32 prevcrc, u16 v) = sw_crc32_u16;
+static u32 (*my_crc32_u32)(u32 prevcrc, u32 v) = sw_crc32_u32;
+static u64 (*my_crc32_u64)(u64 prevcrc, u64 v) = sw_crc32_u64;
+
+static void DFC_InitCRC32(void)
+{
+	u32 i, bit, crc;
+
+	for (i = 0; i < 256; i++)
+	{
+		crc = i;
+		for (bit = 0 ; bit < 8 ; bit++)
+		{
+			if (crc & 1)
 			{
-				my_free(dfc->CompactTable8[i].array[j].DirectFilter);
+				crc = (crc >> 1) ^ UINT32_C(0x82f63b78);
 			}
-
-			if (dfc->CompactTable8[i].array[j].CompactTable != NULL)
+			else
 			{
-				for (k = 0; k < RECURSIVE_CT_SIZE; k++)
-				{
-					for (l = 0; l < dfc->CompactTable8[i].array[j].CompactTable[k].cnt; l++)
-					{
-						my_free(dfc->CompactTable8[i].array[j].CompactTable[k].array[l].pid);
-					}
-					my_free(dfc->CompactTable8[i].array[j].CompactTable[k].array);
-				}
-				my_free(dfc->CompactTable8[i].array[j].CompactTable);
+				crc = (crc >> 1);
 			}
 		}
+		crc32c_table[i] = crc;
+	}
 
-		my_free(dfc->CompactTable8[i].array);
+	my_crc32_u16 = sw_crc32_u16;
+	my_crc32_u32 = sw_crc32_u32;
+	my_crc32_u64 = sw_crc32_u64;
+
+#ifdef DFC_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("sse4.2"))
+	{
+		my_crc32_u16 = hw_crc32_u16;
+		my_crc32_u32 = hw_crc32_u32;
+		my_crc32_u64 = hw_crc32_u64;
 	}
+#endif
+}
 
-	my_free(dfc);
+/****************************************************/
+/*        DF1 scan: AVX-512 / AVX2 front end        */
+/****************************************************/
+/* Tests DFC_SCAN_BLOCK consecutive 2B windows against DirectFilter1 and
+ * returns a bitmask of the positions that hit. Reads DFC_SCAN_BLOCK + 1
+ * bytes from buf. The DF is fetched as u32 words, so bit (data & 31) of
+ * word (data >> 5) is the same bit as BMASK(data) of byte BINDEX(data).
+ * With fold set the input bytes are upper-cased first, like DFC_Load16(),
+ * and filters of df_bits < DF_BITS are indexed like DFC_DFKey(). */
+#define DFC_SCAN_BLOCK    32
+
+#ifdef DFC_X86
+/* 'a'..'z' -> 'A'..'Z' on 16 bytes */
+static inline __m128i dfc_fold_epi8(__m128i v)
+{
+	__m128i lower = _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8('a' - 1)), _mm_cmplt_epi8(v, _mm_set1_epi8('z' + 1)));
+	return _mm_sub_epi8(v, _mm_and_si128(lower, _mm_set1_epi8(0x20)));
 }
 
-static inline u32 DFC_InitHashRaw(u8 *pat, u16 patlen, int nocase)
+__attribute__((target("avx2")))
+static u32 avx2_scan_df1(const u8 *DirectFilter, const u8 *buf, int fold, u32 df_bits)
 {
-	u32 hash  = 0;
-	int i;
+	const __m256i low5 = _mm256_set1_epi32(31);
+	const __m256i df_mask = _mm256_set1_epi32((1 << df_bits) - 1);
+	const __m128i df_shift = _mm_cvtsi32_si128(df_bits);
+	u32 cand = 0;
+	int g;
 
-	for (i = 0; i < patlen; i++)
+	for (g = 0; g < DFC_SCAN_BLOCK; g += 8)
 	{
-		hash += pat[i];
-	}
+		__m128i b0 = _mm_loadl_epi64((const __m128i *)(buf + g));
+		__m128i b1 = _mm_loadl_epi64((const __m128i *)(buf + g + 1));
+		__m256i lo, hi, data, word, bit;
+
+		if (fold)
+		{
+			b0 = dfc_fold_epi8(b0);
+			b1 = dfc_fold_epi8(b1);
+		}
+
+		lo = _mm256_cvtepu8_epi32(b0);
+		hi = _mm256_cvtepu8_epi32(b1);
+		data = _mm256_or_si256(lo, _mm256_slli_epi32(hi, 8));
+		if (df_bits < DF_BITS)
+		{
+			data = _mm256_and_si256(_mm256_xor_si256(data, _mm256_srl_epi32(data, df_shift)), df_mask);
+		}
+		word = _mm256_i32gather_epi32((const int *)DirectFilter, _mm256_srli_epi32(data, 5), 4);
+		bit = _mm256_srlv_epi32(word, _mm256_and_si256(data, low5));
 
-	hash += nocase;
+		cand |= (u32)_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_slli_epi32(bit, 31))) << g;
+	}
 
-	return (hash % INIT_HASH_SIZE);
+	return cand;
 }
 
-static inline DFC_PATTERN *DFC_InitHashLookup(DFC_STRUCTURE *ctx, u8 *pat, u16 patlen, int nocase)
+__attribute__((target("avx512f")))
+static u32 avx512_scan_df1(const u8 *DirectFilter, const u8 *buf, int fold, u32 df_bits)
 {
-	u32 hash = DFC_InitHashRaw(pat, patlen, nocase);
-	DFC_PATTERN *t;
-
-	if (ctx->init_hash == NULL)
+	const __m512i low5 = _mm512_set1_epi32(31);
+	const __m512i df_mask = _mm512_set1_epi32((1 << df_bits) - 1);
+	const __m128i df_shift = _mm_cvtsi32_si128(df_bits);
+	const __m512i one = _mm512_set1_epi32(1);
+	u32 cand = 0;
+	int g;
+
+	for (g = 0; g < DFC_SCAN_BLOCK; g += 16)
 	{
-		return NULL;
-	}
+		__m128i b0 = _mm_loadu_si128((const __m128i *)(buf + g));
+		__m128i b1 = _mm_loadu_si128((const __m128i *)(buf + g + 1));
+		__m512i lo, hi, data, word, bit;
 
-	for (t = ctx->init_hash[hash]; t != NULL; t = t->next)
-	{
-		if (t->n == patlen &&
-			memcmp(t->casepatrn, pat, patlen) == 0)
+		if (fold)
 		{
-			return t;
+			b0 = dfc_fold_epi8(b0);
+			b1 = dfc_fold_epi8(b1);
+		}
+
+		lo = _mm512_cvtepu8_epi32(b0);
+		hi = _mm512_cvtepu8_epi32(b1);
+		data = _mm512_or_si512(lo, _mm512_slli_epi32(hi, 8));
+		if (df_bits < DF_BITS)
+		{
+			data = _mm512_and_si512(_mm512_xor_si512(data, _mm512_srl_epi32(data, df_shift)), df_mask);
 		}
+		word = _mm512_i32gather_epi32(_mm512_srli_epi32(data, 5), (const void *)DirectFilter, 4);
+		bit = _mm512_srlv_epi32(word, _mm512_and_si512(data, low5));
+
+		cand |= (u32)_mm512_test_epi32_mask(bit, one) << g;
 	}
 
-	return NULL;
+	return cand;
 }
+#endif
 
-static inline int DFC_InitHashAdd(DFC_STRUCTURE *ctx, DFC_PATTERN *p)
-{
-	DFC_PATTERN *tt;
-	DFC_PATTERN *t;
-	u32 hash;
+/* NULL means the scalar loop in DFC_Search is used. Selected by DFC_InitDF1Scan(). */
+static u32 (*DFC_ScanDF1)(const u8 *DirectFilter, const u8 *buf, int fold, u32 df_bits) = NULL;
 
-	hash = DFC_InitHashRaw(p->casepatrn, p->n, p->nocase);
+static void DFC_InitDF1Scan(void)
+{
+	DFC_ScanDF1 = NULL;
 
-	if (ctx->init_hash == NULL)
+#ifdef DFC_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx512f"))
 	{
-		return 0;
+		DFC_ScanDF1 = avx512_scan_df1;
 	}
-
-	if (ctx->init_hash[hash] == NULL)
+	else if (__builtin_cpu_supports("avx2"))
 	{
-		ctx->init_hash[hash] = p;
-		return 0;
+		DFC_ScanDF1 = avx2_scan_df1;
 	}
+#endif
+}
+
+/****************************************************/
+/*       Pattern confirmation: SWAR / SSE2 / AVX2   */
+/****************************************************/
+/* Compares of at least DFC_CMP_LONG bytes go through the widest kernel the
+ * CPU has; shorter ones stay inline, 8 bytes at a time. All of them return
+ * 0 on a match and -1 otherwise, and never read past a + n or b + n. */
+#define DFC_CMP_LONG    16
 
-	tt = NULL;
-	t = ctx->init_hash[hash];
+static inline int sw_strncmp(const unsigned char *a, const unsigned char *b, int n)
+{
+	u64 x, y;
 
-	/* get the list tail */
-	do
+	for (; n >= 8; a += 8, b += 8, n -= 8)
 	{
-		tt = t;
-		t = t->next;
+		memcpy(&x, a, 8);
+		memcpy(&y, b, 8);
+		if (x != y)
+		{
+			return -1;
+		}
 	}
-	while (t != NULL);
 
-	tt->next = p;
+	for (; n > 0; n--)
+	{
+		if (*a++ != *b++)
+		{
+			return -1;
+		}
+	}
 
 	return 0;
 }
 
-/*
-*  Add a pattern to the list of patterns
-*
-*
-* \param dfc    Pointer to the DFC structure
-* \param pat    Pointer to the pattern
-* \param n      Pattern length
-* \param nocase Flag for case-insensitive (0 means case-sensitive)
-* \param sid    External id
-*
-* \retval   0 On success to add new pattern.
-* \retval   1 On success to add sid.
-*/
-int DFC_AddPattern(DFC_STRUCTURE * dfc, unsigned char *pat, int n, int nocase, u32 sid)
+/* ASCII case-insensitive, same as comparing xlatcase[] of each byte */
+static inline int sw_strncasecmp(const unsigned char *a, const unsigned char *b, int n)
 {
-	DFC_PATTERN * plist = DFC_InitHashLookup(dfc, pat, n, nocase);
+	u64 x, y;
 
-	if (plist == NULL)
+	for (; n >= 8; a += 8, b += 8, n -= 8)
 	{
-		unsigned char *d;
-		int x;
-
-		plist = (DFC_PATTERN *) my_zalloc(sizeof(DFC_PATTERN));
-		if (plist == NULL)
+		memcpy(&x, a, 8);
+		memcpy(&y, b, 8);
+		if (x != y && DFC_FoldCase(x) != DFC_FoldCase(y))
 		{
 			return -1;
 		}
+	}
 
-		memset(plist, 0, sizeof(DFC_PATTERN));
-
-		plist->patrn = (unsigned char *)my_zalloc(n);
-		if (plist->patrn == NULL)
+	for (; n > 0; n--)
+	{
+		if (xlatcase[*a++] != xlatcase[*b++])
 		{
-			my_free(plist);
 			return -1;
 		}
+	}
 
-		plist->casepatrn = (unsigned char *)my_zalloc(n);
-		if (plist->casepatrn == NULL)
+	return 0;
+}
+
+#ifdef DFC_X86
+/* n >= 16: 16B blocks, the last one overlapping the previous */
+__attribute__((target("sse2")))
+static int sse2_strncmp(const unsigned char *a, const unsigned char *b, int n)
+{
+	int i = 0;
+
+	for (;;)
+	{
+		__m128i va = _mm_loadu_si128((const __m128i *)(a + i));
+		__m128i vb = _mm_loadu_si128((const __m128i *)(b + i));
+
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(va, vb)) != 0xffff)
 		{
-			my_free(plist);
-			my_free(plist->patrn);
 			return -1;
 		}
 
-		plist->sids = (u32 *) my_zalloc(sizeof(u32));
-		if (plist->sids == NULL)
+		if (i + 16 == n)
 		{
-			my_free(plist);
-			my_free(plist->patrn);
-			my_free(plist->casepatrn);
-			return -1;
+			return 0;
 		}
 
-		/* ConvertCaseEx */
-		d = plist->patrn;
+		i = i + 32 <= n ? i + 16 : n - 16;
+	}
+}
 
-		for (x = 0; x < n; x++)
-		{
-			d[x] = xlatcase[ pat[x] ];
-		}
+__attribute__((target("sse2")))
+static int sse2_strncasecmp(const unsigned char *a, const unsigned char *b, int n)
+{
+	int i = 0;
 
-		memcpy(plist->casepatrn, pat, n);
+	for (;;)
+	{
+		__m128i va = dfc_fold_epi8(_mm_loadu_si128((const __m128i *)(a + i)));
+		__m128i vb = dfc_fold_epi8(_mm_loadu_si128((const __m128i *)(b + i)));
 
-		plist->n      = n;
-		plist->nocase = nocase;
-		plist->iid    = dfc->numPatterns; // internal id
-		plist->next   = NULL;
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(va, vb)) != 0xffff)
+		{
+			return -1;
+		}
 
-		DFC_InitHashAdd(dfc, plist);
+		if (i + 16 == n)
+		{
+			return 0;
+		}
 
-		/* sid update */
-		plist->sids_size = 1;
+		i = i + 32 <= n ? i + 16 : n - 16;
+	}
+}
 
-		plist->sids[0] = sid;
+/* 'a'..'z' -> 'A'..'Z' on 32 bytes */
+__attribute__((target("avx2")))
+static inline __m256i dfc_fold_epi8_256(__m256i v)
+{
+	__m256i lower = _mm256_and_si256(_mm256_cmpgt_epi8(v, _mm256_set1_epi8('a' - 1)),
+									 _mm256_cmpgt_epi8(_mm256_set1_epi8('z' + 1), v));
+	return _mm256_sub_epi8(v, _mm256_and_si256(lower, _mm256_set1_epi8(0x20)));
+}
 
-		/* Add this pattern to the list */
-		dfc->numPatterns++;
+/* n >= 16: 32B blocks, the last one overlapping; 16..31 bytes as two 16B halves */
+__attribute__((target("avx2")))
+static int avx2_strncmp(const unsigned char *a, const unsigned char *b, int n)
+{
+	int i = 0;
 
-		return 0;
+	if (n < 32)
+	{
+		return sse2_strncmp(a, b, n);
 	}
-	else
+
+	for (;;)
 	{
-		int found = 0;
-		u32 x = 0;
+		__m256i va = _mm256_loadu_si256((const __m256i *)(a + i));
+		__m256i vb = _mm256_loadu_si256((const __m256i *)(b + i));
 
-		for (x = 0; x < plist->sids_size; x++)
+		if ((u32)_mm256_movemask_epi8(_mm256_cmpeq_epi8(va, vb)) != 0xffffffff)
 		{
-			if (plist->sids[x] == sid)
-			{
-				found = 1;
-				break;
-			}
+			return -1;
 		}
 
-		if (found == 0)
+		if (i + 32 == n)
 		{
-			u32 *tmp = (u32 *)my_realloc(plist->sids, sizeof(u32) * (plist->sids_size + 1));
-			if (tmp == NULL)
-			{
-				return -1;
-			}
-
-			plist->sids = tmp;
-			plist->sids[plist->sids_size] = sid;
-			plist->sids_size++;
+			return 0;
 		}
 
-		return 1;
+		i = i + 64 <= n ? i + 32 : n - 32;
 	}
 }
 
-static int Add_PID_to_2B_CT(CT_Type_2_2B * CompactTable, u8 *temp, u32 pid, dfcMemoryType type)
+__attribute__((target("avx2")))
+static int avx2_strncasecmp(const unsigned char *a, const unsigned char *b, int n)
 {
-	u32 j;
-	u32 k;
-	u32 crc = my_crc32_u16(0, *(u16*)temp);
+	int i = 0;
 
-	crc &= CT2_TABLE_SIZE_MASK;
+	if (n < 32)
+	{
+		return sse2_strncasecmp(a, b, n);
+	}
 
-	if (CompactTable[crc].cnt != 0)
+	for (;;)
 	{
-		for (j = 0; j < CompactTable[crc].cnt; j++)
+		__m256i va = dfc_fold_epi8_256(_mm256_loadu_si256((const __m256i *)(a + i)));
+		__m256i vb = dfc_fold_epi8_256(_mm256_loadu_si256((const __m256i *)(b + i)));
+
+		if ((u32)_mm256_movemask_epi8(_mm256_cmpeq_epi8(va, vb)) != 0xffffffff)
 		{
-			if (CompactTable[crc].array[j].pat == *(u16*)temp)
-			{
-				break;
-			}
+			return -1;
 		}
 
-		if (j == CompactTable[crc].cnt)  // If not found,
+		if (i + 32 == n)
 		{
-			CT_Type_2_2B_Array *tmp;
-			CompactTable[crc].cnt++;
+			return 0;
+		}
 
-			tmp = (CT_Type_2_2B_Array *)my_realloc((void*)CompactTable[crc].array, sizeof(CT_Type_2_2B_Array) * CompactTable[crc].cnt);
-			if (tmp == NULL)
-			{
-				return -1;
-			}
+		i = i + 64 <= n ? i + 32 : n - 32;
+	}
+}
+#endif
 
-			CompactTable[crc].array = tmp;
-			CompactTable[crc].array[CompactTable[crc].cnt - 1].pat = *(u16*)temp;
-			CompactTable[crc].array[CompactTable[crc].cnt - 1].cnt = 1;
+/* Selected by DFC_InitCompare() */
+static int (*my_strncmp_long)(const unsigned char *a, const unsigned char *b, int n) = sw_strncmp;
+static int (*my_strncasecmp_long)(const unsigned char *a, const unsigned char *b, int n) = sw_strncasecmp;
 
-			CompactTable[crc].array[CompactTable[crc].cnt - 1].pid = (u32 *)my_zalloc(sizeof(u32));
-			if (CompactTable[crc].array[CompactTable[crc].cnt - 1].pid == NULL)
-			{
-				return -1;
-			}
+static void DFC_InitCompare(void)
+{
+	my_strncmp_long = sw_strncmp;
+	my_strncasecmp_long = sw_strncasecmp;
 
-			CompactTable[crc].array[CompactTable[crc].cnt - 1].pid[0] = pid;
-		}
-		else   // If found,
+#ifdef DFC_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+	{
+		my_strncmp_long = avx2_strncmp;
+		my_strncasecmp_long = avx2_strncasecmp;
+	}
+	else if (__builtin_cpu_supports("sse2"))
+	{
+		my_strncmp_long = sse2_strncmp;
+		my_strncasecmp_long = sse2_strncasecmp;
+	}
+#endif
+}
+
+static inline int my_strncmp(const unsigned char *a, const unsigned char *b, int n)
+{
+	if (n >= DFC_CMP_LONG)
+	{
+		return my_strncmp_long(a, b, n);
+	}
+
+	return sw_strncmp(a, b, n);
+}
+
+static inline int my_strncasecmp(const unsigned char *a, const unsigned char *b, int n)
+{
+	if (n >= DFC_CMP_LONG)
+	{
+		return my_strncasecmp_long(a, b, n);
+	}
+
+	return sw_strncasecmp(a, b, n);
+}
+
+/* Number of case variants to build for a fragment of len bytes */
+static inline u32 DFC_Variants(DFC_STRUCTURE *dfc, int len)
+{
+	return dfc->fold ? 1 : 1u << len;
+}
+
+static void Build_pattern(DFC_STRUCTURE *dfc, DFC_PATTERN *p, u8 *flag, u8 *temp, u32 i, int j, int k)
+{
+	if (dfc->fold)
+	{
+		temp[k] = xlatcase[p->casepatrn[j]]; // folded, the search folds the input as well
+	}
+	else if (p->nocase)
+	{
+		if ((p->patrn[j] >= 65 && p->patrn[j] <= 90) || (p->patrn[j] >= 97 && p->patrn[j] <= 122))
 		{
-			for (k = 0; k < CompactTable[crc].array[j].cnt; k++)
+			if (flag[k] == 0)
 			{
-				if (CompactTable[crc].array[j].pid[k] == pid)
-				{
-					break;
-				}
+				temp[k] = tolower(p->patrn[j]);
 			}
-			if (k == CompactTable[crc].array[j].cnt)
+			else
 			{
-				u32 *tmp;
-				CompactTable[crc].array[j].cnt++;
-
-				tmp = (u32 *)my_realloc((void*)CompactTable[crc].array[j].pid, sizeof(u32) * CompactTable[crc].array[j].cnt);
-				if (tmp == NULL)
-				{
-					return -1;
-				}
-
-				CompactTable[crc].array[j].pid = tmp;
-				CompactTable[crc].array[j].pid[CompactTable[crc].array[j].cnt - 1] = pid;
+				temp[k] = toupper(p->patrn[j]);
 			}
 		}
-	}
-	else   // If there is no elements in the CT4,
-	{
-		CompactTable[crc].cnt = 1;
-
-		CompactTable[crc].array = (CT_Type_2_2B_Array *)my_zalloc(sizeof(CT_Type_2_2B_Array));
-		if (CompactTable[crc].array == NULL)
+		else
 		{
-			return -1;
+			temp[k] = p->patrn[j];
 		}
+	}
+	else
+	{
+		temp[k] = p->casepatrn[j]; // original pattern
+	}
 
-		memset(CompactTable[crc].array, 0, sizeof(CT_Type_2_2B_Array));
+	return ;
+}
 
-		CompactTable[crc].array[0].pat = *(u16*)temp;
-		CompactTable[crc].array[0].cnt = 1;
+DFC_STRUCTURE * DFC_New(void)
+{
+	return DFC_NewWithAllocator(NULL);
+}
 
-		CompactTable[crc].array[0].pid = (u32 *)my_zalloc(sizeof(u32));
-		if (CompactTable[crc].array[0].pid == NULL)
-		{
-			return -1;
-		}
+/* Process-wide tables, filled once by the first DFC_New */
+static pthread_once_t dfc_init_once = PTHREAD_ONCE_INIT;
 
-		CompactTable[crc].array[0].pid[0] = pid;
+static void DFC_InitGlobals(void)
+{
+	int i;
+	for (i = 0; i < 256; i++)
+	{
+		xlatcase[i] = (unsigned char)toupper(i);
 	}
 
-	return 0;
+	DFC_InitCRC32();
+	DFC_InitDF1Scan();
+	DFC_InitCompare();
 }
 
-int DFC_Compile(DFC_STRUCTURE* dfc)
+/*
+*  Create a DFC instance whose memory all comes from allocator
+*  (NULL: malloc/realloc/free). The hooks are copied into the instance.
+*/
+DFC_STRUCTURE * DFC_NewWithAllocator(const DFC_ALLOCATOR *allocator)
 {
-	u32 i = 0;
-	u32 alpha_cnt;
-
-	int j, k, l;
-	u32 m, n;
-	DFC_PATTERN *plist;
+	return DFC_NewWithConfig(NULL, allocator);
+}
 
-	u8 temp[8], flag[8];
-	u16 fragment_16;
-	u32 fragment_32;
-	u64 fragment_64;
-	u32 byteIndex, bitMask;
+/* The geometry DFC_New uses */
+void DFC_ConfigDefault(DFC_CONFIG *config)
+{
+	config->df_bits = DF_BITS;
+	config->ct2_max = CT2_TABLE_SIZE;
+	config->ct4_max = CT4_TABLE_SIZE;
+	config->ct8_max = CT8_TABLE_SIZE;
+	config->rec_ct_size = RECURSIVE_CT_SIZE;
+	config->rec_boundary = RECURSIVE_BOUNDARY;
+	config->pattern_interval = PATTERN_INTERVAL;
+	config->df_interleave = 0;
+}
 
-	/* ####################################################################################### */
-	/* ###############                  MatchList initialization              ################ */
-	/* ####################################################################################### */
+static inline int DFC_IsPow2(u32 v, u32 min, u32 max)
+{
+	return v >= min && v <= max && (v & (v - 1)) == 0;
+}
 
-	int begin_node_flag = 1;
+/*
+*  Create a DFC instance with its own geometry (NULL: DFC_ConfigDefault)
+*  and allocator (NULL: malloc/realloc/free).
+*
+* \retval NULL The config is out of range or memory ran out.
+*/
+DFC_STRUCTURE * DFC_NewWithConfig(const DFC_CONFIG *config, const DFC_ALLOCATOR *allocator)
+{
+	DFC_STRUCTURE * p;
+	DFC_ALLOCATOR a = allocator ? *allocator : dfc_libc_allocator;
+	DFC_CONFIG c;
 
-	for (i = 0; i < INIT_HASH_SIZE; i++)
+	if (config != NULL)
+	{
+		c = *config;
+	}
+	else
 	{
-		DFC_PATTERN *node = dfc->init_hash[i], *prev_node;
-		int first_node_flag = 1;
+		DFC_ConfigDefault(&c);
+	}
 
-		while (node != NULL)
+	if ((c.df_bits != 0 && (c.df_bits < DF_BITS_MIN || c.df_bits > DF_BITS)) ||
+		!DFC_IsPow2(c.ct2_max, CT_MIN_TABLE_SIZE, CT_MAX_TABLE_SIZE) ||
+		!DFC_IsPow2(c.ct4_max, CT_MIN_TABLE_SIZE, CT_MAX_TABLE_SIZE) ||
+		!DFC_IsPow2(c.ct8_max, CT_MIN_TABLE_SIZE, CT_MAX_TABLE_SIZE) ||
+		(c.rec_ct_size != 0 && !DFC_IsPow2(c.rec_ct_size, 1, RECURSIVE_CT_SIZE_MAX)) ||
+		c.rec_boundary < 2 || c.pattern_interval < MIN_PATTERN_INTERVAL || c.df_interleave > 1)
+	{
+		printf("DFC_NewWithConfig: invalid config.\n");
+		if (a.release_fn)
 		{
-			if (begin_node_flag)
-			{
-				begin_node_flag = 0;
-				dfc->dfcPatterns = node;
-			}
-			else
-			{
-				if (first_node_flag)
-				{
-					first_node_flag = 0;
-					prev_node->next = node;
-				}
-			}
-			prev_node = node;
-			node = node->next;
+			a.release_fn(a.ctx);
 		}
+		return NULL;
 	}
 
-	my_free(dfc->init_hash);
-	dfc->init_hash = NULL;
+	pthread_once(&dfc_init_once, DFC_InitGlobals);
 
-	dfc->dfcMatchList = (DFC_PATTERN **)my_zalloc(sizeof(DFC_PATTERN*) * dfc->numPatterns);
-	if (dfc->dfcMatchList == NULL)
+	p = (DFC_STRUCTURE *)my_alloc_block(&a, sizeof(DFC_STRUCTURE), DFC_MEMORY_TYPE__DFC);
+	if (p)
 	{
-		return -1;
-	}
+		memset(p, 0, sizeof(DFC_STRUCTURE));
+		p->allocator = a;
+		my_account(p, DFC_MEMORY_TYPE__DFC, sizeof(DFC_STRUCTURE), 1);
+		p->config = c;
 
-	for (plist = dfc->dfcPatterns; plist != NULL; plist = plist->next)
-	{
-		if (dfc->dfcMatchList[plist->iid] != NULL)
+		if (DFC_ScratchNew(p) < 0)
 		{
-			printf("Internal ID ERROR : %u\n", plist->iid);
+			DFC_Free(p);
+			return NULL;
 		}
-		dfc->dfcMatchList[plist->iid] = plist;
-	}
-
-	/* ####################################################################################### */
 
-	/* ####################################################################################### */
-	/* ###############              0. Direct Filters initialization          ################ */
-	/* ####################################################################################### */
+		p->init_hash = my_scratch_zalloc(p, sizeof(DFC_PATTERN *) * INIT_HASH_SIZE, DFC_MEMORY_TYPE__DFC);
+		if (p->init_hash == NULL)
+		{
+			DFC_Free(p);
+			return NULL;
+		}
 
-	/* Initializing Bloom Filter */
-	for (i = 0; i < DF_SIZE_REAL; i++)
-	{
-		dfc->DirectFilter1[i] = 0;
-		dfc->ADD_DF_4_plus[i] = 0;
-		dfc->ADD_DF_8_1[i] = 0;
-		dfc->ADD_DF_4_1[i] = 0;
-		dfc->cDF2[i] = 0;
-		dfc->ADD_DF_8_2[i] = 0;
-		dfc->cDF1[i] = 0;
+		p->init_hash_mask = INIT_HASH_SIZE - 1;
 	}
-
-	for (i = 0; i < 256; i++)
+	else if (a.release_fn)
 	{
-		dfc->cDF0[i] = 0;
+		a.release_fn(a.ctx);
 	}
 
-	/* ####################################################################################### */
-
-	/* ####################################################################################### */
-	/* ###############               Direct Filters setup                     ################ */
-	/* ####################################################################################### */
+	return p;
+}
 
-	memset(dfc->CompactTable1, 0, sizeof(CT_Type_1)*CT1_TABLE_SIZE);
+/* Releases the pointer-based CT2/CT4/CT8 that DFC_Compile builds */
+static void DFC_FreeBuildCT(DFC_STRUCTURE *dfc)
+{
+	u32 i, j, l;
+	int k;
 
-	for (plist = dfc->dfcPatterns; plist != NULL; plist = plist->next)
+	for (i = 0; dfc->CompactTable2 != NULL && i <= dfc->CT2.mask; i++)
 	{
-		/* 0. Initialization for DF8 (for 1B patterns)*/
-		if (plist->n == 1)
+		for (j = 0; j < dfc->CompactTable2[i].cnt; j++)
 		{
-			temp[0] = plist->casepatrn[0];
-			for (j = 0; j < 256; j++)
-			{
-				temp[1] = j;
-
-				fragment_16 = (temp[1] << 8) | temp[0];
-				byteIndex = (u32)BINDEX(fragment_16 & DF_MASK);
-				bitMask = BMASK(fragment_16 & DF_MASK);
-
-				dfc->DirectFilter1[byteIndex] |= bitMask;
-			}
+			my_free(dfc, dfc->CompactTable2[i].array[j].pid);
 
-			dfc->cDF0[temp[0]] = 1;
-			if (dfc->CompactTable1[temp[0]].cnt == 0)
+			if (dfc->CompactTable2[i].array[j].DirectFilter != NULL)
 			{
-				dfc->CompactTable1[temp[0]].cnt++;
-				dfc->CompactTable1[temp[0]].pid[0] = plist->iid;
+				my_free(dfc, dfc->CompactTable2[i].array[j].DirectFilter);
 			}
-			else
+
+			if (dfc->CompactTable2[i].array[j].CompactTable != NULL)
 			{
-				for (k = 0; k < dfc->CompactTable1[temp[0]].cnt; k++)
-				{
-					if (dfc->CompactTable1[temp[0]].pid[k] == plist->iid)
-					{
-						break;
-					}
-				}
-				if (k == dfc->CompactTable1[temp[0]].cnt)
+				for (k = 0; k < (int)dfc->config.rec_ct_size; k++)
 				{
-					dfc->CompactTable1[temp[0]].pid[dfc->CompactTable1[temp[0]].cnt++] = plist->iid;
-					if (dfc->CompactTable1[temp[0]].cnt >= CT_TYPE1_PID_CNT_MAX)
+					for (l = 0; l < dfc->CompactTable2[i].array[j].CompactTable[k].cnt; l++)
 					{
-						printf("Too many PIDs in CT1. You should expand the size.\n");
+						my_free(dfc, dfc->CompactTable2[i].array[j].CompactTable[k].array[l].pid);
 					}
+					my_free(dfc, dfc->CompactTable2[i].array[j].CompactTable[k].array);
 				}
+				my_free(dfc, dfc->CompactTable2[i].array[j].CompactTable);
 			}
+		}
 
-			if (plist->nocase)
+		my_free(dfc, dfc->CompactTable2[i].array);
+		dfc->CompactTable2[i].array = NULL;
+		dfc->CompactTable2[i].cnt = 0;
+	}
+
+	for (i = 0; dfc->CompactTable4 != NULL && i <= dfc->CT4.mask; i++)
+	{
+		for (j = 0; j < dfc->CompactTable4[i].cnt; j++)
+		{
+			my_free(dfc, dfc->CompactTable4[i].array[j].pid);
+
+			if (dfc->CompactTable4[i].array[j].DirectFilter != NULL)
 			{
-				if (plist->casepatrn[0] >= 97/*a*/ && plist->casepatrn[0] <= 122/*z*/)
-				{
-					/* when the pattern is lower case */
-					temp[0] = toupper(plist->casepatrn[0]);
-				}
-				else
+				my_free(dfc, dfc->CompactTable4[i].array[j].DirectFilter);
+			}
+
+			if (dfc->CompactTable4[i].array[j].CompactTable != NULL)
+			{
+				for (k = 0; k < (int)dfc->config.rec_ct_size; k++)
 				{
-					/* when the pattern is upper case */
-					temp[0] = tolower(plist->casepatrn[0]);
+					for (l = 0; l < dfc->CompactTable4[i].array[j].CompactTable[k].cnt; l++)
+					{
+						my_free(dfc, dfc->CompactTable4[i].array[j].CompactTable[k].array[l].pid);
+					}
+					my_free(dfc, dfc->CompactTable4[i].array[j].CompactTable[k].array);
 				}
+				my_free(dfc, dfc->CompactTable4[i].array[j].CompactTable);
+			}
+		}
 
-				for (j = 0; j < 256; j++)
-				{
-					temp[1] = j;
+		my_free(dfc, dfc->CompactTable4[i].array);
+		dfc->CompactTable4[i].array = NULL;
+		dfc->CompactTable4[i].cnt = 0;
+	}
 
-					fragment_16 = (temp[1] << 8) | temp[0];
-					byteIndex = (u32)BINDEX(fragment_16 & DF_MASK);
-					bitMask = BMASK(fragment_16 & DF_MASK);
+	for (i = 0; dfc->CompactTable8 != NULL && i <= dfc->CT8.mask; i++)
+	{
+		for (j = 0; j < dfc->CompactTable8[i].cnt; j++)
+		{
+			my_free(dfc, dfc->CompactTable8[i].array[j].pid);
 
-					dfc->DirectFilter1[byteIndex] |= bitMask;
-				}
+			if (dfc->CompactTable8[i].array[j].DirectFilter != NULL)
+			{
+				my_free(dfc, dfc->CompactTable8[i].array[j].DirectFilter);
+			}
 
-				dfc->cDF0[temp[0]] = 1;
-				if (dfc->CompactTable1[temp[0]].cnt == 0)
-				{
-					dfc->CompactTable1[temp[0]].cnt++;
-					dfc->CompactTable1[temp[0]].pid[0] = plist->iid;
-				}
-				else
+			if (dfc->CompactTable8[i].array[j].CompactTable != NULL)
+			{
+				for (k = 0; k < (int)dfc->config.rec_ct_size; k++)
 				{
-					for (k = 0; k < dfc->CompactTable1[temp[0]].cnt; k++)
-					{
-						if (dfc->CompactTable1[temp[0]].pid[k] == plist->iid)
-						{
-							break;
-						}
-					}
-					if (k == dfc->CompactTable1[temp[0]].cnt)
+					for (l = 0; l < dfc->CompactTable8[i].array[j].CompactTable[k].cnt; l++)
 					{
-						dfc->CompactTable1[temp[0]].pid[dfc->CompactTable1[temp[0]].cnt++] = plist->iid;
-						if (dfc->CompactTable1[temp[0]].cnt >= CT_TYPE1_PID_CNT_MAX)
-						{
-							printf("Too many PIDs in CT1. You should expand the size.\n");
-						}
+						my_free(dfc, dfc->CompactTable8[i].array[j].CompactTable[k].array[l].pid);
 					}
+					my_free(dfc, dfc->CompactTable8[i].array[j].CompactTable[k].array);
 				}
+				my_free(dfc, dfc->CompactTable8[i].array[j].CompactTable);
 			}
 		}
 
-		/* 1. Initialization for DF1 */
-		if (plist->n > 1)
-		{
-			alpha_cnt = 0;
+		my_free(dfc, dfc->CompactTable8[i].array);
+		dfc->CompactTable8[i].array = NULL;
+		dfc->CompactTable8[i].cnt = 0;
+	}
 
-			do
-			{
-				for (j = 1, k = 0; j >= 0; --j, k++)
-				{
-					flag[k] = (alpha_cnt >> j) & 1;
-				}
 
-				if (plist->n == 2)
-				{
-					for (j = plist->n - 2, k = 0; j < plist->n; j++, k++)
-					{
-						Build_pattern(plist, flag, temp, i, j, k);
-					}
-				}
-				else if (plist->n == 3)
-				{
-					//for (j=0 , k=0; j < 2; j++, k++){
-					for (j = plist->n - 2, k = 0; j < plist->n; j++, k++)
-					{
-						Build_pattern(plist, flag, temp, i, j, k);
-					}
-				}
-				else if (plist->n < 8)
-				{
-					for (j = plist->n - 4, k = 0; j < plist->n - 2; j++, k++)
-					{
-						Build_pattern(plist, flag, temp, i, j, k);
-					}
-				}
-				else     // len >= 8
-				{
-					for (j = min_pattern_interval * (plist->n - 8) / pattern_interval, k = 0;
-						 j < min_pattern_interval * (plist->n - 8) / pattern_interval + 2; j++, k++)
-					{
-						Build_pattern(plist, flag, temp, i, j, k);
-					}
-				}
+	my_free(dfc, dfc->CompactTable2);
+	my_free(dfc, dfc->CompactTable4);
+	my_free(dfc, dfc->CompactTable8);
+	dfc->CompactTable2 = NULL;
+	dfc->CompactTable4 = NULL;
+	dfc->CompactTable8 = NULL;
+}
 
-				fragment_16 = (temp[1] << 8) | temp[0];
-				byteIndex = (u32)BINDEX(fragment_16 & DF_MASK);
-				bitMask = BMASK(fragment_16 & DF_MASK);
+static void DFC_FreeStore(DFC_STRUCTURE *dfc)
+{
+	my_free(dfc, dfc->store_mem);
+	my_free(dfc, dfc->store_off);
+	my_free(dfc, dfc->SIDPool);
+	my_free(dfc, dfc->sid_start);
+}
 
-				dfc->DirectFilter1[byteIndex] |= bitMask;
+void DFC_Free(DFC_STRUCTURE *dfc)
+{
+	if (dfc == NULL)
+	{
+		return;
+	}
 
-				if (plist->n == 2 || plist->n == 3)
-				{
-					dfc->cDF1[byteIndex] |= bitMask;
-				}
+	/* Arena-style allocator: drop everything at once */
+	if (dfc->allocator.release_fn != NULL)
+	{
+		DFC_ALLOCATOR a = dfc->allocator;
+		int i;
 
-				alpha_cnt++;
-			}
-			while (alpha_cnt < 4);
+		DFC_ScratchRelease(dfc);
+
+		for (i = 0; i < DFC_MEMORY_TYPE__MAX; i++)
+		{
+			__atomic_sub_fetch(&dfc_memory_stats.bytes[i], dfc->mem.bytes[i], __ATOMIC_RELAXED);
+			__atomic_sub_fetch(&dfc_memory_stats.allocs[i], dfc->mem.allocs[i], __ATOMIC_RELAXED);
 		}
 
-		/* Initializing 4B DF, 8B DF */
-		if (plist->n >= 4)
+		a.release_fn(a.ctx);
+		return;
+	}
+
+	if (dfc->blob != NULL)
+	{
+		if (dfc->blob_map_size != 0)
 		{
-			alpha_cnt = 0;
+			munmap((void *)dfc->blob, dfc->blob_map_size);
+		}
 
-			do
-			{
-				for (j = 3, k = 0; j >= 0; --j, k++)
-				{
-					flag[k] = (alpha_cnt >> j) & 1;
-				}
+		if (dfc->dfcMatchList != NULL)
+		{
+			int i;
 
-				if (plist->n < 8)
-				{
-					for (j = plist->n - 4, k = 0; j < plist->n; j++, k++)
-					{
-						Build_pattern(plist, flag, temp, i, j, k);
-					}
-				}
-				else
-				{
-					for (j = min_pattern_interval * (plist->n - 8) / pattern_interval, k = 0;
-						 j < min_pattern_interval * (plist->n - 8) / pattern_interval + 4; j++, k++)
-					{
-						Build_pattern(plist, flag, temp, i, j, k);
-					}
-				}
+			for (i = 0; i < dfc->numPatterns; i++)
+			{
+				my_free(dfc, dfc->dfcMatchList[i]);
+			}
+		}
 
-				byteIndex = BINDEX((*(((u16*)temp) + 1)) & DF_MASK);
-				bitMask = BMASK((*(((u16*)temp) + 1)) & DF_MASK);
+		my_free(dfc, dfc->dfcMatchList);
+		my_free(dfc, dfc->DFBits);
+		my_free(dfc, dfc);
+		return;
+	}
 
-				dfc->ADD_DF_4_plus[byteIndex] |= bitMask;
-				if (plist->n >= 4 && plist->n < 8)
-				{
-					dfc->ADD_DF_4_1[byteIndex] |= bitMask;
+	if (dfc->dfcPatterns != NULL)
+	{
+		DFC_PATTERN *plist;
+		DFC_PATTERN *p_next;
 
-					fragment_16 = (temp[1] << 8) | temp[0];
-					byteIndex = BINDEX(fragment_16 & DF_MASK);
-					bitMask = BMASK(fragment_16 & DF_MASK);
+		for (plist = dfc->dfcPatterns; plist != NULL;)
+		{
+			if (plist->patrn != NULL)
+			{
+				my_free(dfc, plist->patrn);
+			}
 
-					dfc->cDF2[byteIndex] |= bitMask;
-				}
-				alpha_cnt++;
+			/* Otherwise they point into the pattern store */
+			if (dfc->PatternStore == NULL)
+			{
+				my_free(dfc, plist->casepatrn);
+				my_free(dfc, plist->sids);
 			}
-			while (alpha_cnt < 16);
+
+			p_next = plist->next;
+			my_free(dfc, plist);
+			plist = p_next;
 		}
+	}
 
-		if (plist->n >= 8)
-		{
-			alpha_cnt = 0;
+	if (dfc->dfcMatchList != NULL)
+	{
+		my_free(dfc, dfc->dfcMatchList);
+	}
 
-			do
-			{
-				for (j = 7, k = 0; j >= 0; --j, k++)
-				{
-					flag[k] = (alpha_cnt >> j) & 1;
-				}
+	my_free(dfc, dfc->init_hash);
+	my_free(dfc, dfc->pair_freq);
+
+	DFC_FreeBuildCT(dfc);
+
+	my_free(dfc, dfc->CompactTable1.pid);
+	my_free(dfc, dfc->CT2.bucket);
+	my_free(dfc, dfc->CT2.entry);
+	my_free(dfc, dfc->CT4.bucket);
+	my_free(dfc, dfc->CT4.entry);
+	my_free(dfc, dfc->CT8.bucket);
+	my_free(dfc, dfc->CT8.entry);
+	my_free(dfc, dfc->RecCT.df);
+	my_free(dfc, dfc->RecCT.bucket);
+	my_free(dfc, dfc->RecCT.entry);
+	my_free(dfc, dfc->PIDPool);
+	my_free(dfc, dfc->DFBits);
+	DFC_FreeStore(dfc);
+
+	my_free(dfc, dfc);
+}
 
-				for (j = min_pattern_interval * (plist->n - 8) / pattern_interval, k = 0;
-					 j < min_pattern_interval * (plist->n - 8) / pattern_interval + 8; j++, k++)
-				{
-					Build_pattern(plist, flag, temp, i, j, k);
-				}
+/* CRC32-C of the pattern bytes, seeded with the length and case flag */
+static inline u32 DFC_InitHashRaw(const u8 *pat, int patlen, int nocase)
+{
+	u64 crc = ((u64)patlen << 1) | (nocase != 0);
+	u64 v;
+	int i;
 
-				byteIndex = BINDEX((*(((u16*)temp) + 3)) & DF_MASK);
-				bitMask = BMASK((*(((u16*)temp) + 3)) & DF_MASK);
+	for (i = 0; i + 8 <= patlen; i += 8)
+	{
+		memcpy(&v, pat + i, 8);
+		crc = my_crc32_u64(crc, v);
+	}
 
-				dfc->ADD_DF_8_1[byteIndex] |= bitMask;
+	if (i < patlen)
+	{
+		v = 0;
+		memcpy(&v, pat + i, patlen - i);
+		crc = my_crc32_u64(crc, v);
+	}
 
-				byteIndex = BINDEX((*(((u16*)temp) + 2)) & DF_MASK);
-				bitMask = BMASK((*(((u16*)temp) + 2)) & DF_MASK);
+	return (u32)crc;
+}
 
-				dfc->ADD_DF_8_2[byteIndex] |= bitMask;
+static inline DFC_PATTERN *DFC_InitHashLookup(DFC_STRUCTURE *ctx, u8 *pat, int patlen, int nocase)
+{
+	DFC_PATTERN *t;
+	u32 i;
 
-				alpha_cnt++;
-			}
-			while (alpha_cnt < 256);
+	if (ctx->init_hash == NULL)
+	{
+		return NULL;
+	}
+
+	for (i = DFC_InitHashRaw(pat, patlen, nocase) & ctx->init_hash_mask; (t = ctx->init_hash[i]) != NULL;
+		 i = (i + 1) & ctx->init_hash_mask)
+	{
+		if (t->n == patlen && t->nocase == nocase &&
+			memcmp(t->casepatrn, pat, patlen) == 0)
+		{
+			return t;
 		}
+	}
+
+	return NULL;
+}
+
+/* Puts p in the first free slot of its probe sequence */
+static inline void DFC_InitHashPut(DFC_STRUCTURE *ctx, DFC_PATTERN *p)
+{
+	u32 i = DFC_InitHashRaw(p->casepatrn, p->n, p->nocase) & ctx->init_hash_mask;
 
+	while (ctx->init_hash[i] != NULL)
+	{
+		i = (i + 1) & ctx->init_hash_mask;
 	}
 
-	//printf("DF Initialization is done.\n");
+	ctx->init_hash[i] = p;
+}
 
-	/* ####################################################################################### */
+/* Doubles init_hash and re-inserts every pattern added so far */
+static int DFC_InitHashGrow(DFC_STRUCTURE *ctx)
+{
+	u32 size = (ctx->init_hash_mask + 1) * 2;
+	DFC_PATTERN **table = (DFC_PATTERN **)my_scratch_zalloc(ctx, sizeof(DFC_PATTERN *) * size, DFC_MEMORY_TYPE__DFC);
+	DFC_PATTERN *p;
 
-	/* ####################################################################################### */
-	/* ###############                Compact Tables initialization           ################ */
-	/* ####################################################################################### */
+	if (table == NULL)
+	{
+		return -1;
+	}
 
-	memset(dfc->CompactTable2, 0, sizeof(CT_Type_2)*CT2_TABLE_SIZE);
-	memset(dfc->CompactTable4, 0, sizeof(CT_Type_2)*CT4_TABLE_SIZE);
-	memset(dfc->CompactTable8, 0, sizeof(CT_Type_2_8B)*CT8_TABLE_SIZE);
+	my_free(ctx, ctx->init_hash);
+	ctx->init_hash = table;
+	ctx->init_hash_mask = size - 1;
 
-	/* ####################################################################################### */
+	for (p = ctx->dfcPatterns; p != NULL; p = p->next)
+	{
+		DFC_InitHashPut(ctx, p);
+	}
 
-	/* ####################################################################################### */
-	/* ###############                   Compact Tables setup                 ################ */
-	/* ####################################################################################### */
+	return 0;
+}
 
-	for (plist = dfc->dfcPatterns; plist != NULL; plist = plist->next)
+/* Adds a new pattern to init_hash and to the tail of dfcPatterns */
+static inline int DFC_InitHashAdd(DFC_STRUCTURE *ctx, DFC_PATTERN *p)
+{
+	if (((u64)ctx->numPatterns + 1) * 2 > (u64)ctx->init_hash_mask + 1 && DFC_InitHashGrow(ctx) < 0)
 	{
-		if (plist->n == 2 || plist->n == 3)
-		{
-			alpha_cnt = 0;
+		return -1;
+	}
 
-			do
-			{
-				u32 crc;
+	DFC_InitHashPut(ctx, p);
 
-				// 1.
-				for (j = 1, k = 0; j >= 0; --j, k++)
-				{
-					flag[k] = (alpha_cnt >> j) & 1;
-				}
+	if (ctx->lastPattern == NULL)
+	{
+		ctx->dfcPatterns = p;
+	}
+	else
+	{
+		ctx->lastPattern->next = p;
+	}
+	ctx->lastPattern = p;
 
-				for (j = plist->n - 2, k = 0; j < plist->n; j++, k++)
-				{
-					Build_pattern(plist, flag, temp, i, j, k);
-				}
+	return 0;
+}
 
-				// 2.
-				fragment_16 = (temp[1] << 8) | temp[0];
-				crc = my_crc32_u16(0, fragment_16);
+/*
+*  Build the tables from case-folded keys: a nocase pattern then takes one
+*  slot per table instead of up to 256 case variants, and the search folds
+*  the input before every filter and table lookup. Case-sensitive patterns
+*  are checked byte-exact during verification. Must be called before
+*  DFC_Compile.
+*
+* \param dfc    Pointer to the DFC structure
+* \param on     Non-zero to enable folding
+*
+* \retval  0 On success.
+* \retval -1 The instance is already compiled.
+*/
+int DFC_SetNocaseFolding(DFC_STRUCTURE *dfc, int on)
+{
+	if (dfc->init_hash == NULL)
+	{
+		printf("DFC_SetNocaseFolding must be called before DFC_Compile.\n");
+		return -1;
+	}
 
-				// 3.
-				crc &= CT2_TABLE_SIZE_MASK;
+	dfc->fold = on != 0;
 
-				// 4.
-				if (dfc->CompactTable2[crc].cnt != 0)
-				{
-					for (n = 0; n < dfc->CompactTable2[crc].cnt; n++)
-					{
-						if (dfc->CompactTable2[crc].array[n].pat == fragment_16)
-						{
-							break;
-						}
-					}
+	return 0;
+}
 
-					if (n == dfc->CompactTable2[crc].cnt)  // If not found,
-					{
-						CT_Type_2_Array *tmp;
-						dfc->CompactTable2[crc].cnt++;
+/*
+*  Number of threads DFC_Compile spreads the DF setup, the CT inserts and
+*  the recursive tables over (default 1). A custom allocator is called
+*  under a lock while they run.
+*
+* \param dfc     Pointer to the DFC structure
+* \param threads Thread count, 0 for the number of online CPUs
+*
+* \retval  0 On success.
+* \retval -1 The instance is already compiled.
+*/
+int DFC_SetCompileThreads(DFC_STRUCTURE *dfc, int threads)
+{
+	if (dfc->init_hash == NULL)
+	{
+		printf("DFC_SetCompileThreads must be called before DFC_Compile.\n");
+		return -1;
+	}
 
-						tmp = (CT_Type_2_Array *)my_realloc((void*)dfc->CompactTable2[crc].array, sizeof(CT_Type_2_Array) * dfc->CompactTable2[crc].cnt);
-						if (tmp == NULL)
-						{
-							return -1;
-						}
+	if (threads <= 0)
+	{
+		threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+	}
 
-						dfc->CompactTable2[crc].array = tmp;
-						dfc->CompactTable2[crc].array[dfc->CompactTable2[crc].cnt - 1].pat = fragment_16;
-						dfc->CompactTable2[crc].array[dfc->CompactTable2[crc].cnt - 1].cnt = 1;
+	if (threads < 1)
+	{
+		threads = 1;
+	}
+	else if (threads > DFC_COMPILE_THREADS_MAX)
+	{
+		threads = DFC_COMPILE_THREADS_MAX;
+	}
 
-						dfc->CompactTable2[crc].array[dfc->CompactTable2[crc].cnt - 1].pid = (u32 *)my_zalloc(sizeof(u32));
-						if (dfc->CompactTable2[crc].array[dfc->CompactTable2[crc].cnt - 1].pid == NULL)
-						{
-							return -1;
-						}
+	dfc->compile_threads = threads;
 
-						dfc->CompactTable2[crc].array[dfc->CompactTable2[crc].cnt - 1].pid[0] = plist->iid;
-						dfc->CompactTable2[crc].array[dfc->CompactTable2[crc].cnt - 1].DirectFilter = NULL;
-						dfc->CompactTable2[crc].array[dfc->CompactTable2[crc].cnt - 1].CompactTable = NULL;
-					}
-					else   // If found,
-					{
-						for (m = 0; m < dfc->CompactTable2[crc].array[n].cnt; m++)
-						{
-							if (dfc->CompactTable2[crc].array[n].pid[m] == plist->iid)
-							{
-								break;
-							}
-						}
+	return 0;
+}
+
+/* Pair counts of the traffic sample, allocated on first use */
+static u32 *DFC_PairFreq(DFC_STRUCTURE *dfc, const char *caller)
+{
+	if (dfc->init_hash == NULL)
+	{
+		printf("%s must be called before DFC_Compile.\n", caller);
+		return NULL;
+	}
+
+	if (dfc->pair_freq == NULL)
+	{
+		dfc->pair_freq = (u32 *)my_scratch_zalloc(dfc, sizeof(u32) * DF_SIZE, DFC_MEMORY_TYPE__DFC);
+	}
+
+	return dfc->pair_freq;
+}
+
+/*
+*  Feeds a sample of the expected traffic to DFC_Compile. Patterns of 8B
+*  or more are then keyed on the 8B window whose byte pairs are rarest in
+*  the samples rather than on a fixed one, see DFC_PickCT8Keys(). Can be
+*  called repeatedly; the counts add up.
+*
+* \param dfc    Pointer to the DFC structure
+* \param buf    Sample bytes
+* \param buflen Length of buf
+*
+* \retval  0 On success.
+* \retval -1 The instance is already compiled or out of memory.
+*/
+int DFC_AddTrafficSample(DFC_STRUCTURE *dfc, const unsigned char *buf, int buflen)
+{
+	u32 *freq = DFC_PairFreq(dfc, "DFC_AddTrafficSample");
+	int i;
+
+	if (freq == NULL)
+	{
+		return -1;
+	}
+
+	for (i = 0; i + 1 < buflen; i++)
+	{
+		u32 *f = &freq[buf[i] | (buf[i + 1] << 8)];
+
+		if (*f != UINT32_MAX)
+		{
+			(*f)++;
+		}
+	}
+
+	return 0;
+}
+
+/*
+*  Same as DFC_AddTrafficSample() from precomputed counts: freq[a | b << 8]
+*  is how often byte a is followed by byte b. Replaces earlier samples.
+*
+* \param dfc  Pointer to the DFC structure
+* \param freq DF_SIZE pair counts
+*
+* \retval  0 On success.
+* \retval -1 The instance is already compiled or out of memory.
+*/
+int DFC_SetPairFrequency(DFC_STRUCTURE *dfc, const u32 *freq)
+{
+	u32 *dst = DFC_PairFreq(dfc, "DFC_SetPairFrequency");
+
+	if (dst == NULL)
+	{
+		return -1;
+	}
+
+	memcpy(dst, freq, sizeof(u32) * DF_SIZE);
+
+	return 0;
+}
+
+/*
+*  Add a pattern to the list of patterns
+*
+*
+* \param dfc    Pointer to the DFC structure
+* \param pat    Pointer to the pattern
+* \param n      Pattern length
+* \param nocase Flag for case-insensitive (0 means case-sensitive)
+* \param sid    External id
+*
+* \retval   0 On success to add new pattern.
+* \retval   1 On success to add sid.
+*/
+int DFC_AddPattern(DFC_STRUCTURE * dfc, unsigned char *pat, int n, int nocase, u32 sid)
+{
+	DFC_PATTERN * plist;
+
+	if (dfc->init_hash == NULL)
+	{
+		printf("DFC_AddPattern must be called before DFC_Compile.\n");
+		return -1;
+	}
+
+	plist = DFC_InitHashLookup(dfc, pat, n, nocase);
+	if (plist == NULL)
+	{
+		unsigned char *d;
+		int x;
+
+		plist = (DFC_PATTERN *) my_zalloc(dfc, sizeof(DFC_PATTERN), DFC_MEMORY_TYPE__PATTERN);
+		if (plist == NULL)
+		{
+			return -1;
+		}
+
+		memset(plist, 0, sizeof(DFC_PATTERN));
+
+		plist->patrn = (unsigned char *)my_zalloc(dfc, n, DFC_MEMORY_TYPE__PATTERN);
+		if (plist->patrn == NULL)
+		{
+			my_free(dfc, plist);
+			return -1;
+		}
+
+		plist->casepatrn = (unsigned char *)my_zalloc(dfc, n, DFC_MEMORY_TYPE__PATTERN);
+		if (plist->casepatrn == NULL)
+		{
+			my_free(dfc, plist->patrn);
+			my_free(dfc, plist);
+			return -1;
+		}
+
+		plist->sids = (u32 *) my_zalloc(dfc, sizeof(u32), DFC_MEMORY_TYPE__PATTERN);
+		if (plist->sids == NULL)
+		{
+			my_free(dfc, plist->patrn);
+			my_free(dfc, plist->casepatrn);
+			my_free(dfc, plist);
+			return -1;
+		}
+
+		/* ConvertCaseEx */
+		d = plist->patrn;
+
+		for (x = 0; x < n; x++)
+		{
+			d[x] = xlatcase[ pat[x] ];
+		}
+
+		memcpy(plist->casepatrn, pat, n);
+
+		plist->n      = n;
+		plist->nocase = nocase;
+		plist->iid    = dfc->numPatterns; // internal id
+		plist->next   = NULL;
+
+		if (DFC_InitHashAdd(dfc, plist) < 0)
+		{
+			my_free(dfc, plist->patrn);
+			my_free(dfc, plist->casepatrn);
+			my_free(dfc, plist->sids);
+			my_free(dfc, plist);
+			return -1;
+		}
+
+		/* sid update */
+		plist->sids_size = 1;
+
+		plist->sids[0] = sid;
+
+		/* Add this pattern to the list */
+		dfc->numPatterns++;
+		if (n > dfc->maxPatternLen)
+		{
+			dfc->maxPatternLen = n;
+		}
+
+		return 0;
+	}
+	else
+	{
+		int found = 0;
+		u32 x = 0;
+
+		for (x = 0; x < plist->sids_size; x++)
+		{
+			if (plist->sids[x] == sid)
+			{
+				found = 1;
+				break;
+			}
+		}
+
+		if (found == 0)
+		{
+			u32 *tmp = (u32 *)my_realloc(dfc, plist->sids, sizeof(u32) * (plist->sids_size + 1), DFC_MEMORY_TYPE__PATTERN);
+			if (tmp == NULL)
+			{
+				return -1;
+			}
+
+			plist->sids = tmp;
+			plist->sids[plist->sids_size] = sid;
+			plist->sids_size++;
+		}
+
+		return 1;
+	}
+}
+
+static int Add_PID_to_2B_CT(DFC_STRUCTURE *dfc, CT_Type_2_2B * CompactTable, u8 *temp, u32 pid, dfcMemoryType type)
+{
+	u32 j;
+	u32 k;
+	u32 crc = my_crc32_u16(0, *(u16*)temp);
+
+	crc &= dfc->rec_mask;
+
+	if (CompactTable[crc].cnt != 0)
+	{
+		for (j = 0; j < CompactTable[crc].cnt; j++)
+		{
+			if (CompactTable[crc].array[j].pat == *(u16*)temp)
+			{
+				break;
+			}
+		}
+
+		if (j == CompactTable[crc].cnt)  // If not found,
+		{
+			CT_Type_2_2B_Array *tmp;
+			CompactTable[crc].cnt++;
+
+			tmp = (CT_Type_2_2B_Array *)my_realloc(dfc, (void*)CompactTable[crc].array, sizeof(CT_Type_2_2B_Array) * CompactTable[crc].cnt, type);
+			if (tmp == NULL)
+			{
+				return -1;
+			}
+
+			CompactTable[crc].array = tmp;
+			CompactTable[crc].array[CompactTable[crc].cnt - 1].pat = *(u16*)temp;
+			CompactTable[crc].array[CompactTable[crc].cnt - 1].cnt = 1;
+
+			CompactTable[crc].array[CompactTable[crc].cnt - 1].pid = (u32 *)my_zalloc(dfc, sizeof(u32), type);
+			if (CompactTable[crc].array[CompactTable[crc].cnt - 1].pid == NULL)
+			{
+				return -1;
+			}
+
+			CompactTable[crc].array[CompactTable[crc].cnt - 1].pid[0] = pid;
+		}
+		else   // If found,
+		{
+			for (k = 0; k < CompactTable[crc].array[j].cnt; k++)
+			{
+				if (CompactTable[crc].array[j].pid[k] == pid)
+				{
+					break;
+				}
+			}
+			if (k == CompactTable[crc].array[j].cnt)
+			{
+				u32 *tmp;
+				CompactTable[crc].array[j].cnt++;
+
+				tmp = (u32 *)my_realloc(dfc, (void*)CompactTable[crc].array[j].pid, sizeof(u32) * CompactTable[crc].array[j].cnt, type);
+				if (tmp == NULL)
+				{
+					return -1;
+				}
+
+				CompactTable[crc].array[j].pid = tmp;
+				CompactTable[crc].array[j].pid[CompactTable[crc].array[j].cnt - 1] = pid;
+			}
+		}
+	}
+	else   // If there is no elements in the CT4,
+	{
+		CompactTable[crc].cnt = 1;
+
+		CompactTable[crc].array = (CT_Type_2_2B_Array *)my_zalloc(dfc, sizeof(CT_Type_2_2B_Array), type);
+		if (CompactTable[crc].array == NULL)
+		{
+			return -1;
+		}
+
+		memset(CompactTable[crc].array, 0, sizeof(CT_Type_2_2B_Array));
+
+		CompactTable[crc].array[0].pat = *(u16*)temp;
+		CompactTable[crc].array[0].cnt = 1;
+
+		CompactTable[crc].array[0].pid = (u32 *)my_zalloc(dfc, sizeof(u32), type);
+		if (CompactTable[crc].array[0].pid == NULL)
+		{
+			return -1;
+		}
+
+		CompactTable[crc].array[0].pid[0] = pid;
+	}
+
+	return 0;
+}
+
+/* Adds pid under every 2B key (x, c) of a recursive table. With folding
+ * only keys the folded input can produce are added. */
+static int DFC_AddRecursive1B(DFC_STRUCTURE *dfc, u8 *DirectFilter, CT_Type_2_2B *CompactTable, u8 c, u32 pid, dfcMemoryType type)
+{
+	u8 temp[2];
+	u32 key;
+	int l;
+
+	temp[1] = c;
+	for (l = 0; l < 256; l++)
+	{
+		if (dfc->fold && xlatcase[l] != l)
+		{
+			continue;
+		}
+
+		temp[0] = l;
+
+		key = DFC_DFKey(dfc, (temp[1] << 8) | temp[0]);
+		DirectFilter[BINDEX(key)] |= BMASK(key);
+
+		if (Add_PID_to_2B_CT(dfc, CompactTable, temp, pid, type) < 0)
+		{
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/* Number of keys a pattern fragment expands to (2^letters if nocase and not folding) */
+static u32 DFC_CaseVariants(DFC_STRUCTURE *dfc, DFC_PATTERN *p, int from, int len)
+{
+	u32 cnt = 1;
+	int j;
+
+	if (p->nocase && !dfc->fold)
+	{
+		for (j = from; j < from + len; j++)
+		{
+			if (isalpha(p->patrn[j]))
+			{
+				cnt <<= 1;
+			}
+		}
+	}
+
+	return cnt;
+}
+
+/* Power of two >= keys, within [CT_MIN_TABLE_SIZE, max] */
+static u32 DFC_TableSize(u32 keys, u32 max)
+{
+	u32 size = CT_MIN_TABLE_SIZE;
+
+	while (size < keys && size < max)
+	{
+		size <<= 1;
+	}
+
+	return size;
+}
+
+/****************************************************/
+/*            Compact Table flattening              */
+/****************************************************/
+static void DFC_CountRecursive(CT_Type_2_2B *CompactTable, u32 rec_size, u32 *entries, u32 *pids)
+{
+	u32 k, l;
+
+	for (k = 0; k < rec_size; k++)
+	{
+		*entries += CompactTable[k].cnt;
+		for (l = 0; l < CompactTable[k].cnt; l++)
+		{
+			*pids += CompactTable[k].array[l].cnt;
+		}
+	}
+}
+
+static void DFC_CountCT(CT_Type_2 *CompactTable, u32 size, u32 rec_size, u32 *entries, u32 *pids, u32 *recs, u32 *rec_entries)
+{
+	u32 i, j;
+
+	for (i = 0; i < size; i++)
+	{
+		*entries += CompactTable[i].cnt;
+		for (j = 0; j < CompactTable[i].cnt; j++)
+		{
+			*pids += CompactTable[i].array[j].cnt;
+			if (CompactTable[i].array[j].CompactTable != NULL)
+			{
+				(*recs)++;
+				DFC_CountRecursive(CompactTable[i].array[j].CompactTable, rec_size, rec_entries, pids);
+			}
+		}
+	}
+}
+
+static void DFC_CountCT8(CT_Type_2_8B *CompactTable, u32 size, u32 rec_size, u32 *entries, u32 *pids, u32 *recs, u32 *rec_entries)
+{
+	u32 i, j;
+
+	for (i = 0; i < size; i++)
+	{
+		*entries += CompactTable[i].cnt;
+		for (j = 0; j < CompactTable[i].cnt; j++)
+		{
+			*pids += CompactTable[i].array[j].cnt;
+			if (CompactTable[i].array[j].CompactTable != NULL)
+			{
+				(*recs)++;
+				DFC_CountRecursive(CompactTable[i].array[j].CompactTable, rec_size, rec_entries, pids);
+			}
+		}
+	}
+}
+
+/* Appends cnt PIDs to the pool and returns the index of the first one */
+static u32 DFC_PackPIDs(DFC_STRUCTURE *dfc, u32 *pid, u32 cnt)
+{
+	u32 start = dfc->PIDPoolCnt;
+
+	if (cnt)
+	{
+		memcpy(&dfc->PIDPool[start], pid, sizeof(u32) * cnt);
+		dfc->PIDPoolCnt += cnt;
+	}
+
+	return start;
+}
+
+/* Packs one recursive table and returns its index + 1 */
+static u32 DFC_PackRecursive(DFC_STRUCTURE *dfc, u8 *DirectFilter, CT_Type_2_2B *CompactTable)
+{
+	u32 rec = dfc->RecCT.cnt++;
+	u32 *bucket = &dfc->RecCT.bucket[rec * (dfc->config.rec_ct_size + 1)];
+	u32 k, l;
+
+	memcpy(&dfc->RecCT.df[rec * DFC_DFBytes(dfc)], DirectFilter, DFC_DFBytes(dfc));
+
+	for (k = 0; k < dfc->config.rec_ct_size; k++)
+	{
+		bucket[k] = dfc->RecCT.entry_cnt;
+		for (l = 0; l < CompactTable[k].cnt; l++)
+		{
+			CT_Flat_Entry *e = &dfc->RecCT.entry[dfc->RecCT.entry_cnt++];
+
+			e->pat = CompactTable[k].array[l].pat;
+			e->pid_cnt = CompactTable[k].array[l].cnt;
+			e->pid_start = DFC_PackPIDs(dfc, CompactTable[k].array[l].pid, e->pid_cnt);
+			e->rec = 0;
+		}
+	}
+	bucket[dfc->config.rec_ct_size] = dfc->RecCT.entry_cnt;
+
+	return rec + 1;
+}
+
+static void DFC_PackCT(DFC_STRUCTURE *dfc, CT_Flat *flat, CT_Type_2 *CompactTable, u32 size)
+{
+	u32 i, j;
+
+	for (i = 0; i < size; i++)
+	{
+		flat->bucket[i] = flat->entry_cnt;
+		for (j = 0; j < CompactTable[i].cnt; j++)
+		{
+			CT_Flat_Entry *e = &flat->entry[flat->entry_cnt++];
+
+			e->pat = CompactTable[i].array[j].pat;
+			e->pid_cnt = CompactTable[i].array[j].cnt;
+			e->pid_start = DFC_PackPIDs(dfc, CompactTable[i].array[j].pid, e->pid_cnt);
+			e->rec = 0;
+			if (CompactTable[i].array[j].CompactTable != NULL)
+			{
+				e->rec = DFC_PackRecursive(dfc, CompactTable[i].array[j].DirectFilter, CompactTable[i].array[j].CompactTable);
+			}
+		}
+	}
+	flat->bucket[size] = flat->entry_cnt;
+}
+
+static void DFC_PackCT8(DFC_STRUCTURE *dfc, CT_Flat_8B *flat, CT_Type_2_8B *CompactTable, u32 size)
+{
+	u32 i, j;
+
+	for (i = 0; i < size; i++)
+	{
+		flat->bucket[i] = flat->entry_cnt;
+		for (j = 0; j < CompactTable[i].cnt; j++)
+		{
+			CT_Flat_8B_Entry *e = &flat->entry[flat->entry_cnt++];
+
+			e->pat = CompactTable[i].array[j].pat;
+			e->pid_cnt = CompactTable[i].array[j].cnt;
+			e->pid_start = DFC_PackPIDs(dfc, CompactTable[i].array[j].pid, e->pid_cnt);
+			e->rec = 0;
+			if (CompactTable[i].array[j].CompactTable != NULL)
+			{
+				e->rec = DFC_PackRecursive(dfc, CompactTable[i].array[j].DirectFilter, CompactTable[i].array[j].CompactTable);
+			}
+		}
+	}
+	flat->bucket[size] = flat->entry_cnt;
+}
+
+/* Packs CompactTable2/4/8 (and their recursive tables) into the flat layout */
+static int DFC_FlattenCT(DFC_STRUCTURE *dfc)
+{
+	u32 ct2 = 0, ct4 = 0, ct8 = 0;
+	u32 recs = 0, rec_entries = 0, pids = 0;
+
+	DFC_CountCT(dfc->CompactTable2, dfc->CT2.mask + 1, dfc->config.rec_ct_size, &ct2, &pids, &recs, &rec_entries);
+	DFC_CountCT(dfc->CompactTable4, dfc->CT4.mask + 1, dfc->config.rec_ct_size, &ct4, &pids, &recs, &rec_entries);
+	DFC_CountCT8(dfc->CompactTable8, dfc->CT8.mask + 1, dfc->config.rec_ct_size, &ct8, &pids, &recs, &rec_entries);
+
+	/* + 1 so that empty tables still get a valid pointer */
+	dfc->CT2.bucket = (u32 *)my_zalloc(dfc, sizeof(u32) * (dfc->CT2.mask + 2), DFC_MEMORY_TYPE__CT2);
+	dfc->CT2.entry = (CT_Flat_Entry *)my_zalloc(dfc, sizeof(CT_Flat_Entry) * (ct2 + 1), DFC_MEMORY_TYPE__CT2);
+	dfc->CT4.bucket = (u32 *)my_zalloc(dfc, sizeof(u32) * (dfc->CT4.mask + 2), DFC_MEMORY_TYPE__CT4);
+	dfc->CT4.entry = (CT_Flat_Entry *)my_zalloc(dfc, sizeof(CT_Flat_Entry) * (ct4 + 1), DFC_MEMORY_TYPE__CT4);
+	dfc->CT8.bucket = (u32 *)my_zalloc(dfc, sizeof(u32) * (dfc->CT8.mask + 2), DFC_MEMORY_TYPE__CT8);
+	dfc->CT8.entry = (CT_Flat_8B_Entry *)my_zalloc(dfc, sizeof(CT_Flat_8B_Entry) * (ct8 + 1), DFC_MEMORY_TYPE__CT8);
+	dfc->RecCT.df = (u8 *)my_zalloc(dfc, DFC_DFBytes(dfc) * recs + 1, DFC_MEMORY_TYPE__RECURSIVE);
+	dfc->RecCT.bucket = (u32 *)my_zalloc(dfc, sizeof(u32) * (dfc->config.rec_ct_size + 1) * recs + 1, DFC_MEMORY_TYPE__RECURSIVE);
+	dfc->RecCT.entry = (CT_Flat_Entry *)my_zalloc(dfc, sizeof(CT_Flat_Entry) * (rec_entries + 1), DFC_MEMORY_TYPE__RECURSIVE);
+	dfc->PIDPool = (u32 *)my_zalloc(dfc, sizeof(u32) * (pids + 1), DFC_MEMORY_TYPE__PID);
+
+	if (dfc->CT2.bucket == NULL || dfc->CT2.entry == NULL ||
+		dfc->CT4.bucket == NULL || dfc->CT4.entry == NULL ||
+		dfc->CT8.bucket == NULL || dfc->CT8.entry == NULL ||
+		dfc->RecCT.df == NULL || dfc->RecCT.bucket == NULL ||
+		dfc->RecCT.entry == NULL || dfc->PIDPool == NULL)
+	{
+		printf("Failed to allocate memory for flattened compact tables.\n");
+		return -1;
+	}
+
+	DFC_PackCT(dfc, &dfc->CT2, dfc->CompactTable2, dfc->CT2.mask + 1);
+	DFC_PackCT(dfc, &dfc->CT4, dfc->CompactTable4, dfc->CT4.mask + 1);
+	DFC_PackCT8(dfc, &dfc->CT8, dfc->CompactTable8, dfc->CT8.mask + 1);
+
+	return 0;
+}
+
+/* Second byte a nocase 1B pattern is reported for, or -1 */
+static int DFC_CT1OtherCase(DFC_PATTERN *p)
+{
+	u8 c = p->casepatrn[0];
+	u8 o = (c >= 97/*a*/ && c <= 122/*z*/) ? toupper(c) : tolower(c);
+
+	return (p->nocase && o != c) ? o : -1;
+}
+
+/* Counts the 1B patterns per byte, then fills the PID list in pattern order */
+static int DFC_BuildCT1(DFC_STRUCTURE *dfc)
+{
+	CT_Type_1 *ct = &dfc->CompactTable1;
+	u32 pos[CT1_TABLE_SIZE];
+	DFC_PATTERN *plist;
+	u32 i;
+	int o;
+
+	memset(ct->start, 0, sizeof(ct->start));
+
+	for (plist = dfc->dfcPatterns; plist != NULL; plist = plist->next)
+	{
+		if (plist->n == 1)
+		{
+			ct->start[plist->casepatrn[0] + 1]++;
+			if ((o = DFC_CT1OtherCase(plist)) >= 0)
+			{
+				ct->start[o + 1]++;
+			}
+		}
+	}
+
+	for (i = 0; i < CT1_TABLE_SIZE; i++)
+	{
+		ct->start[i + 1] += ct->start[i];
+		pos[i] = ct->start[i];
+	}
+
+	if (ct->start[CT1_TABLE_SIZE] == 0)
+	{
+		return 0;
+	}
+
+	ct->pid = (u32 *)my_malloc(dfc, sizeof(u32) * ct->start[CT1_TABLE_SIZE], DFC_MEMORY_TYPE__CT1);
+	if (ct->pid == NULL)
+	{
+		return -1;
+	}
+
+	for (plist = dfc->dfcPatterns; plist != NULL; plist = plist->next)
+	{
+		if (plist->n == 1)
+		{
+			ct->pid[pos[plist->casepatrn[0]]++] = plist->iid;
+			if ((o = DFC_CT1OtherCase(plist)) >= 0)
+			{
+				ct->pid[pos[o]++] = plist->iid;
+			}
+		}
+	}
+
+	return 0;
+}
+
+/****************************************************/
+/*              Parallel compilation                */
+/****************************************************/
+typedef struct _dfc_compile_job
+{
+	DFC_STRUCTURE *dfc;
+	int (*run)(DFC_STRUCTURE *dfc, u32 part, u32 parts, void *arg);
+	void *arg;
+	u32 part;
+	u32 parts;
+	int ret;
+} DFC_COMPILE_JOB;
+
+/* Part of the table (mask + 1 buckets) that bucket crc belongs to; parts
+ * are contiguous ranges, so no two parts write the same cache lines */
+static inline u32 DFC_PartOf(u32 crc, u32 mask, u32 parts)
+{
+	return (u32)(((u64)crc * parts) / ((u64)mask + 1));
+}
+
+static void *DFC_CompileWorker(void *arg)
+{
+	DFC_COMPILE_JOB *job = (DFC_COMPILE_JOB *)arg;
+
+	job->ret = job->run(job->dfc, job->part, job->parts, job->arg);
+
+	return NULL;
+}
+
+/*
+*  Runs run(dfc, part, parts, arg) for every part on its own thread; part 0
+*  runs on the caller. Parts must only write memory no other part touches.
+*  A custom allocator is serialized by a mutex while the parts run.
+*/
+static int DFC_RunParts(DFC_STRUCTURE *dfc, int (*run)(DFC_STRUCTURE *, u32, u32, void *), void *arg)
+{
+	DFC_COMPILE_JOB job[DFC_COMPILE_THREADS_MAX];
+	pthread_t tid[DFC_COMPILE_THREADS_MAX];
+	int started[DFC_COMPILE_THREADS_MAX];
+	u32 parts = dfc->compile_threads;
+	u32 p;
+	int ret = 0;
+
+	if (parts <= 1)
+	{
+		return run(dfc, 0, 1, arg);
+	}
+
+	if (dfc->allocator.malloc_fn != libc_malloc)
+	{
+		dfc->alloc_lock = (pthread_mutex_t *)malloc(sizeof(pthread_mutex_t));
+		if (dfc->alloc_lock == NULL)
+		{
+			return run(dfc, 0, 1, arg);
+		}
+
+		pthread_mutex_init(dfc->alloc_lock, NULL);
+	}
+
+	for (p = 0; p < parts; p++)
+	{
+		job[p].dfc = dfc;
+		job[p].run = run;
+		job[p].arg = arg;
+		job[p].part = p;
+		job[p].parts = parts;
+		job[p].ret = 0;
+
+		/* Without a thread the part runs on the caller after part 0 */
+		started[p] = p > 0 && pthread_create(&tid[p], NULL, DFC_CompileWorker, &job[p]) == 0;
+	}
+
+	for (p = 0; p < parts; p++)
+	{
+		if (started[p])
+		{
+			pthread_join(tid[p], NULL);
+		}
+		else
+		{
+			DFC_CompileWorker(&job[p]);
+		}
+
+		if (job[p].ret < 0)
+		{
+			ret = -1;
+		}
+	}
+
+	if (dfc->alloc_lock != NULL)
+	{
+		pthread_mutex_destroy(dfc->alloc_lock);
+		free(dfc->alloc_lock);
+		dfc->alloc_lock = NULL;
+	}
+
+	return ret;
+}
+
+/* Filters one DF setup part writes; merged into dfc with OR */
+typedef struct _dfc_df_set
+{
+	u8 DirectFilter1[DF_SIZE_REAL];
+	u8 cDF0[256];
+	u8 cDF1[DF_SIZE_REAL];
+	u8 cDF2[DF_SIZE_REAL];
+	u8 ADD_DF_4_plus[DF_SIZE_REAL];
+	u8 ADD_DF_4_1[DF_SIZE_REAL];
+	u8 ADD_DF_8_1[DF_SIZE_REAL];
+	u8 ADD_DF_8_2[DF_SIZE_REAL];
+} DFC_DF_SET;
+
+/* DF bits of every parts-th pattern into ((DFC_DF_SET *)arg)[part]. The
+ * filters are built with the full 2B keys and sized by DFC_ResizeDF(). */
+static int DFC_SetupDFPart(DFC_STRUCTURE *dfc, u32 part, u32 parts, void *arg)
+{
+	DFC_DF_SET *df = (DFC_DF_SET *)arg + part;
+	u32 idx = 0;
+	u32 alpha_cnt;
+
+	int j, k;
+	DFC_PATTERN *plist;
+
+	u8 temp[8], flag[8];
+	u16 fragment_16;
+	u32 byteIndex, bitMask;
+
+	for (plist = dfc->dfcPatterns; plist != NULL; plist = plist->next, idx++)
+	{
+		if (idx % parts != part)
+		{
+			continue;
+		}
+
+		/* 0. Initialization for DF8 (for 1B patterns)*/
+		if (plist->n == 1)
+		{
+			temp[0] = dfc->fold ? xlatcase[plist->casepatrn[0]] : plist->casepatrn[0];
+			for (j = 0; j < 256; j++)
+			{
+				temp[1] = j;
+
+				fragment_16 = (temp[1] << 8) | temp[0];
+				byteIndex = (u32)BINDEX(fragment_16);
+				bitMask = BMASK(fragment_16);
+
+				df->DirectFilter1[byteIndex] |= bitMask;
+			}
+
+			/* CT1 is indexed by the raw byte in both modes */
+			temp[0] = plist->casepatrn[0];
+			df->cDF0[temp[0]] = 1;
+
+			if (plist->nocase)
+			{
+				if (plist->casepatrn[0] >= 97/*a*/ && plist->casepatrn[0] <= 122/*z*/)
+				{
+					/* when the pattern is lower case */
+					temp[0] = toupper(plist->casepatrn[0]);
+				}
+				else
+				{
+					/* when the pattern is upper case */
+					temp[0] = tolower(plist->casepatrn[0]);
+				}
+
+				for (j = 0; j < 256 && !dfc->fold; j++)
+				{
+					temp[1] = j;
+
+					fragment_16 = (temp[1] << 8) | temp[0];
+					byteIndex = (u32)BINDEX(fragment_16);
+					bitMask = BMASK(fragment_16);
+
+					df->DirectFilter1[byteIndex] |= bitMask;
+				}
+
+				df->cDF0[temp[0]] = 1;
+			}
+		}
+
+		/* 1. Initialization for DF1 */
+		if (plist->n > 1)
+		{
+			alpha_cnt = 0;
+
+			do
+			{
+				for (j = 1, k = 0; j >= 0; --j, k++)
+				{
+					flag[k] = (alpha_cnt >> j) & 1;
+				}
+
+				if (plist->n == 2)
+				{
+					for (j = plist->n - 2, k = 0; j < plist->n; j++, k++)
+					{
+						Build_pattern(dfc, plist, flag, temp, 0, j, k);
+					}
+				}
+				else if (plist->n == 3)
+				{
+					//for (j=0 , k=0; j < 2; j++, k++){
+					for (j = plist->n - 2, k = 0; j < plist->n; j++, k++)
+					{
+						Build_pattern(dfc, plist, flag, temp, 0, j, k);
+					}
+				}
+				else if (plist->n < 8)
+				{
+					for (j = plist->n - 4, k = 0; j < plist->n - 2; j++, k++)
+					{
+						Build_pattern(dfc, plist, flag, temp, 0, j, k);
+					}
+				}
+				else     // len >= 8
+				{
+					for (j = plist->ct8_off, k = 0; j < plist->ct8_off + 2; j++, k++)
+					{
+						Build_pattern(dfc, plist, flag, temp, 0, j, k);
+					}
+				}
+
+				fragment_16 = (temp[1] << 8) | temp[0];
+				byteIndex = (u32)BINDEX(fragment_16);
+				bitMask = BMASK(fragment_16);
+
+				df->DirectFilter1[byteIndex] |= bitMask;
+
+				if (plist->n == 2 || plist->n == 3)
+				{
+					df->cDF1[byteIndex] |= bitMask;
+				}
+
+				alpha_cnt++;
+			}
+			while (alpha_cnt < DFC_Variants(dfc, 2));
+		}
+
+		/* Initializing 4B DF, 8B DF */
+		if (plist->n >= 4)
+		{
+			alpha_cnt = 0;
+
+			do
+			{
+				for (j = 3, k = 0; j >= 0; --j, k++)
+				{
+					flag[k] = (alpha_cnt >> j) & 1;
+				}
+
+				if (plist->n < 8)
+				{
+					for (j = plist->n - 4, k = 0; j < plist->n; j++, k++)
+					{
+						Build_pattern(dfc, plist, flag, temp, 0, j, k);
+					}
+				}
+				else
+				{
+					for (j = plist->ct8_off, k = 0; j < plist->ct8_off + 4; j++, k++)
+					{
+						Build_pattern(dfc, plist, flag, temp, 0, j, k);
+					}
+				}
+
+				byteIndex = BINDEX(*(((u16*)temp) + 1));
+				bitMask = BMASK(*(((u16*)temp) + 1));
+
+				df->ADD_DF_4_plus[byteIndex] |= bitMask;
+				if (plist->n >= 4 && plist->n < 8)
+				{
+					df->ADD_DF_4_1[byteIndex] |= bitMask;
+
+					fragment_16 = (temp[1] << 8) | temp[0];
+					byteIndex = BINDEX(fragment_16);
+					bitMask = BMASK(fragment_16);
+
+					df->cDF2[byteIndex] |= bitMask;
+				}
+				alpha_cnt++;
+			}
+			while (alpha_cnt < DFC_Variants(dfc, 4));
+		}
+
+		if (plist->n >= 8)
+		{
+			alpha_cnt = 0;
+
+			do
+			{
+				for (j = 7, k = 0; j >= 0; --j, k++)
+				{
+					flag[k] = (alpha_cnt >> j) & 1;
+				}
+
+				for (j = plist->ct8_off, k = 0; j < plist->ct8_off + 8; j++, k++)
+				{
+					Build_pattern(dfc, plist, flag, temp, 0, j, k);
+				}
+
+				byteIndex = BINDEX(*(((u16*)temp) + 3));
+				bitMask = BMASK(*(((u16*)temp) + 3));
+
+				df->ADD_DF_8_1[byteIndex] |= bitMask;
+
+				byteIndex = BINDEX(*(((u16*)temp) + 2));
+				bitMask = BMASK(*(((u16*)temp) + 2));
+
+				df->ADD_DF_8_2[byteIndex] |= bitMask;
+
+				alpha_cnt++;
+			}
+			while (alpha_cnt < DFC_Variants(dfc, 8));
+		}
+
+	}
+
+	return 0;
+}
+
+/* Sets up DirectFilter1, cDF0-2 and ADD_DF_* from all patterns */
+static int DFC_SetupDF(DFC_STRUCTURE *dfc)
+{
+	u32 parts = dfc->compile_threads > 1 ? dfc->compile_threads : 1;
+	DFC_DF_SET *set = (DFC_DF_SET *)my_zalloc(dfc, sizeof(DFC_DF_SET) * parts, DFC_MEMORY_TYPE__DFC);
+	u32 p, i;
+
+	if (set == NULL)
+	{
+		return -1;
+	}
+
+	if (DFC_RunParts(dfc, DFC_SetupDFPart, set) < 0)
+	{
+		my_free(dfc, set);
+		return -1;
+	}
+
+	for (p = 0; p < parts; p++)
+	{
+		for (i = 0; i < DF_SIZE_REAL; i++)
+		{
+			dfc->DirectFilter1[i] |= set[p].DirectFilter1[i];
+			dfc->cDF1[i] |= set[p].cDF1[i];
+			dfc->cDF2[i] |= set[p].cDF2[i];
+			dfc->ADD_DF_4_plus[i] |= set[p].ADD_DF_4_plus[i];
+			dfc->ADD_DF_4_1[i] |= set[p].ADD_DF_4_1[i];
+			dfc->ADD_DF_8_1[i] |= set[p].ADD_DF_8_1[i];
+			dfc->ADD_DF_8_2[i] |= set[p].ADD_DF_8_2[i];
+		}
+
+		for (i = 0; i < 256; i++)
+		{
+			dfc->cDF0[i] |= set[p].cDF0[i];
+		}
+	}
+
+	my_free(dfc, set);
+
+	return 0;
+}
+
+/* Distinct 2B keys in a full-size filter */
+static u32 DFC_DFKeys(const u8 *df)
+{
+	u32 i, keys = 0;
+
+	for (i = 0; i < DF_SIZE_REAL; i += 8)
+	{
+		u64 w;
+
+		memcpy(&w, &df[i], 8);
+		keys += __builtin_popcountll(w);
+	}
+
+	return keys;
+}
+
+/* Rehashes a filter built with full 2B keys into its DFC_DFKey() bits */
+static void DFC_FoldDF(const DFC_STRUCTURE *dfc, u8 *df)
+{
+	u8 folded[DF_SIZE_REAL];
+	u32 data;
+
+	memset(folded, 0, sizeof(folded));
+	for (data = 0; data < DF_SIZE; data++)
+	{
+		if (df[BINDEX(data)] & BMASK(data))
+		{
+			u32 key = DFC_DFKey(dfc, data);
+
+			folded[BINDEX(key)] |= BMASK(key);
+		}
+	}
+
+	memcpy(df, folded, sizeof(folded));
+}
+
+/*
+*  Sizes the direct filters. In auto mode df_bits is the smallest that
+*  gives DF_AUTO_BITS_PER_KEY bits to each key of the fullest filter:
+*  DF1 holds every length class, cDF1 the 2-3B, ADD_DF_4_1 the 4-7B and
+*  ADD_DF_8_* the 8B+ patterns, but a class with many case variants can
+*  still outgrow DF1.
+*/
+static void DFC_ResizeDF(DFC_STRUCTURE *dfc)
+{
+	u8 *filters[7] = { dfc->DirectFilter1, dfc->cDF1, dfc->cDF2, dfc->ADD_DF_4_plus,
+					   dfc->ADD_DF_4_1, dfc->ADD_DF_8_1, dfc->ADD_DF_8_2 };
+	u32 i;
+
+	if (dfc->config.df_bits == 0)
+	{
+		u32 keys = 0;
+
+		for (i = 0; i < 7; i++)
+		{
+			u32 k = DFC_DFKeys(filters[i]);
+
+			keys = k > keys ? k : keys;
+		}
+
+		dfc->config.df_bits = DF_BITS_MIN;
+		while (dfc->config.df_bits < DF_BITS && (1u << dfc->config.df_bits) < (u64)keys * DF_AUTO_BITS_PER_KEY)
+		{
+			dfc->config.df_bits++;
+		}
+	}
+
+	dfc->df_mask = (1u << dfc->config.df_bits) - 1;
+
+	if (dfc->config.df_bits < DF_BITS)
+	{
+		for (i = 0; i < 7; i++)
+		{
+			DFC_FoldDF(dfc, filters[i]);
+		}
+	}
+}
+
+/*
+*  Interleaved filter layout: the search tests DF1 and cDF1 with the key of
+*  the DF1 window, ADD_DF_4_* with the key 2 bytes on, ADD_DF_8_2 and
+*  ADD_DF_8_1 with the keys 4 and 6 bytes on. One byte per key holds all
+*  of them, so each key costs one load instead of one per filter. The
+*  SIMD DF1 scan keeps reading the DF1 bitmap.
+*/
+static int DFC_BuildDFBits(DFC_STRUCTURE *dfc)
+{
+	const u8 *filters[6] = { dfc->DirectFilter1, dfc->cDF1, dfc->ADD_DF_4_plus,
+							 dfc->ADD_DF_4_1, dfc->ADD_DF_8_1, dfc->ADD_DF_8_2 };
+	u32 key;
+	int f;
+
+	if (!dfc->config.df_interleave)
+	{
+		return 0;
+	}
+
+	dfc->DFBits = (u8 *)my_zalloc(dfc, (u64)dfc->df_mask + 1, DFC_MEMORY_TYPE__DFC);
+	if (dfc->DFBits == NULL)
+	{
+		return -1;
+	}
+
+	for (key = 0; key <= dfc->df_mask; key++)
+	{
+		for (f = 0; f < 6; f++)
+		{
+			if (filters[f][BINDEX(key)] & BMASK(key))
+			{
+				dfc->DFBits[key] |= 1 << f;
+			}
+		}
+	}
+
+	return 0;
+}
+
+/* Tests key against one filter: its DFB_* bit with the interleaved layout,
+ * its bit in df otherwise */
+static inline int DFC_DFTest(const DFC_STRUCTURE *dfc, const u8 *df, u32 bit, u32 key)
+{
+	if (dfc->DFBits != NULL)
+	{
+		return dfc->DFBits[key] & bit;
+	}
+
+	return df[BINDEX(key)] & BMASK(key);
+}
+
+/* Auto rec_ct_size: room for the keys of the largest group of PIDs that
+ * gets a recursive table */
+static void DFC_SizeRecursive(DFC_STRUCTURE *dfc)
+{
+	u32 i, n, cnt, max = 0;
+
+	if (dfc->config.rec_ct_size == 0)
+	{
+		/* A 3B pattern under a CT2 key adds all 256 preceding bytes */
+		for (i = 0; i <= dfc->CT2.mask; i++)
+		{
+			for (n = 0; n < dfc->CompactTable2[i].cnt; n++)
+			{
+				cnt = dfc->CompactTable2[i].array[n].cnt;
+				if (cnt >= dfc->config.rec_boundary && 256 * cnt > max)
+				{
+					max = 256 * cnt;
+				}
+			}
+		}
+
+		for (i = 0; i <= dfc->CT4.mask; i++)
+		{
+			for (n = 0; n < dfc->CompactTable4[i].cnt; n++)
+			{
+				cnt = dfc->CompactTable4[i].array[n].cnt;
+				if (cnt >= dfc->config.rec_boundary && DFC_Variants(dfc, 2) * cnt > max)
+				{
+					max = DFC_Variants(dfc, 2) * cnt;
+				}
+			}
+		}
+
+		for (i = 0; i <= dfc->CT8.mask; i++)
+		{
+			for (n = 0; n < dfc->CompactTable8[i].cnt; n++)
+			{
+				cnt = dfc->CompactTable8[i].array[n].cnt;
+				if (cnt >= dfc->config.rec_boundary && DFC_Variants(dfc, 2) * cnt > max)
+				{
+					max = DFC_Variants(dfc, 2) * cnt;
+				}
+			}
+		}
+
+		dfc->config.rec_ct_size = DFC_TableSize(max, RECURSIVE_CT_SIZE);
+	}
+
+	dfc->rec_mask = dfc->config.rec_ct_size - 1;
+}
+
+/* Inserts the CT2/CT4/CT8 keys of all patterns that hash into this part */
+static int DFC_SetupCTPart(DFC_STRUCTURE *dfc, u32 part, u32 parts, void *arg)
+{
+	u32 alpha_cnt;
+
+	int j, k;
+	u32 m, n;
+	DFC_PATTERN *plist;
+
+	u8 temp[8], flag[8];
+	u16 fragment_16;
+	u32 fragment_32;
+	u64 fragment_64;
+
+	for (plist = dfc->dfcPatterns; plist != NULL; plist = plist->next)
+	{
+		if (plist->n == 2 || plist->n == 3)
+		{
+			alpha_cnt = 0;
+
+			do
+			{
+				u32 crc;
+
+				// 1.
+				for (j = 1, k = 0; j >= 0; --j, k++)
+				{
+					flag[k] = (alpha_cnt >> j) & 1;
+				}
+
+				for (j = plist->n - 2, k = 0; j < plist->n; j++, k++)
+				{
+					Build_pattern(dfc, plist, flag, temp, 0, j, k);
+				}
+
+				// 2.
+				fragment_16 = (temp[1] << 8) | temp[0];
+				crc = my_crc32_u16(0, fragment_16);
+
+				// 3.
+				crc &= dfc->CT2.mask;
+
+				/* Another part inserts into this bucket */
+				if (DFC_PartOf(crc, dfc->CT2.mask, parts) != part)
+				{
+					alpha_cnt++;
+					continue;
+				}
+
+				// 4.
+				if (dfc->CompactTable2[crc].cnt != 0)
+				{
+					for (n = 0; n < dfc->CompactTable2[crc].cnt; n++)
+					{
+						if (dfc->CompactTable2[crc].array[n].pat == fragment_16)
+						{
+							break;
+						}
+					}
+
+					if (n == dfc->CompactTable2[crc].cnt)  // If not found,
+					{
+						CT_Type_2_Array *tmp;
+						dfc->CompactTable2[crc].cnt++;
+
+						tmp = (CT_Type_2_Array *)my_realloc(dfc, (void*)dfc->CompactTable2[crc].array, sizeof(CT_Type_2_Array) * dfc->CompactTable2[crc].cnt, DFC_MEMORY_TYPE__CT2);
+						if (tmp == NULL)
+						{
+							return -1;
+						}
+
+						dfc->CompactTable2[crc].array = tmp;
+						dfc->CompactTable2[crc].array[dfc->CompactTable2[crc].cnt - 1].pat = fragment_16;
+						dfc->CompactTable2[crc].array[dfc->CompactTable2[crc].cnt - 1].cnt = 1;
+
+						dfc->CompactTable2[crc].array[dfc->CompactTable2[crc].cnt - 1].pid = (u32 *)my_zalloc(dfc, sizeof(u32), DFC_MEMORY_TYPE__CT2);
+						if (dfc->CompactTable2[crc].array[dfc->CompactTable2[crc].cnt - 1].pid == NULL)
+						{
+							return -1;
+						}
+
+						dfc->CompactTable2[crc].array[dfc->CompactTable2[crc].cnt - 1].pid[0] = plist->iid;
+						dfc->CompactTable2[crc].array[dfc->CompactTable2[crc].cnt - 1].DirectFilter = NULL;
+						dfc->CompactTable2[crc].array[dfc->CompactTable2[crc].cnt - 1].CompactTable = NULL;
+					}
+					else   // If found,
+					{
+						for (m = 0; m < dfc->CompactTable2[crc].array[n].cnt; m++)
+						{
+							if (dfc->CompactTable2[crc].array[n].pid[m] == plist->iid)
+							{
+								break;
+							}
+						}
 						if (m == dfc->CompactTable2[crc].array[n].cnt)
 						{
-							u32 *tmp;
-							dfc->CompactTable2[crc].array[n].cnt++;
+							u32 *tmp;
+							dfc->CompactTable2[crc].array[n].cnt++;
+
+							tmp = (u32 *)my_realloc(dfc, (void*)dfc->CompactTable2[crc].array[n].pid, sizeof(u32) * dfc->CompactTable2[crc].array[n].cnt, DFC_MEMORY_TYPE__CT2);
+							if (tmp == NULL)
+							{
+								return -1;
+							}
+
+							dfc->CompactTable2[crc].array[n].pid = tmp;
+							dfc->CompactTable2[crc].array[n].pid[dfc->CompactTable2[crc].array[n].cnt - 1] = plist->iid;
+						}
+					}
+				}
+				else   // If there is no elements in the CT4,
+				{
+					dfc->CompactTable2[crc].cnt = 1;
+
+					dfc->CompactTable2[crc].array = (CT_Type_2_Array *)my_zalloc(dfc, sizeof(CT_Type_2_Array), DFC_MEMORY_TYPE__CT2);
+					if (dfc->CompactTable2[crc].array == NULL)
+					{
+						return -1;
+					}
+
+					memset(dfc->CompactTable2[crc].array, 0, sizeof(CT_Type_2_Array));
+
+					dfc->CompactTable2[crc].array[0].pat = fragment_16;
+					dfc->CompactTable2[crc].array[0].cnt = 1;
+
+					dfc->CompactTable2[crc].array[0].pid = (u32 *)my_zalloc(dfc, sizeof(u32), DFC_MEMORY_TYPE__CT2);
+					if (dfc->CompactTable2[crc].array[0].pid == NULL)
+					{
+						return -1;
+					}
+
+					dfc->CompactTable2[crc].array[0].pid[0] = plist->iid;
+					dfc->CompactTable2[crc].array[0].DirectFilter = NULL;
+					dfc->CompactTable2[crc].array[0].CompactTable = NULL;
+				}
+
+				alpha_cnt++;
+			}
+			while (alpha_cnt < DFC_Variants(dfc, 2));
+		}
+
+		/* CT4 initialization */
+		if (plist->n >= 4 && plist->n < 8)
+		{
+			alpha_cnt = 0;
+			do
+			{
+				u32 crc;
+
+				// 1.
+				for (j = 3, k = 0; j >= 0; --j, k++)
+				{
+					flag[k] = (alpha_cnt >> j) & 1;
+				}
+
+				for (j = plist->n - 4, k = 0; j < plist->n; j++, k++)
+				{
+					Build_pattern(dfc, plist, flag, temp, 0, j, k);
+				}
+
+				// 2.
+				fragment_32 = ((u32)temp[3] << 24) | (temp[2] << 16) | (temp[1] << 8) | temp[0];
+				crc = my_crc32_u32(0, fragment_32);
+
+				// 3.
+				crc &= dfc->CT4.mask;
+
+				/* Another part inserts into this bucket */
+				if (DFC_PartOf(crc, dfc->CT4.mask, parts) != part)
+				{
+					alpha_cnt++;
+					continue;
+				}
+
+				// 4.
+				if (dfc->CompactTable4[crc].cnt != 0)
+				{
+					for (n = 0; n < dfc->CompactTable4[crc].cnt; n++)
+					{
+						if (dfc->CompactTable4[crc].array[n].pat == fragment_32)
+						{
+							break;
+						}
+					}
+
+					if (n == dfc->CompactTable4[crc].cnt)  // If not found,
+					{
+						CT_Type_2_Array *tmp;
+						dfc->CompactTable4[crc].cnt++;
+
+						tmp = (CT_Type_2_Array *)my_realloc(dfc, (void*)dfc->CompactTable4[crc].array, sizeof(CT_Type_2_Array) * dfc->CompactTable4[crc].cnt, DFC_MEMORY_TYPE__CT4);
+						if (tmp == NULL)
+						{
+							return -1;
+						}
+						dfc->CompactTable4[crc].array = tmp;
+
+						dfc->CompactTable4[crc].array[dfc->CompactTable4[crc].cnt - 1].pat = fragment_32;
+						dfc->CompactTable4[crc].array[dfc->CompactTable4[crc].cnt - 1].cnt = 1;
+
+						dfc->CompactTable4[crc].array[dfc->CompactTable4[crc].cnt - 1].pid = (u32 *)my_zalloc(dfc, sizeof(u32), DFC_MEMORY_TYPE__CT4);
+						if (dfc->CompactTable4[crc].array[dfc->CompactTable4[crc].cnt - 1].pid == NULL)
+						{
+							return -1;
+						}
+
+						dfc->CompactTable4[crc].array[dfc->CompactTable4[crc].cnt - 1].pid[0] = plist->iid;
+						dfc->CompactTable4[crc].array[dfc->CompactTable4[crc].cnt - 1].DirectFilter = NULL;
+						dfc->CompactTable4[crc].array[dfc->CompactTable4[crc].cnt - 1].CompactTable = NULL;
+					}
+					else   // If found,
+					{
+						for (m = 0; m < dfc->CompactTable4[crc].array[n].cnt; m++)
+						{
+							if (dfc->CompactTable4[crc].array[n].pid[m] == plist->iid)
+							{
+								break;
+							}
+						}
+						if (m == dfc->CompactTable4[crc].array[n].cnt)
+						{
+							u32 *tmp;
+							dfc->CompactTable4[crc].array[n].cnt++;
+
+							tmp = (u32 *)my_realloc(dfc, (void*)dfc->CompactTable4[crc].array[n].pid, sizeof(u32) * dfc->CompactTable4[crc].array[n].cnt, DFC_MEMORY_TYPE__CT4);
+							if (tmp == NULL)
+							{
+								return -1;
+							}
+
+							dfc->CompactTable4[crc].array[n].pid = tmp;
+							dfc->CompactTable4[crc].array[n].pid[dfc->CompactTable4[crc].array[n].cnt - 1] = plist->iid;
+						}
+					}
+				}
+				else   // If there is no elements in the CT4,
+				{
+					dfc->CompactTable4[crc].cnt = 1;
+
+					dfc->CompactTable4[crc].array = (CT_Type_2_Array *)my_zalloc(dfc, sizeof(CT_Type_2_Array), DFC_MEMORY_TYPE__CT4);
+					if (dfc->CompactTable4[crc].array == NULL)
+					{
+						printf("Failed to allocate memory for recursive things.\n");
+						return -1;
+					}
+
+					memset(dfc->CompactTable4[crc].array, 0, sizeof(CT_Type_2_Array));
+
+					dfc->CompactTable4[crc].array[0].pat = fragment_32;
+					dfc->CompactTable4[crc].array[0].cnt = 1;
+
+					dfc->CompactTable4[crc].array[0].pid = (u32 *)my_zalloc(dfc, sizeof(u32), DFC_MEMORY_TYPE__CT4);
+					if (dfc->CompactTable4[crc].array[0].pid == NULL)
+					{
+						printf("Failed to allocate memory for recursive things.\n");
+						return -1;
+					}
+
+					dfc->CompactTable4[crc].array[0].pid[0] = plist->iid;
+					dfc->CompactTable4[crc].array[0].DirectFilter = NULL;
+					dfc->CompactTable4[crc].array[0].CompactTable = NULL;
+				}
+				alpha_cnt++;
+			}
+			while (alpha_cnt < DFC_Variants(dfc, 4));
+		}
+
+		/* CT8 initialization: one key per pattern, from the upper-cased patrn */
+		if (plist->n >= 8)
+		{
+			u64 crc;
+
+			for (j = plist->ct8_off, k = 0; j < plist->ct8_off + 8; j++, k++)
+			{
+				temp[k] = plist->patrn[j];
+			}
+
+			// 1. Calulating Indice
+			fragment_32 = ((u32)temp[7] << 24) | (temp[6] << 16) | (temp[5] << 8) | temp[4];
+			fragment_64 = ((u64)fragment_32 << 32) | ((u32)temp[3] << 24) | (temp[2] << 16) | (temp[1] << 8) | temp[0];
+
+			crc = my_crc32_u64(0, fragment_64);
+			crc &= dfc->CT8.mask;
+
+			/* Another part inserts into this bucket */
+			if (DFC_PartOf(crc, dfc->CT8.mask, parts) != part)
+			{
+				continue;
+			}
+
+			if (dfc->CompactTable8[crc].cnt != 0)
+			{
+				for (n = 0; n < dfc->CompactTable8[crc].cnt; n++)
+				{
+					if (dfc->CompactTable8[crc].array[n].pat == fragment_64)
+					{
+						break;
+					}
+				}
+
+				if (n == dfc->CompactTable8[crc].cnt)  // If not found,
+				{
+					CT_Type_2_8B_Array *tmp;
+					dfc->CompactTable8[crc].cnt++;
+
+					tmp = (CT_Type_2_8B_Array *)my_realloc(dfc, (void*)dfc->CompactTable8[crc].array, sizeof(CT_Type_2_8B_Array) * dfc->CompactTable8[crc].cnt, DFC_MEMORY_TYPE__CT8);
+					if (tmp == NULL)
+					{
+						return -1;
+					}
+
+					dfc->CompactTable8[crc].array = tmp;
+					dfc->CompactTable8[crc].array[dfc->CompactTable8[crc].cnt - 1].pat = fragment_64;
+					dfc->CompactTable8[crc].array[dfc->CompactTable8[crc].cnt - 1].cnt = 1;
+
+					dfc->CompactTable8[crc].array[dfc->CompactTable8[crc].cnt - 1].pid = (u32 *)my_zalloc(dfc, sizeof(u32), DFC_MEMORY_TYPE__CT8);
+					if (dfc->CompactTable8[crc].array[dfc->CompactTable8[crc].cnt - 1].pid == NULL)
+					{
+						printf("Failed to allocate memory for recursive things.\n");
+						return -1;
+					}
+
+					dfc->CompactTable8[crc].array[dfc->CompactTable8[crc].cnt - 1].pid[0] = plist->iid;
+					dfc->CompactTable8[crc].array[dfc->CompactTable8[crc].cnt - 1].DirectFilter = NULL;
+					dfc->CompactTable8[crc].array[dfc->CompactTable8[crc].cnt - 1].CompactTable = NULL;
+				}
+				else   // If found,
+				{
+					for (m = 0; m < dfc->CompactTable8[crc].array[n].cnt; m++)
+					{
+						if (dfc->CompactTable8[crc].array[n].pid[m] == plist->iid)
+						{
+							break;
+						}
+					}
+					if (m == dfc->CompactTable8[crc].array[n].cnt)
+					{
+						u32 *tmp;
+						dfc->CompactTable8[crc].array[n].cnt++;
+
+						tmp = (u32 *)my_realloc(dfc, (void*)dfc->CompactTable8[crc].array[n].pid, sizeof(u32) * dfc->CompactTable8[crc].array[n].cnt, DFC_MEMORY_TYPE__CT8);
+						if (tmp == NULL)
+						{
+							return -1;
+						}
+
+						dfc->CompactTable8[crc].array[n].pid = tmp;
+						dfc->CompactTable8[crc].array[n].pid[dfc->CompactTable8[crc].array[n].cnt - 1] = plist->iid;
+					}
+				}
+			}
+			else   // If there is no elements in the CT8,
+			{
+				dfc->CompactTable8[crc].cnt = 1;
+
+				dfc->CompactTable8[crc].array = (CT_Type_2_8B_Array *)my_zalloc(dfc, sizeof(CT_Type_2_8B_Array), DFC_MEMORY_TYPE__CT8);
+				if (dfc->CompactTable8[crc].array == NULL)
+				{
+					printf("Failed to allocate memory for recursive things.\n");
+					return -1;
+				}
+
+				memset(dfc->CompactTable8[crc].array, 0, sizeof(CT_Type_2_8B_Array));
+
+				dfc->CompactTable8[crc].array[0].pat = fragment_64;
+				dfc->CompactTable8[crc].array[0].cnt = 1;
+
+				dfc->CompactTable8[crc].array[0].pid = (u32 *)my_zalloc(dfc, sizeof(u32), DFC_MEMORY_TYPE__CT8);
+				if (dfc->CompactTable8[crc].array[0].pid == NULL)
+				{
+					printf("Failed to allocate memory for recursive things.\n");
+					return -1;
+				}
+
+				dfc->CompactTable8[crc].array[0].pid[0] = plist->iid;
+				dfc->CompactTable8[crc].array[0].DirectFilter = NULL;
+				dfc->CompactTable8[crc].array[0].CompactTable = NULL;
+			}
+		}
+	}
+
+	return 0;
+}
+
+/* Recursive tables of the crowded CT2/CT4/CT8 entries in this part */
+static int DFC_RecursivePart(DFC_STRUCTURE *dfc, u32 part, u32 parts, void *arg)
+{
+	u32 i;
+	u32 alpha_cnt;
+
+	int k, l;
+	u32 m, n;
+
+	u8 temp[8], flag[8];
+	u16 fragment_16;
+	u32 byteIndex, bitMask;
+
+	// Only for CT2 firstly
+	for (i = 0; i <= dfc->CT2.mask; i++)
+	{
+		if (DFC_PartOf(i, dfc->CT2.mask, parts) != part)
+		{
+			continue;
+		}
+
+		for (n = 0; n < dfc->CompactTable2[i].cnt; n++)
+		{
+			/* If the number of PID is bigger than 3, do recursive filtering */
+			if (dfc->CompactTable2[i].array[n].cnt >= dfc->config.rec_boundary)
+			{
+				int temp_cnt = 0; // cnt for 2 byte patterns.
+				u32 *tempPID;
+
+				/* Initialization */
+				dfc->CompactTable2[i].array[n].DirectFilter = (u8*)my_zalloc(dfc, sizeof(u8) * DFC_DFBytes(dfc), DFC_MEMORY_TYPE__CT2);
+				if (dfc->CompactTable2[i].array[n].DirectFilter == NULL)
+				{
+					printf("Failed to allocate memory for recursive things.\n");
+					return -1;
+				}
+
+				dfc->CompactTable2[i].array[n].CompactTable = (CT_Type_2_2B*)my_zalloc(dfc, sizeof(CT_Type_2_2B) * dfc->config.rec_ct_size, DFC_MEMORY_TYPE__CT2);
+				if (dfc->CompactTable2[i].array[n].CompactTable == NULL)
+				{
+					printf("Failed to allocate memory for recursive things.\n");
+					return -1;
+				}
+
+				tempPID = (u32*)my_zalloc(dfc, sizeof(u32) * dfc->CompactTable2[i].array[n].cnt, DFC_MEMORY_TYPE__CT2);
+				if (tempPID == NULL)
+				{
+					printf("Failed to allocate memory for recursive things.\n");
+					return -1;
+				}
+
+				memcpy(tempPID, dfc->CompactTable2[i].array[n].pid, sizeof(u32) * dfc->CompactTable2[i].array[n].cnt);
+
+				my_free(dfc, dfc->CompactTable2[i].array[n].pid);
+				dfc->CompactTable2[i].array[n].pid = NULL;
+
+				for (m = 0; m < dfc->CompactTable2[i].array[n].cnt; m++)
+				{
+					int pat_len = dfc->dfcMatchList[tempPID[m]]->n - 2;
+
+					if (pat_len == 0) /* When pat length is 2 */
+					{
+						u32 *tmp;
+						temp_cnt ++;
+
+						tmp = (u32 *)my_realloc(dfc, dfc->CompactTable2[i].array[n].pid, sizeof(u32) * temp_cnt, DFC_MEMORY_TYPE__CT2);
+						if (tmp == NULL)
+						{
+							return -1;
+						}
+
+						dfc->CompactTable2[i].array[n].pid = tmp;
+						dfc->CompactTable2[i].array[n].pid[temp_cnt - 1] = tempPID[m];
+					}
+					else if (pat_len == 1)   /* When pat length is 3 */
+					{
+						DFC_PATTERN *mlist = dfc->dfcMatchList[tempPID[m]];
+						u8 *df = dfc->CompactTable2[i].array[n].DirectFilter;
+						CT_Type_2_2B *ct = dfc->CompactTable2[i].array[n].CompactTable;
+						int ret;
+
+						if (dfc->fold)
+						{
+							ret = DFC_AddRecursive1B(dfc, df, ct, xlatcase[mlist->casepatrn[0]], tempPID[m], DFC_MEMORY_TYPE__CT2);
+						}
+						else if (mlist->nocase)
+						{
+							ret = DFC_AddRecursive1B(dfc, df, ct, tolower(mlist->patrn[0]), tempPID[m], DFC_MEMORY_TYPE__CT2);
+							if (ret == 0)
+							{
+								ret = DFC_AddRecursive1B(dfc, df, ct, toupper(mlist->patrn[0]), tempPID[m], DFC_MEMORY_TYPE__CT2);
+							}
+						}
+						else
+						{
+							ret = DFC_AddRecursive1B(dfc, df, ct, mlist->casepatrn[0], tempPID[m], DFC_MEMORY_TYPE__CT2);
+						}
+
+						if (ret < 0)
+						{
+							return -1;
+						}
+					}
+				}
+
+				dfc->CompactTable2[i].array[n].cnt = temp_cnt;
+				my_free(dfc, tempPID);
+			}
+		}
+	}
+
+	// Only for CT4 firstly
+	for (i = 0; i <= dfc->CT4.mask; i++)
+	{
+		if (DFC_PartOf(i, dfc->CT4.mask, parts) != part)
+		{
+			continue;
+		}
+
+		for (n = 0; n < dfc->CompactTable4[i].cnt; n++)
+		{
+			/* If the number of PID is bigger than 3, do recursive filtering */
+			if (dfc->CompactTable4[i].array[n].cnt >= dfc->config.rec_boundary)
+			{
+				int temp_cnt = 0; // cnt for 4 byte patterns.
+				u32 *tempPID;
+
+				/* Initialization */
+				dfc->CompactTable4[i].array[n].DirectFilter = (u8*)my_zalloc(dfc, sizeof(u8) * DFC_DFBytes(dfc), DFC_MEMORY_TYPE__CT4);
+				if (dfc->CompactTable4[i].array[n].DirectFilter == NULL)
+				{
+					printf("Failed to allocate memory for recursive things.\n");
+					return -1;
+				}
+
+				dfc->CompactTable4[i].array[n].CompactTable = (CT_Type_2_2B*)my_zalloc(dfc, sizeof(CT_Type_2_2B) * dfc->config.rec_ct_size, DFC_MEMORY_TYPE__CT4);
+				if (dfc->CompactTable4[i].array[n].CompactTable == NULL)
+				{
+					printf("Failed to allocate memory for recursive things.\n");
+					return -1;
+				}
+
+				tempPID = (u32*)my_zalloc(dfc, sizeof(u32) * dfc->CompactTable4[i].array[n].cnt, DFC_MEMORY_TYPE__CT4);
+				if (tempPID == NULL)
+				{
+					printf("Failed to allocate memory for recursive things.\n");
+					return -1;
+				}
+
+				memcpy(tempPID, dfc->CompactTable4[i].array[n].pid, sizeof(u32) * dfc->CompactTable4[i].array[n].cnt);
+
+				my_free(dfc, dfc->CompactTable4[i].array[n].pid);
+				dfc->CompactTable4[i].array[n].pid = NULL;
+
+				for (m = 0; m < dfc->CompactTable4[i].array[n].cnt; m++)
+				{
+					//DFC_PATTERN *mlist = dfc->dfcMatchList[];
+					int pat_len = dfc->dfcMatchList[tempPID[m]]->n - 4;
+
+					if (pat_len == 0) /* When pat length is 4 */
+					{
+						u32 *tmp;
+						temp_cnt ++;
+
+						tmp = (u32 *)my_realloc(dfc, dfc->CompactTable4[i].array[n].pid, sizeof(u32) * temp_cnt, DFC_MEMORY_TYPE__CT4);
+						if (tmp == NULL)
+						{
+							return -1;
+						}
+
+						dfc->CompactTable4[i].array[n].pid = tmp;
+						dfc->CompactTable4[i].array[n].pid[temp_cnt - 1] = tempPID[m];
+					}
+					else if (pat_len == 1)   /* When pat length is 5 */
+					{
+						DFC_PATTERN *mlist = dfc->dfcMatchList[tempPID[m]];
+						u8 *df = dfc->CompactTable4[i].array[n].DirectFilter;
+						CT_Type_2_2B *ct = dfc->CompactTable4[i].array[n].CompactTable;
+						int ret;
+
+						if (dfc->fold)
+						{
+							ret = DFC_AddRecursive1B(dfc, df, ct, xlatcase[mlist->casepatrn[0]], tempPID[m], DFC_MEMORY_TYPE__CT4);
+						}
+						else if (mlist->nocase)
+						{
+							ret = DFC_AddRecursive1B(dfc, df, ct, tolower(mlist->patrn[0]), tempPID[m], DFC_MEMORY_TYPE__CT4);
+							if (ret == 0)
+							{
+								ret = DFC_AddRecursive1B(dfc, df, ct, toupper(mlist->patrn[0]), tempPID[m], DFC_MEMORY_TYPE__CT4);
+							}
+						}
+						else
+						{
+							ret = DFC_AddRecursive1B(dfc, df, ct, mlist->casepatrn[0], tempPID[m], DFC_MEMORY_TYPE__CT4);
+						}
+
+						if (ret < 0)
+						{
+							return -1;
+						}
+					}
+					else    /* When pat length is 7 (pat_len is equal to 2(6) or 3(7)) */
+					{
+						if (dfc->dfcMatchList[tempPID[m]]->nocase || dfc->fold)
+						{
+							alpha_cnt = 0;
+							do
+							{
+								for (l = 1, k = 0; l >= 0; --l, k++)
+								{
+									flag[k] = (alpha_cnt >> l) & 1;
+								}
+
+								for (l = pat_len - 2, k = 0; l <= pat_len - 1; l++, k++)
+								{
+									Build_pattern(dfc, dfc->dfcMatchList[tempPID[m]], flag, temp, 0, l, k);
+								}
+
+								fragment_16 = (temp[1] << 8) | temp[0];
+								byteIndex = BINDEX(DFC_DFKey(dfc, fragment_16));
+								bitMask = BMASK(DFC_DFKey(dfc, fragment_16));
+
+								dfc->CompactTable4[i].array[n].DirectFilter[byteIndex] |= bitMask;
+
+								Add_PID_to_2B_CT(dfc, dfc->CompactTable4[i].array[n].CompactTable, temp, tempPID[m],
+												 DFC_MEMORY_TYPE__CT4);
+
+								alpha_cnt++;
+							}
+							while (alpha_cnt < DFC_Variants(dfc, 2));
+						}
+						else   /* case sensitive pattern */
+						{
+							temp[0] = dfc->dfcMatchList[tempPID[m]]->casepatrn[pat_len - 2];
+							temp[1] = dfc->dfcMatchList[tempPID[m]]->casepatrn[pat_len - 1];
+
+							fragment_16 = (temp[1] << 8) | temp[0];
+							byteIndex = BINDEX(DFC_DFKey(dfc, fragment_16));
+							bitMask = BMASK(DFC_DFKey(dfc, fragment_16));
+
+							dfc->CompactTable4[i].array[n].DirectFilter[byteIndex] |= bitMask;
+
+							Add_PID_to_2B_CT(dfc, dfc->CompactTable4[i].array[n].CompactTable, temp, tempPID[m],
+											 DFC_MEMORY_TYPE__CT4);
+						}
+					}
+				}
+
+				dfc->CompactTable4[i].array[n].cnt = temp_cnt;
+				my_free(dfc, tempPID);
+			}
+		}
+	}
+
+	/* For CT8 */
+	for (i = 0; i <= dfc->CT8.mask; i++)
+	{
+		if (DFC_PartOf(i, dfc->CT8.mask, parts) != part)
+		{
+			continue;
+		}
+
+		for (n = 0; n < dfc->CompactTable8[i].cnt; n++)
+		{
+			/* If the number of PID is bigger than rec_boundary, do recursive filtering */
+			if (dfc->CompactTable8[i].array[n].cnt >= dfc->config.rec_boundary)
+			{
+				int temp_cnt = 0; // cnt for 8 byte patterns.
+				u32 *tempPID;
+
+				/* Initialization */
+				dfc->CompactTable8[i].array[n].DirectFilter = (u8*)my_zalloc(dfc, DFC_DFBytes(dfc) * sizeof(u8), DFC_MEMORY_TYPE__CT8);
+				if (dfc->CompactTable8[i].array[n].DirectFilter == NULL)
+				{
+					printf("Failed to allocate memory for recursive things.\n");
+					return -1;
+				}
+
+				dfc->CompactTable8[i].array[n].CompactTable = (CT_Type_2_2B *)my_zalloc(dfc, sizeof(CT_Type_2_2B) * dfc->config.rec_ct_size, DFC_MEMORY_TYPE__CT8);
+				if (dfc->CompactTable8[i].array[n].CompactTable == NULL)
+				{
+					printf("Failed to allocate memory for recursive things.\n");
+					return -1;
+				}
+
+				tempPID = (u32*)my_zalloc(dfc, sizeof(u32) * dfc->CompactTable8[i].array[n].cnt, DFC_MEMORY_TYPE__CT8);
+				if (tempPID == NULL)
+				{
+					printf("Failed to allocate memory for recursive things.\n");
+					return -1;
+				}
+
+				memcpy(tempPID, dfc->CompactTable8[i].array[n].pid, sizeof(u32) * dfc->CompactTable8[i].array[n].cnt);
+
+				my_free(dfc, dfc->CompactTable8[i].array[n].pid);
+				dfc->CompactTable8[i].array[n].pid = NULL;
+
+				for (m = 0; m < dfc->CompactTable8[i].array[n].cnt; m++)
+				{
+					/* Bytes of the pattern before its CT8 key */
+					int pat_len = dfc->dfcMatchList[tempPID[m]]->ct8_off;
+
+					if (pat_len == 0) /* Key at the start, e.g. 8B patterns */
+					{
+						u32 *tmp;
+						temp_cnt ++;
+
+						tmp = (u32 *)my_realloc(dfc, dfc->CompactTable8[i].array[n].pid, sizeof(u32) * temp_cnt, DFC_MEMORY_TYPE__CT8);
+						if (tmp == NULL)
+						{
+							printf("Failed to allocate memory for recursive things.\n");
+							return -1;
+						}
+
+						dfc->CompactTable8[i].array[n].pid = tmp;
+						dfc->CompactTable8[i].array[n].pid[temp_cnt - 1] = tempPID[m];
+					}
+					else if (pat_len == 1)   /* One byte before the key */
+					{
+						DFC_PATTERN *mlist = dfc->dfcMatchList[tempPID[m]];
+						u8 *df = dfc->CompactTable8[i].array[n].DirectFilter;
+						CT_Type_2_2B *ct = dfc->CompactTable8[i].array[n].CompactTable;
+						int ret;
+
+						if (dfc->fold)
+						{
+							ret = DFC_AddRecursive1B(dfc, df, ct, xlatcase[mlist->casepatrn[0]], tempPID[m], DFC_MEMORY_TYPE__CT8);
+						}
+						else if (mlist->nocase)
+						{
+							ret = DFC_AddRecursive1B(dfc, df, ct, tolower(mlist->patrn[0]), tempPID[m], DFC_MEMORY_TYPE__CT8);
+							if (ret == 0)
+							{
+								ret = DFC_AddRecursive1B(dfc, df, ct, toupper(mlist->patrn[0]), tempPID[m], DFC_MEMORY_TYPE__CT8);
+							}
+						}
+						else
+						{
+							ret = DFC_AddRecursive1B(dfc, df, ct, mlist->casepatrn[0], tempPID[m], DFC_MEMORY_TYPE__CT8);
+						}
+
+						if (ret < 0)
+						{
+							return -1;
+						}
+					}
+					else    /* Two or more bytes before the key */
+					{
+						if (dfc->dfcMatchList[tempPID[m]]->nocase || dfc->fold)
+						{
+							alpha_cnt = 0;
+							do
+							{
+								for (l = 1, k = 0; l >= 0; --l, k++)
+								{
+									flag[k] = (alpha_cnt >> l) & 1;
+								}
+
+								for (l = pat_len - 2, k = 0; l <= pat_len - 1; l++, k++)
+								{
+									Build_pattern(dfc, dfc->dfcMatchList[tempPID[m]], flag, temp, 0, l, k);
+								}
+
+								fragment_16 = (temp[1] << 8) | temp[0];
+								byteIndex = BINDEX(DFC_DFKey(dfc, fragment_16));
+								bitMask = BMASK(DFC_DFKey(dfc, fragment_16));
+
+								dfc->CompactTable8[i].array[n].DirectFilter[byteIndex] |= bitMask;
+
+								Add_PID_to_2B_CT(dfc, dfc->CompactTable8[i].array[n].CompactTable, temp, tempPID[m],
+												 DFC_MEMORY_TYPE__CT8);
+
+								alpha_cnt++;
+							}
+							while (alpha_cnt < DFC_Variants(dfc, 2));
+						}
+						else   /* case sensitive pattern */
+						{
+							temp[0] = dfc->dfcMatchList[tempPID[m]]->casepatrn[pat_len - 2];
+							temp[1] = dfc->dfcMatchList[tempPID[m]]->casepatrn[pat_len - 1];
+
+							fragment_16 = (temp[1] << 8) | temp[0];
+							byteIndex = BINDEX(DFC_DFKey(dfc, fragment_16));
+							bitMask = BMASK(DFC_DFKey(dfc, fragment_16));
+
+							dfc->CompactTable8[i].array[n].DirectFilter[byteIndex] |= bitMask;
+
+							Add_PID_to_2B_CT(dfc, dfc->CompactTable8[i].array[n].CompactTable, temp, tempPID[m],
+											 DFC_MEMORY_TYPE__CT8);
+						}
+					}
+				}
+
+				dfc->CompactTable8[i].array[n].cnt = temp_cnt;
+				my_free(dfc, tempPID);
+			}
+		}
+	}
+
+	return 0;
+}
+
+/*
+*  Lays out the compiled pattern store from dfcMatchList: each record holds
+*  what confirming a candidate needs, and does not cross a cache line
+*  unless it is longer than one. The sids go to SIDPool, so a match only
+*  touches them when it is reported. casepatrn and sids of each pattern
+*  are moved into the store rather than copied.
+*/
+static int DFC_BuildStore(DFC_STRUCTURE *dfc)
+{
+	u64 size = 0, sids = 0;
+	u32 i;
+
+	dfc->store_off = (u32 *)my_malloc(dfc, sizeof(u32) * ((u64)dfc->numPatterns + 1), DFC_MEMORY_TYPE__PATTERN);
+	dfc->sid_start = (u32 *)my_malloc(dfc, sizeof(u32) * ((u64)dfc->numPatterns + 1), DFC_MEMORY_TYPE__PATTERN);
+	if (dfc->store_off == NULL || dfc->sid_start == NULL)
+	{
+		return -1;
+	}
+
+	for (i = 0; i < (u32)dfc->numPatterns; i++)
+	{
+		const DFC_PATTERN *p = dfc->dfcMatchList[i];
+		u64 rec = sizeof(DFC_STORED_PATTERN) + p->n;
+
+		if (rec <= 64 && (size & 63) + rec > 64)
+		{
+			size = (size + 63) & ~(u64)63;
+		}
+
+		dfc->store_off[i] = (u32)size;
+		dfc->sid_start[i] = (u32)sids;
+		size = (size + rec + 3) & ~(u64)3;
+		sids += p->sids_size;
+
+		if (size > UINT32_MAX || sids > UINT32_MAX)
+		{
+			printf("DFC_BuildStore: patterns too large.\n");
+			return -1;
+		}
+	}
+	dfc->store_off[i] = (u32)size;
+	dfc->sid_start[i] = (u32)sids;
+	dfc->store_size = (u32)size;
+
+	dfc->store_mem = my_malloc(dfc, size + 64, DFC_MEMORY_TYPE__PATTERN);
+	dfc->SIDPool = (u32 *)my_malloc(dfc, sizeof(u32) * (sids + 1), DFC_MEMORY_TYPE__PATTERN);
+	if (dfc->store_mem == NULL || dfc->SIDPool == NULL)
+	{
+		return -1;
+	}
+
+	dfc->PatternStore = (u8 *)(((uintptr_t)dfc->store_mem + 63) & ~(uintptr_t)63);
+
+	/* The patterns keep only patrn to themselves from here on */
+	for (i = 0; i < (u32)dfc->numPatterns; i++)
+	{
+		DFC_PATTERN *p = dfc->dfcMatchList[i];
+		DFC_STORED_PATTERN *rec = (DFC_STORED_PATTERN *)(dfc->PatternStore + dfc->store_off[i]);
+
+		rec->n = p->n;
+		rec->nocase = p->nocase;
+		rec->ct8_off = p->n >= 8 ? p->ct8_off : 0;
+		memcpy(rec->casepatrn, p->casepatrn, p->n);
+		memcpy(&dfc->SIDPool[dfc->sid_start[i]], p->sids, sizeof(u32) * p->sids_size);
+
+		my_free(dfc, p->casepatrn);
+		my_free(dfc, p->sids);
+		p->casepatrn = rec->casepatrn;
+		p->sids = &dfc->SIDPool[dfc->sid_start[i]];
+	}
+
+	return 0;
+}
+
+/* Sample count of the 2B key at p[j], over every case the filters accept */
+static double DFC_PairWeight(const DFC_STRUCTURE *dfc, const DFC_PATTERN *p, int j)
+{
+	u8 a = p->casepatrn[j], b = p->casepatrn[j + 1];
+	double w = 0;
+	int x, y;
+
+	if (!p->nocase && !dfc->fold)
+	{
+		return dfc->pair_freq[a | (b << 8)];
+	}
+
+	for (x = 0; x < 2; x++)
+	{
+		for (y = 0; y < 2; y++)
+		{
+			if ((x && !isalpha(a)) || (y && !isalpha(b)))
+			{
+				continue;
+			}
+
+			w += dfc->pair_freq[(x ? toupper(a) : tolower(a)) | ((y ? toupper(b) : tolower(b)) << 8)];
+		}
+	}
+
+	return w;
+}
+
+/* How often the DF1, ADD_DF_4_plus and ADD_DF_8_* keys of the window at
+ * p[j] pass together, up to scale */
+static double DFC_WindowWeight(const DFC_STRUCTURE *dfc, const DFC_PATTERN *p, int j)
+{
+	return (DFC_PairWeight(dfc, p, j) + 1) * (DFC_PairWeight(dfc, p, j + 2) + 1) *
+		   (DFC_PairWeight(dfc, p, j + 4) + 1) * (DFC_PairWeight(dfc, p, j + 6) + 1);
+}
+
+/*
+*  Picks the 8B window each pattern of 8B or more is keyed on in DF1,
+*  ADD_DF_4_plus, ADD_DF_8_* and CT8. Without a traffic sample that is
+*  the window pattern_interval gives; with one, the window the sample
+*  passes least often, keeping the default on ties.
+*/
+static void DFC_PickCT8Keys(DFC_STRUCTURE *dfc)
+{
+	DFC_PATTERN *plist;
+	double w, best;
+	int j;
+
+	for (plist = dfc->dfcPatterns; plist != NULL; plist = plist->next)
+	{
+		if (plist->n < 8)
+		{
+			continue;
+		}
+
+		plist->ct8_off = DFC_CT8DefaultOffset(dfc, plist->n);
+		if (dfc->pair_freq == NULL)
+		{
+			continue;
+		}
+
+		best = DFC_WindowWeight(dfc, plist, plist->ct8_off);
+		for (j = 0; j <= plist->n - 8; j++)
+		{
+			w = DFC_WindowWeight(dfc, plist, j);
+			if (w < best)
+			{
+				best = w;
+				plist->ct8_off = j;
+			}
+		}
+	}
+
+	my_free(dfc, dfc->pair_freq);
+	dfc->pair_freq = NULL;
+}
+
+/* Everything but the pattern store; the build tables are left for the
+ * caller to free, whether this fails or not */
+static int DFC_CompileTables(DFC_STRUCTURE *dfc)
+{
+	u32 i = 0;
+
+	int l;
+	u32 m, n;
+	DFC_PATTERN *plist;
+
+	/* ####################################################################################### */
+	/* ###############                  MatchList initialization              ################ */
+	/* ####################################################################################### */
+
+	/* dfcPatterns already lists the patterns in iid order */
+	my_free(dfc, dfc->init_hash);
+	dfc->init_hash = NULL;
+
+	dfc->dfcMatchList = (DFC_PATTERN **)my_zalloc(dfc, sizeof(DFC_PATTERN*) * dfc->numPatterns, DFC_MEMORY_TYPE__PATTERN);
+	if (dfc->dfcMatchList == NULL)
+	{
+		return -1;
+	}
+
+	for (plist = dfc->dfcPatterns; plist != NULL; plist = plist->next)
+	{
+		if (dfc->dfcMatchList[plist->iid] != NULL)
+		{
+			printf("Internal ID ERROR : %u\n", plist->iid);
+		}
+		dfc->dfcMatchList[plist->iid] = plist;
+	}
+
+	DFC_PickCT8Keys(dfc);
+
+	/* ####################################################################################### */
+
+	/* ####################################################################################### */
+	/* ###############              0. Direct Filters initialization          ################ */
+	/* ####################################################################################### */
+
+	/* Initializing Bloom Filter */
+	for (i = 0; i < DF_SIZE_REAL; i++)
+	{
+		dfc->DirectFilter1[i] = 0;
+		dfc->ADD_DF_4_plus[i] = 0;
+		dfc->ADD_DF_8_1[i] = 0;
+		dfc->ADD_DF_4_1[i] = 0;
+		dfc->cDF2[i] = 0;
+		dfc->ADD_DF_8_2[i] = 0;
+		dfc->cDF1[i] = 0;
+	}
+
+	for (i = 0; i < 256; i++)
+	{
+		dfc->cDF0[i] = 0;
+	}
+
+	/* ####################################################################################### */
+
+	/* ####################################################################################### */
+	/* ###############               Direct Filters setup                     ################ */
+	/* ####################################################################################### */
+
+	if (DFC_BuildCT1(dfc) < 0)
+	{
+		return -1;
+	}
+
+	dfc->scratch_on = 1;
+	if (DFC_SetupDF(dfc) < 0)
+	{
+		return -1;
+	}
+	dfc->scratch_on = 0;
+
+	DFC_ResizeDF(dfc);
+
+	if (DFC_BuildDFBits(dfc) < 0)
+	{
+		return -1;
+	}
+
+	//printf("DF Initialization is done.\n");
+
+	/* ####################################################################################### */
+
+	/* ####################################################################################### */
+	/* ###############                Compact Tables initialization           ################ */
+	/* ####################################################################################### */
+
+	/* The pointer-based build tables only live until DFC_FlattenCT */
+	dfc->scratch_on = 1;
+
+	/* Size each table from the number of keys it will hold */
+	m = n = 0;
+	l = 0;
+	for (plist = dfc->dfcPatterns; plist != NULL; plist = plist->next)
+	{
+		if (plist->n == 2 || plist->n == 3)
+		{
+			m += DFC_CaseVariants(dfc, plist, plist->n - 2, 2);
+		}
+		else if (plist->n >= 4 && plist->n < 8)
+		{
+			n += DFC_CaseVariants(dfc, plist, plist->n - 4, 4);
+		}
+		else if (plist->n >= 8)
+		{
+			l++;
+		}
+	}
+
+	dfc->CT2.mask = DFC_TableSize(m, dfc->config.ct2_max) - 1;
+	dfc->CT4.mask = DFC_TableSize(n, dfc->config.ct4_max) - 1;
+	dfc->CT8.mask = DFC_TableSize(l, dfc->config.ct8_max) - 1;
+
+	dfc->CompactTable2 = (CT_Type_2 *)my_zalloc(dfc, sizeof(CT_Type_2) * (dfc->CT2.mask + 1), DFC_MEMORY_TYPE__CT2);
+	dfc->CompactTable4 = (CT_Type_2 *)my_zalloc(dfc, sizeof(CT_Type_2) * (dfc->CT4.mask + 1), DFC_MEMORY_TYPE__CT4);
+	dfc->CompactTable8 = (CT_Type_2_8B *)my_zalloc(dfc, sizeof(CT_Type_2_8B) * (dfc->CT8.mask + 1), DFC_MEMORY_TYPE__CT8);
+	if (dfc->CompactTable2 == NULL || dfc->CompactTable4 == NULL || dfc->CompactTable8 == NULL)
+	{
+		return -1;
+	}
+
+	/* ####################################################################################### */
+
+	/* ####################################################################################### */
+	/* ###############                   Compact Tables setup                 ################ */
+	/* ####################################################################################### */
+
+	if (DFC_RunParts(dfc, DFC_SetupCTPart, NULL) < 0)
+	{
+		return -1;
+	}
+
+	//printf("CT Initialization is done.\n");
+
+	/* ####################################################################################### */
+
+	/* ####################################################################################### */
+	/* ###############                   Recursive filtering                  ################ */
+	/* ####################################################################################### */
+
+	DFC_SizeRecursive(dfc);
+
+	if (DFC_RunParts(dfc, DFC_RecursivePart, NULL) < 0)
+	{
+		return -1;
+	}
+
+	dfc->scratch_on = 0;
+
+	/* ####################################################################################### */
+
+	/* ####################################################################################### */
+	/* ###############                 Compact Tables flattening              ################ */
+	/* ####################################################################################### */
+
+	if (DFC_FlattenCT(dfc) < 0)
+	{
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+*  Build the filters and tables from the added patterns. An instance is
+*  compiled once; patterns can no longer be added afterwards.
+*
+* \retval  0 On success.
+* \retval -1 Out of memory, or the instance is already compiled.
+*/
+int DFC_Compile(DFC_STRUCTURE* dfc)
+{
+	int r;
+
+	if (dfc->init_hash == NULL)
+	{
+		printf("DFC_Compile: the instance is already compiled.\n");
+		return -1;
+	}
+
+	r = DFC_CompileTables(dfc);
+
+	/* Nothing may point into the scratch arena once it is released */
+	DFC_FreeBuildCT(dfc);
+	my_free(dfc, dfc->init_hash);
+	dfc->init_hash = NULL;
+	my_free(dfc, dfc->pair_freq);
+	dfc->pair_freq = NULL;
+	DFC_ScratchRelease(dfc);
+
+	if (r < 0)
+	{
+		return -1;
+	}
+
+	if (DFC_BuildStore(dfc) < 0)
+	{
+		return -1;
+	}
+
+	return 0;
+}
+
+static inline const DFC_STORED_PATTERN *DFC_Stored(const DFC_STRUCTURE *dfc, u32 pid)
+{
+	return (const DFC_STORED_PATTERN *)(dfc->PatternStore + dfc->store_off[pid]);
+}
+
+/* mlist is the stored record of pid */
+static inline int DFC_Report(const DFC_STRUCTURE *dfc, DFC_SINK *sink, u32 pid, const DFC_STORED_PATTERN *mlist,
+							 const unsigned char *start, int matches)
+{
+	u32 *sids;
+	u32 sids_size;
+
+	if (unlikely(sink->span != 0))
+	{
+		u32 off = (u32)(start - sink->buf);
+
+		if (off >= sink->span || off + mlist->n <= sink->span)
+		{
+			return matches;
+		}
+	}
+
+	if (sink->rec != NULL)
+	{
+		if (unlikely(sink->rec_cnt == sink->rec_max))
+		{
+			sink->full = 1;
+			return matches;
+		}
+
+		sink->rec[sink->rec_cnt].offset = (u32)(start - sink->buf);
+		sink->rec[sink->rec_cnt].iid = pid;
+		sink->rec_cnt++;
+
+		return matches + dfc->sid_start[pid + 1] - dfc->sid_start[pid];
+	}
+
+	sids = &dfc->SIDPool[dfc->sid_start[pid]];
+	sids_size = dfc->sid_start[pid + 1] - dfc->sid_start[pid];
+
+	if (sink->MatchOffset != NULL)
+	{
+		sink->MatchOffset(sink->r, (unsigned char *)mlist->casepatrn, sids, sids_size, (u32)(start - sink->buf), mlist->n);
+	}
+	else if (sink->MatchStream != NULL)
+	{
+		sink->MatchStream(sink->r, (unsigned char *)mlist->casepatrn, sids, sids_size, sink->base + (start - sink->buf), mlist->n);
+	}
+	else
+	{
+		sink->Match(sink->r, (unsigned char *)mlist->casepatrn, sids, sids_size);
+	}
+
+	return matches + sids_size;
+}
+
+static int Verification_CT1(const DFC_STRUCTURE *dfc,
+							unsigned char *buf,
+							int matches,
+							DFC_SINK *sink,
+							const unsigned char *starting_point)
+{
+	u32 i, end;
+	for (i = dfc->CompactTable1.start[*(buf - 2)], end = dfc->CompactTable1.start[*(buf - 2) + 1]; i < end; i++)
+	{
+		u32 pid = dfc->CompactTable1.pid[i];
+		const DFC_STORED_PATTERN *mlist = DFC_Stored(dfc, pid);
+
+		matches = DFC_Report(dfc, sink, pid, mlist, buf - 2, matches);
+	}
+	return matches;
+}
+
+/* 1B patterns ending on the last byte of buf; no DF window starts there */
+static inline int Verification_LastByte(const DFC_STRUCTURE *dfc,
+										unsigned char *buf,
+										int buflen,
+										int matches,
+										DFC_SINK *sink)
+{
+	unsigned char c = buf[buflen - 1];
+	u32 i, end;
+
+	if (!dfc->cDF0[c])
+	{
+		return matches;
+	}
+
+	for (i = dfc->CompactTable1.start[c], end = dfc->CompactTable1.start[c + 1]; i < end; i++)
+	{
+		u32 pid = dfc->CompactTable1.pid[i];
+		const DFC_STORED_PATTERN *mlist = DFC_Stored(dfc, pid);
+
+		matches = DFC_Report(dfc, sink, pid, mlist, &buf[buflen - 1], matches);
+	}
+	return matches;
+}
+
+/* Entries reached without a byte compare only matched the folded key;
+ * a case-sensitive pattern starting at start still has to match exactly */
+static inline int DFC_CaseExact(const DFC_STRUCTURE *dfc, const DFC_STORED_PATTERN *mlist, unsigned char *start)
+{
+	return !dfc->fold || mlist->nocase || my_strncmp(start, mlist->casepatrn, mlist->n) == 0;
+}
+
+/* Finds the entry for 2B data in recursive table rec, NULL if none */
+static inline CT_Flat_Entry *DFC_RecursiveLookup(const DFC_STRUCTURE *dfc, u32 rec, u16 data)
+{
+	u32 *bucket;
+	u32 crc;
+	u32 i;
+
+	u32 key = DFC_DFKey(dfc, data);
+
+	if (!(dfc->RecCT.df[rec * DFC_DFBytes(dfc) + BINDEX(key)] & BMASK(key)))
+	{
+		return NULL;
+	}
+
+	crc = my_crc32_u16(0, data) & dfc->rec_mask;
+	bucket = &dfc->RecCT.bucket[rec * (dfc->config.rec_ct_size + 1)];
+
+	for (i = bucket[crc]; i < bucket[crc + 1]; i++)
+	{
+		if (dfc->RecCT.entry[i].pat == data)
+		{
+			return &dfc->RecCT.entry[i];
+		}
+	}
+
+	return NULL;
+}
+
+/*
+*  Recursive lookup on the 2B before the window key. For a window at the
+*  very start of the buffer only the byte at buf - 3 exists; the recursive
+*  1B level accepts any byte before it, so 0 stands in for the missing one.
+*/
+static inline CT_Flat_Entry *DFC_RecursiveLookupPrev(const DFC_STRUCTURE *dfc, u32 rec, unsigned char *buf,
+													 const unsigned char *starting_point)
+{
+	unsigned char head[2];
+
+	if (likely(buf - starting_point >= 4))
+	{
+		return DFC_RecursiveLookup(dfc, rec, DFC_Load16(dfc, buf - 4));
+	}
+
+	if (buf - starting_point < 3)
+	{
+		return NULL;
+	}
+
+	head[0] = 0;
+	head[1] = *(buf - 3);
+
+	return DFC_RecursiveLookup(dfc, rec, DFC_Load16(dfc, head));
+}
+
+static int Verification_CT2(const DFC_STRUCTURE *dfc,
+							unsigned char *buf,
+							int matches,
+							DFC_SINK *sink,
+							const unsigned char *starting_point)
+{
+	u16 pat = DFC_Load16(dfc, buf - 2);
+	u32 crc = my_crc32_u16(0, pat);
+	u32 i, end;
+
+	// 2. calculate index
+	crc &= dfc->CT2.mask;
+
+	for (i = dfc->CT2.bucket[crc], end = dfc->CT2.bucket[crc + 1]; i < end; i++)
+	{
+		CT_Flat_Entry *e = &dfc->CT2.entry[i];
+
+		if (e->pat == pat)
+		{
+			u32 *pids = &dfc->PIDPool[e->pid_start];
+			u32 j;
+
+			if (e->rec == 0)
+			{
+				for (j = 0; j < e->pid_cnt; j++)
+				{
+					const DFC_STORED_PATTERN *mlist = DFC_Stored(dfc, pids[j]);
+
+					if (buf - starting_point >= mlist->n)
+					{
+						if (mlist->nocase)
+						{
+							if (my_strncasecmp(buf - (mlist->n), mlist->casepatrn, mlist->n - 2) == 0)
+							{
+								matches = DFC_Report(dfc, sink, pids[j], mlist, buf - mlist->n, matches);
+							}
+						}
+						else
+						{
+							if (my_strncmp(buf - (mlist->n), mlist->casepatrn, mlist->n - (dfc->fold ? 0 : 2)) == 0)
+							{
+								matches = DFC_Report(dfc, sink, pids[j], mlist, buf - mlist->n, matches);
+							}
+						}
+					}
+				}
+			}
+			else
+			{
+				CT_Flat_Entry *e2;
+
+				for (j = 0; j < e->pid_cnt; j++)
+				{
+					const DFC_STORED_PATTERN *mlist = DFC_Stored(dfc, pids[j]);
+
+					if (DFC_CaseExact(dfc, mlist, buf - 2))
+					{
+						matches = DFC_Report(dfc, sink, pids[j], mlist, buf - mlist->n, matches);
+					}
+				}
+
+				e2 = DFC_RecursiveLookupPrev(dfc, e->rec - 1, buf, starting_point);
+				if (e2 != NULL)
+				{
+					pids = &dfc->PIDPool[e2->pid_start];
+					for (j = 0; j < e2->pid_cnt; j++)
+					{
+						const DFC_STORED_PATTERN *mlist = DFC_Stored(dfc, pids[j]);
+
+						if (buf - starting_point >= mlist->n && DFC_CaseExact(dfc, mlist, buf - 3))
+						{
+							matches = DFC_Report(dfc, sink, pids[j], mlist, buf - mlist->n, matches);
+						}
+					}
+				}
+			}
+			break;
+		}
+	}
+	return matches;
+}
+
+static inline u32 DFC_CT4_Bucket(const DFC_STRUCTURE *dfc, unsigned char *buf)
+{
+	return my_crc32_u32(0, DFC_Load32(dfc, buf - 2)) & dfc->CT4.mask;
+}
+
+/* crc is the CT4 bucket of buf, see DFC_CT4_Bucket() */
+static int Verification_CT4_7_Bucket(const DFC_STRUCTURE *dfc,
+									 unsigned char *buf,
+									 u32 crc,
+									 int matches,
+									 DFC_SINK *sink,
+									 const unsigned char *starting_point)
+{
+	u32 pat = DFC_Load32(dfc, buf - 2);
+	u32 i, end;
+
+	for (i = dfc->CT4.bucket[crc], end = dfc->CT4.bucket[crc + 1]; i < end; i++)
+	{
+		CT_Flat_Entry *e = &dfc->CT4.entry[i];
+
+		if (e->pat == pat)
+		{
+			u32 *pids = &dfc->PIDPool[e->pid_start];
+			u32 j;
+
+			if (e->rec == 0)
+			{
+				for (j = 0; j < e->pid_cnt; j++)
+				{
+					const DFC_STORED_PATTERN *mlist = DFC_Stored(dfc, pids[j]);
+
+					if (buf - starting_point >= mlist->n - 2)
+					{
+						if (mlist->nocase)
+						{
+							if (my_strncasecmp(buf - (mlist->n - 2), mlist->casepatrn, mlist->n - 4) == 0)
+							{
+								matches = DFC_Report(dfc, sink, pids[j], mlist, buf - (mlist->n - 2), matches);
+							}
+						}
+						else
+						{
+							if (my_strncmp(buf - (mlist->n - 2), mlist->casepatrn, mlist->n - (dfc->fold ? 0 : 4)) == 0)
+							{
+								matches = DFC_Report(dfc, sink, pids[j], mlist, buf - (mlist->n - 2), matches);
+							}
+						}
+					}
+				}
+			}
+			else
+			{
+				CT_Flat_Entry *e2;
+
+				for (j = 0; j < e->pid_cnt; j++)
+				{
+					const DFC_STORED_PATTERN *mlist = DFC_Stored(dfc, pids[j]);
+
+					if (DFC_CaseExact(dfc, mlist, buf - 2))
+					{
+						matches = DFC_Report(dfc, sink, pids[j], mlist, buf - (mlist->n - 2), matches);
+					}
+				}
+
+				e2 = DFC_RecursiveLookupPrev(dfc, e->rec - 1, buf, starting_point);
+				if (e2 != NULL)
+				{
+					pids = &dfc->PIDPool[e2->pid_start];
+					for (j = 0; j < e2->pid_cnt; j++)
+					{
+						const DFC_STORED_PATTERN *mlist = DFC_Stored(dfc, pids[j]);
+
+						if (buf - starting_point < mlist->n - 2)
+						{
+							continue;
+						}
+
+						if (mlist->nocase)
+						{
+							if (my_strncasecmp(buf - (mlist->n - 2), mlist->casepatrn, mlist->n - 6) == 0)
+							{
+								matches = DFC_Report(dfc, sink, pids[j], mlist, buf - (mlist->n - 2), matches);
+							}
+						}
+						else
+						{
+							if (my_strncmp(buf - (mlist->n - 2), mlist->casepatrn, mlist->n - (dfc->fold ? 0 : 6)) == 0)
+							{
+								matches = DFC_Report(dfc, sink, pids[j], mlist, buf - (mlist->n - 2), matches);
+							}
+						}
+					}
+				}
+			}
+			break;
+		}
+	}
+	return matches;
+}
+
+/* CT8 keys are always built from the upper-cased pattern */
+static inline u64 DFC_CT8_Fragment(unsigned char *buf)
+{
+	return DFC_FoldCase(*(u64*)(buf - 2));
+}
+
+static inline u32 DFC_CT8_Bucket(const DFC_STRUCTURE *dfc, unsigned char *buf)
+{
+	return my_crc32_u64(0, DFC_CT8_Fragment(buf)) & dfc->CT8.mask;
+}
+
+/* crc is the CT8 bucket of buf, see DFC_CT8_Bucket(). The key need not be
+ * at the pattern end (pattern_interval, traffic sample), so a match has to
+ * end by ending_point as well. */
+static int Verification_CT8_plus_Bucket(const DFC_STRUCTURE *dfc,
+										unsigned char *buf,
+										u32 crc,
+										int matches,
+										DFC_SINK *sink,
+										const unsigned char *starting_point,
+										const unsigned char *ending_point)
+{
+	u64 fragment_64 = DFC_CT8_Fragment(buf);
+	u32 i, end;
+
+	for (i = dfc->CT8.bucket[crc], end = dfc->CT8.bucket[crc + 1]; i < end; i++)
+	{
+		CT_Flat_8B_Entry *e = &dfc->CT8.entry[i];
+
+		if (e->pat == fragment_64)
+		{
+			u32 *pids = &dfc->PIDPool[e->pid_start];
+			u32 j;
+
+			if (e->rec == 0)
+			{
+				for (j = 0; j < e->pid_cnt; j++)
+				{
+					const DFC_STORED_PATTERN *mlist = DFC_Stored(dfc, pids[j]);
+
+					int comparison_requirement = mlist->ct8_off + 2;
+					if (buf - starting_point >= comparison_requirement &&
+						ending_point - buf >= mlist->n - comparison_requirement)
+					{
+						if (mlist->nocase)
+						{
+							if (my_strncasecmp(buf - comparison_requirement, mlist->casepatrn, mlist->n) == 0)
+							{
+								matches = DFC_Report(dfc, sink, pids[j], mlist, buf - comparison_requirement, matches);
+							}
+						}
+						else
+						{
+							if (my_strncmp(buf - comparison_requirement, mlist->casepatrn, mlist->n) == 0)
+							{
+								matches = DFC_Report(dfc, sink, pids[j], mlist, buf - comparison_requirement, matches);
+							}
+						}
+					}
+				}
+			}
+			else
+			{
+				CT_Flat_Entry *e2;
+
+				for (j = 0; j < e->pid_cnt; j++)
+				{
+					const DFC_STORED_PATTERN *mlist = DFC_Stored(dfc, pids[j]);
+
+					int comparison_requirement = mlist->ct8_off + 2;
+					if (buf - starting_point < comparison_requirement ||
+						ending_point - buf < mlist->n - comparison_requirement)
+					{
+						continue;
+					}
+
+					if (mlist->nocase)
+					{
+						if (my_strncasecmp(buf - comparison_requirement, mlist->casepatrn, mlist->n) == 0)
+						{
+							matches = DFC_Report(dfc, sink, pids[j], mlist, buf - comparison_requirement, matches);
+						}
+					}
+					else
+					{
+						if (my_strncmp(buf - comparison_requirement, mlist->casepatrn, mlist->n) == 0)
+						{
+							matches = DFC_Report(dfc, sink, pids[j], mlist, buf - comparison_requirement, matches);
+						}
+					}
+				}
+
+				e2 = DFC_RecursiveLookupPrev(dfc, e->rec - 1, buf, starting_point);
+				if (e2 != NULL)
+				{
+					pids = &dfc->PIDPool[e2->pid_start];
+					for (j = 0; j < e2->pid_cnt; j++)
+					{
+						const DFC_STORED_PATTERN *mlist = DFC_Stored(dfc, pids[j]);
+
+						int comparison_requirement = mlist->ct8_off + 2;
+						if (buf - starting_point >= comparison_requirement &&
+							ending_point - buf >= mlist->n - comparison_requirement)
+						{
+							if (mlist->nocase)
+							{
+								if (my_strncasecmp(buf - comparison_requirement, mlist->casepatrn, mlist->n) == 0)
+								{
+									matches = DFC_Report(dfc, sink, pids[j], mlist, buf - comparison_requirement, matches);
+								}
+							}
+							else
+							{
+								if (my_strncmp(buf - comparison_requirement, mlist->casepatrn, mlist->n) == 0)
+								{
+									matches = DFC_Report(dfc, sink, pids[j], mlist, buf - comparison_requirement, matches);
+								}
+							}
+						}
+					}
+				}
+			}
+			break;
+		}
+	}
+
+	return matches;
+}
+
+static int Verification_CT4_7(const DFC_STRUCTURE *dfc,
+							  unsigned char *buf,
+							  int matches,
+							  DFC_SINK *sink,
+							  const unsigned char *starting_point)
+{
+	return Verification_CT4_7_Bucket(dfc, buf, DFC_CT4_Bucket(dfc, buf), matches, sink, starting_point);
+}
+
+static int Verification_CT8_plus(const DFC_STRUCTURE *dfc,
+								 unsigned char *buf,
+								 int matches,
+								 DFC_SINK *sink,
+								 const unsigned char *starting_point,
+								 const unsigned char *ending_point)
+{
+	return Verification_CT8_plus_Bucket(dfc, buf, DFC_CT8_Bucket(dfc, buf), matches, sink, starting_point, ending_point);
+}
+
+/*
+*  Windows with fewer than DFC_TAIL_LEN bytes left run the guarded filters,
+*  which check rest_len before reading ahead for CT4/CT8. guarded is a
+*  constant at every call site, so the fast path keeps no checks.
+*/
+#define DFC_TAIL_LEN      8
+
+static inline int Progressive_Filtering(const DFC_STRUCTURE *dfc,
+										unsigned char *buf,
+										int matches,
+										u32 key,
+										DFC_SINK *sink,
+										const unsigned char *starting_point,
+										int rest_len,
+										const int guarded)
+{
+	if (dfc->cDF0[*(buf - 2)])
+	{
+		matches = Verification_CT1(dfc, buf, matches, sink, starting_point);
+	}
+
+	if (unlikely(DFC_DFTest(dfc, dfc->cDF1, DFB_CDF1, key)))
+	{
+		matches = Verification_CT2(dfc, buf, matches, sink, starting_point);
+	}
+
+	if (!guarded || rest_len >= 4)
+	{
+		u32 data = DFC_DFKey(dfc, DFC_Load16(dfc, buf));
+
+		if (unlikely(DFC_DFTest(dfc, dfc->ADD_DF_4_plus, DFB_4_PLUS, data)))
+		{
+			u32 data8;
+
+			if (unlikely(DFC_DFTest(dfc, dfc->ADD_DF_4_1, DFB_4_1, data)))
+			{
+				matches = Verification_CT4_7(dfc, buf, matches, sink, starting_point);
+			}
+
+			if (guarded && rest_len < 8)
+			{
+				return matches;
+			}
+
+			data8 = DFC_DFKey(dfc, DFC_Load16(dfc, &buf[4]));
+
+			if (unlikely(DFC_DFTest(dfc, dfc->ADD_DF_8_1, DFB_8_1, data8)))
+			{
+				data8 = DFC_DFKey(dfc, DFC_Load16(dfc, &buf[2]));
+
+				if (unlikely(DFC_DFTest(dfc, dfc->ADD_DF_8_2, DFB_8_2, data8)))
+				{
+					matches = Verification_CT8_plus(dfc, buf, matches, sink, starting_point, buf - 2 + rest_len);
+				}
+			}
+		}
+	}
+
+	return matches;
+}
+
+/*
+*  Scans the DF1 windows from start on. If the sink runs full, the records of
+*  the window that did not fit are dropped and sink->resume is set to it.
+*/
+static int DFC_SearchSink(const DFC_STRUCTURE *dfc, unsigned char *buf, int buflen, int start, DFC_SINK *sink)
+{
+	const u8 *DirectFilter1 = dfc->DirectFilter1;
+
+	int i;
+	int matches = 0;
+	u32 mark;
+
+	if (unlikely(buflen <= 0))
+	{
+		return 0;
+	}
+
+	i = start;
+
+	/* SIMD front end: only positions passing DF1 reach Progressive_Filtering.
+	 * The buffer tail is left to the scalar loop, so its hits never need the guarded filters */
+	if (DFC_ScanDF1 != NULL)
+	{
+		for (; i + DFC_SCAN_BLOCK + DFC_TAIL_LEN <= buflen; i += DFC_SCAN_BLOCK)
+		{
+			u32 cand = DFC_ScanDF1(DirectFilter1, &buf[i], dfc->fold, dfc->config.df_bits);
+
+			while (cand)
+			{
+				int pos = i + __builtin_ctz(cand);
+				u32 data = DFC_DFKey(dfc, DFC_Load16(dfc, &buf[pos]));
+
+				mark = sink->rec_cnt;
+				matches = Progressive_Filtering(dfc, &buf[pos + 2], matches, data, sink, buf, buflen - pos, 0);
+				if (unlikely(sink->full))
+				{
+					sink->rec_cnt = mark;
+					sink->resume = pos;
+					return matches;
+				}
+				cand &= cand - 1;
+			}
+		}
+	}
+
+	/* Scalar loop for the remainder (or everything without AVX2) */
+	for (; i < buflen - 1; i++)
+	{
+		u32 data = DFC_DFKey(dfc, DFC_Load16(dfc, &buf[i]));
+
+		if (unlikely(DFC_DFTest(dfc, DirectFilter1, DFB_DF1, data)))
+		{
+			mark = sink->rec_cnt;
+			if (likely(buflen - i >= DFC_TAIL_LEN))
+			{
+				matches = Progressive_Filtering(dfc, &buf[i + 2], matches, data, sink, buf, buflen - i, 0);
+			}
+			else
+			{
+				matches = Progressive_Filtering(dfc, &buf[i + 2], matches, data, sink, buf, buflen - i, 1);
+			}
+			if (unlikely(sink->full))
+			{
+				sink->rec_cnt = mark;
+				sink->resume = i;
+				return matches;
+			}
+		}
+	}
+
+	/* It is needed to check last 1 byte from payload */
+	mark = sink->rec_cnt;
+	matches = Verification_LastByte(dfc, buf, buflen, matches, sink);
+
+	if (unlikely(sink->full))
+	{
+		sink->rec_cnt = mark;
+		sink->resume = buflen - 1;
+		return matches;
+	}
+
+	sink->resume = buflen;
+
+	return matches;
+}
 
-							tmp = (u32 *)my_realloc((void*)dfc->CompactTable2[crc].array[n].pid, sizeof(u32) * dfc->CompactTable2[crc].array[n].cnt);
-							if (tmp == NULL)
-							{
-								return -1;
-							}
+int DFC_Search(const DFC_STRUCTURE *dfc, unsigned char *buf, int buflen, void* r, void (*Match)(void*, unsigned char *, u32 *, u32))
+{
+	DFC_SINK sink = { .Match = Match, .r = r, .buf = buf };
 
-							dfc->CompactTable2[crc].array[n].pid = tmp;
-							dfc->CompactTable2[crc].array[n].pid[dfc->CompactTable2[crc].array[n].cnt - 1] = plist->iid;
-						}
-					}
-				}
-				else   // If there is no elements in the CT4,
-				{
-					dfc->CompactTable2[crc].cnt = 1;
+	return DFC_SearchSink(dfc, buf, buflen, 0, &sink);
+}
 
-					dfc->CompactTable2[crc].array = (CT_Type_2_Array *)my_zalloc(sizeof(CT_Type_2_Array));
-					if (dfc->CompactTable2[crc].array == NULL)
-					{
-						return -1;
-					}
+/*
+*  Same as DFC_Search, but Match also gets the offset in buf where the
+*  pattern starts and the pattern length.
+*/
+int DFC_SearchOffsets(const DFC_STRUCTURE *dfc, unsigned char *buf, int buflen, void* r,
+					  void (*Match)(void*, unsigned char *, u32 *, u32, u32 offset, u32 len))
+{
+	DFC_SINK sink = { .MatchOffset = Match, .r = r, .buf = buf };
 
-					memset(dfc->CompactTable2[crc].array, 0, sizeof(CT_Type_2_Array));
+	return DFC_SearchSink(dfc, buf, buflen, 0, &sink);
+}
 
-					dfc->CompactTable2[crc].array[0].pat = fragment_16;
-					dfc->CompactTable2[crc].array[0].cnt = 1;
+/*
+*  Search without callbacks: (offset, iid) records are appended to out in
+*  buffer order. When out is full the search stops at a window boundary;
+*  call again with the same buf and *pos to continue.
+*
+* \param pos      In: window to start from (0 for a new buffer).
+*                 Out: where to resume, buflen once the buffer is done.
+* \param out      Record array
+* \param out_size Number of records out can hold
+*
+* \retval  n  Number of records written to out.
+* \retval -1  out cannot hold the matches of a single window.
+*/
+int DFC_SearchBatch(const DFC_STRUCTURE *dfc, unsigned char *buf, int buflen, int *pos, DFC_MATCH_RECORD *out, int out_size)
+{
+	DFC_SINK sink;
 
-					dfc->CompactTable2[crc].array[0].pid = (u32 *)my_zalloc(sizeof(u32));
-					if (dfc->CompactTable2[crc].array[0].pid == NULL)
-					{
-						return -1;
-					}
+	if (*pos >= buflen)
+	{
+		*pos = buflen;
+		return 0;
+	}
 
-					dfc->CompactTable2[crc].array[0].pid[0] = plist->iid;
-					dfc->CompactTable2[crc].array[0].DirectFilter = NULL;
-					dfc->CompactTable2[crc].array[0].CompactTable = NULL;
-				}
+	memset(&sink, 0, sizeof(sink));
+	sink.buf = buf;
+	sink.rec = out;
+	sink.rec_max = out_size;
 
-				alpha_cnt++;
-			}
-			while (alpha_cnt < 4);
-		}
+	DFC_SearchSink(dfc, buf, buflen, *pos, &sink);
 
-		/* CT4 initialization */
-		if (plist->n >= 4 && plist->n < 8)
-		{
-			alpha_cnt = 0;
-			do
-			{
-				u32 crc;
+	if (sink.full && sink.rec_cnt == 0)
+	{
+		printf("DFC_SearchBatch: out_size %d is too small.\n", out_size);
+		return -1;
+	}
 
-				// 1.
-				for (j = 3, k = 0; j >= 0; --j, k++)
-				{
-					flag[k] = (alpha_cnt >> j) & 1;
-				}
+	*pos = sink.resume;
 
-				for (j = plist->n - 4, k = 0; j < plist->n; j++, k++)
-				{
-					Build_pattern(plist, flag, temp, i, j, k);
-				}
+	return sink.rec_cnt;
+}
 
-				// 2.
-				fragment_32 = (temp[3] << 24) | (temp[2] << 16) | (temp[1] << 8) | temp[0];
-				crc = my_crc32_u32(0, fragment_32);
+/*
+*  Stream state for DFC_SearchStream. It keeps the last (longest pattern - 1)
+*  bytes of the stream, so it should be created after all patterns of dfc
+*  are added; patterns longer than that are not found across segments.
+*/
+DFC_STREAM_STATE *DFC_StreamNew(const DFC_STRUCTURE *dfc)
+{
+	u32 keep = dfc->maxPatternLen > 1 ? dfc->maxPatternLen - 1 : 0;
+	DFC_STREAM_STATE *state = (DFC_STREAM_STATE *)calloc(1, sizeof(DFC_STREAM_STATE) + 3 * keep);
 
-				// 3.
-				crc &= CT4_TABLE_SIZE_MASK;
+	if (state == NULL)
+	{
+		return NULL;
+	}
 
-				// 4.
-				if (dfc->CompactTable4[crc].cnt != 0)
-				{
-					for (n = 0; n < dfc->CompactTable4[crc].cnt; n++)
-					{
-						if (dfc->CompactTable4[crc].array[n].pat == fragment_32)
-						{
-							break;
-						}
-					}
+	state->keep = keep;
+	state->carry = (unsigned char *)(state + 1);
+	state->stitch = state->carry + keep;
+	DFC_StreamReset(state);
 
-					if (n == dfc->CompactTable4[crc].cnt)  // If not found,
-					{
-						CT_Type_2_Array *tmp;
-						dfc->CompactTable4[crc].cnt++;
+	return state;
+}
 
-						tmp = (CT_Type_2_Array *)my_realloc((void*)dfc->CompactTable4[crc].array, sizeof(CT_Type_2_Array) * dfc->CompactTable4[crc].cnt);
-						if (tmp == NULL)
-						{
-							return -1;
-						}
-						dfc->CompactTable4[crc].array = tmp;
+void DFC_StreamReset(DFC_STREAM_STATE *state)
+{
+	state->offset = 0;
+	state->carry_len = 0;
+}
 
-						dfc->CompactTable4[crc].array[dfc->CompactTable4[crc].cnt - 1].pat = fragment_32;
-						dfc->CompactTable4[crc].array[dfc->CompactTable4[crc].cnt - 1].cnt = 1;
+void DFC_StreamFree(DFC_STREAM_STATE *state)
+{
+	free(state);
+}
 
-						dfc->CompactTable4[crc].array[dfc->CompactTable4[crc].cnt - 1].pid = (u32 *)my_zalloc(sizeof(u32));
-						if (dfc->CompactTable4[crc].array[dfc->CompactTable4[crc].cnt - 1].pid == NULL)
-						{
-							return -1;
-						}
+/*
+*  Searches the next segment of a stream. Reports exactly the matches a
+*  single DFC_Search over all segments so far would report that end in
+*  this segment; offset is the match start in the stream.
+*
+*  The segment itself is scanned in place. Matches crossing into it from
+*  earlier segments are found in a small stitch buffer (carry + the first
+*  keep bytes of buf) that only reports those crossing matches.
+*/
+int DFC_SearchStream(const DFC_STRUCTURE *dfc, DFC_STREAM_STATE *state, unsigned char *buf, int buflen, void* r,
+					 void (*Match)(void*, unsigned char *, u32 *, u32, u64 offset, u32 len))
+{
+	DFC_SINK sink;
+	u32 len = buflen > 0 ? (u32)buflen : 0;
+	int matches = 0;
 
-						dfc->CompactTable4[crc].array[dfc->CompactTable4[crc].cnt - 1].pid[0] = plist->iid;
-						dfc->CompactTable4[crc].array[dfc->CompactTable4[crc].cnt - 1].DirectFilter = NULL;
-						dfc->CompactTable4[crc].array[dfc->CompactTable4[crc].cnt - 1].CompactTable = NULL;
-					}
-					else   // If found,
-					{
-						for (m = 0; m < dfc->CompactTable4[crc].array[n].cnt; m++)
-						{
-							if (dfc->CompactTable4[crc].array[n].pid[m] == plist->iid)
-							{
-								break;
-							}
-						}
-						if (m == dfc->CompactTable4[crc].array[n].cnt)
-						{
-							u32 *tmp;
-							dfc->CompactTable4[crc].array[n].cnt++;
+	if (len == 0)
+	{
+		return 0;
+	}
 
-							tmp = (u32 *)my_realloc((void*)dfc->CompactTable4[crc].array[n].pid, sizeof(u32) * dfc->CompactTable4[crc].array[n].cnt);
-							if (tmp == NULL)
-							{
-								return -1;
-							}
+	memset(&sink, 0, sizeof(sink));
+	sink.MatchStream = Match;
+	sink.r = r;
 
-							dfc->CompactTable4[crc].array[n].pid = tmp;
-							dfc->CompactTable4[crc].array[n].pid[dfc->CompactTable4[crc].array[n].cnt - 1] = plist->iid;
-						}
-					}
-				}
-				else   // If there is no elements in the CT4,
-				{
-					dfc->CompactTable4[crc].cnt = 1;
+	if (state->carry_len > 0)
+	{
+		u32 head = len < state->keep ? len : state->keep;
 
-					dfc->CompactTable4[crc].array = (CT_Type_2_Array *)my_zalloc(sizeof(CT_Type_2_Array));
-					if (dfc->CompactTable4[crc].array == NULL)
-					{
-						printf("Failed to allocate memory for recursive things.\n");
-						return -1;
-					}
+		memcpy(state->stitch, state->carry, state->carry_len);
+		memcpy(state->stitch + state->carry_len, buf, head);
 
-					memset(dfc->CompactTable4[crc].array, 0, sizeof(CT_Type_2_Array));
+		sink.buf = state->stitch;
+		sink.base = state->offset - state->carry_len;
+		sink.span = state->carry_len;
+		matches += DFC_SearchSink(dfc, state->stitch, state->carry_len + head, 0, &sink);
+	}
 
-					dfc->CompactTable4[crc].array[0].pat = fragment_32;
-					dfc->CompactTable4[crc].array[0].cnt = 1;
+	sink.buf = buf;
+	sink.base = state->offset;
+	sink.span = 0;
+	matches += DFC_SearchSink(dfc, buf, len, 0, &sink);
 
-					dfc->CompactTable4[crc].array[0].pid = (u32 *)my_zalloc(sizeof(u32));
-					if (dfc->CompactTable4[crc].array[0].pid == NULL)
-					{
-						printf("Failed to allocate memory for recursive things.\n");
-						return -1;
-					}
+	/* Keep the last keep bytes of carry + buf */
+	if (len >= state->keep)
+	{
+		memcpy(state->carry, buf + len - state->keep, state->keep);
+		state->carry_len = state->keep;
+	}
+	else
+	{
+		u32 drop = state->carry_len + len > state->keep ? state->carry_len + len - state->keep : 0;
 
-					dfc->CompactTable4[crc].array[0].pid[0] = plist->iid;
-					dfc->CompactTable4[crc].array[0].DirectFilter = NULL;
-					dfc->CompactTable4[crc].array[0].CompactTable = NULL;
-				}
-				alpha_cnt++;
-			}
-			while (alpha_cnt < 16);
+		memmove(state->carry, state->carry + drop, state->carry_len - drop);
+		memcpy(state->carry + state->carry_len - drop, buf, len);
+		state->carry_len += len - drop;
+	}
+
+	state->offset += len;
+
+	return matches;
+}
+
+/* A blob instance has no DFC_PATTERNs of its own; the one of iid is built
+ * from the mapped store when first asked for. Searching threads may race
+ * here, the loser of the exchange frees its copy. */
+static DFC_PATTERN *DFC_BlobPattern(DFC_STRUCTURE *dfc, u32 iid)
+{
+	DFC_PATTERN **list = __atomic_load_n(&dfc->dfcMatchList, __ATOMIC_ACQUIRE);
+	DFC_PATTERN *p, *expected = NULL;
+	const DFC_STORED_PATTERN *rec;
+	u32 x;
+
+	if (list == NULL)
+	{
+		DFC_PATTERN **fresh = (DFC_PATTERN **)my_zalloc(dfc, sizeof(DFC_PATTERN *) * dfc->numPatterns, DFC_MEMORY_TYPE__PATTERN);
+		if (fresh == NULL)
+		{
+			return NULL;
 		}
 
-		/* CT8 initialization */
-		if (plist->n >= 8)
+		if (__atomic_compare_exchange_n(&dfc->dfcMatchList, &list, fresh, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
 		{
-			alpha_cnt = 0;
-			do
-			{
-				u64 crc;
+			list = fresh;
+		}
+		else
+		{
+			my_free(dfc, fresh);
+		}
+	}
 
-				for (j = 7, k = 0; j >= 0; --j, k++)
-				{
-					flag[k] = (alpha_cnt >> j) & 1;
-				}
+	p = __atomic_load_n(&list[iid], __ATOMIC_ACQUIRE);
+	if (p != NULL)
+	{
+		return p;
+	}
 
-				for (j = min_pattern_interval * (plist->n - 8) / pattern_interval, k = 0;
-					 j < min_pattern_interval * (plist->n - 8) / pattern_interval + 8; j++, k++)
-				{
-					temp[k] = plist->patrn[j];
-				}
+	rec = DFC_Stored(dfc, iid);
+	p = (DFC_PATTERN *)my_zalloc(dfc, sizeof(DFC_PATTERN) + rec->n, DFC_MEMORY_TYPE__PATTERN);
+	if (p == NULL)
+	{
+		return NULL;
+	}
 
-				// 1. Calulating Indice
-				fragment_32 = (temp[7] << 24) | (temp[6] << 16) | (temp[5] << 8) | temp[4];
-				fragment_64 = ((u64)fragment_32 << 32) | (temp[3] << 24) | (temp[2] << 16) | (temp[1] << 8) | temp[0];
+	p->patrn = (unsigned char *)(p + 1);
+	for (x = 0; x < rec->n; x++)
+	{
+		p->patrn[x] = xlatcase[rec->casepatrn[x]];
+	}
+	p->casepatrn = (unsigned char *)rec->casepatrn;
+	p->n = rec->n;
+	p->nocase = rec->nocase;
+	p->sids_size = dfc->sid_start[iid + 1] - dfc->sid_start[iid];
+	p->sids = &dfc->SIDPool[dfc->sid_start[iid]];
+	p->iid = iid;
+	p->ct8_off = rec->ct8_off;
+
+	if (!__atomic_compare_exchange_n(&list[iid], &expected, p, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+	{
+		my_free(dfc, p);
+		p = expected;
+	}
 
-				crc = my_crc32_u64(0, fragment_64);
-				crc &= CT8_TABLE_SIZE_MASK;
+	return p;
+}
 
-				if (dfc->CompactTable8[crc].cnt != 0)
-				{
-					for (n = 0; n < dfc->CompactTable8[crc].cnt; n++)
-					{
-						if (dfc->CompactTable8[crc].array[n].pat == fragment_64)
-						{
-							break;
-						}
-					}
+/* Pattern of a DFC_MATCH_RECORD, NULL if iid is out of range or, for a
+ * DFC_Deserialize instance, memory ran out */
+DFC_PATTERN *DFC_GetPattern(const DFC_STRUCTURE *dfc, u32 iid)
+{
+	if (iid >= (u32)dfc->numPatterns)
+	{
+		return NULL;
+	}
 
-					if (n == dfc->CompactTable8[crc].cnt)  // If not found,
-					{
-						CT_Type_2_8B_Array *tmp;
-						dfc->CompactTable8[crc].cnt++;
+	/* Builds on demand; nothing the search reads is written */
+	if (dfc->blob != NULL)
+	{
+		return DFC_BlobPattern((DFC_STRUCTURE *)dfc, iid);
+	}
 
-						tmp = (CT_Type_2_8B_Array *)my_realloc((void*)dfc->CompactTable8[crc].array, sizeof(CT_Type_2_8B_Array) * dfc->CompactTable8[crc].cnt);
-						if (tmp == NULL)
-						{
-							return -1;
-						}
+	if (dfc->dfcMatchList == NULL)
+	{
+		return NULL;
+	}
 
-						dfc->CompactTable8[crc].array = tmp;
-						dfc->CompactTable8[crc].array[dfc->CompactTable8[crc].cnt - 1].pat = fragment_64;
-						dfc->CompactTable8[crc].array[dfc->CompactTable8[crc].cnt - 1].cnt = 1;
+	return dfc->dfcMatchList[iid];
+}
 
-						dfc->CompactTable8[crc].array[dfc->CompactTable8[crc].cnt - 1].pid = (u32 *)my_zalloc(sizeof(u32));
-						if (dfc->CompactTable8[crc].array[dfc->CompactTable8[crc].cnt - 1].pid == NULL)
-						{
-							printf("Failed to allocate memory for recursive things.\n");
-							return -1;
-						}
+static inline void DFC_CollectCandidates(const DFC_STRUCTURE *dfc,
+										 DFC_CANDIDATES *cand,
+										 unsigned char *buf,
+										 int pos,
+										 u32 key,
+										 int rest_len,
+										 const int guarded)
+{
+	if (dfc->cDF0[buf[pos]])
+	{
+		cand->pos[DFC_CAND_CT1][cand->cnt[DFC_CAND_CT1]++] = pos;
+	}
 
-						dfc->CompactTable8[crc].array[dfc->CompactTable8[crc].cnt - 1].pid[0] = plist->iid;
-						dfc->CompactTable8[crc].array[dfc->CompactTable8[crc].cnt - 1].DirectFilter = NULL;
-						dfc->CompactTable8[crc].array[dfc->CompactTable8[crc].cnt - 1].CompactTable = NULL;
-					}
-					else   // If found,
-					{
-						for (m = 0; m < dfc->CompactTable8[crc].array[n].cnt; m++)
-						{
-							if (dfc->CompactTable8[crc].array[n].pid[m] == plist->iid)
-							{
-								break;
-							}
-						}
-						if (m == dfc->CompactTable8[crc].array[n].cnt)
-						{
-							u32 *tmp;
-							dfc->CompactTable8[crc].array[n].cnt++;
+	if (unlikely(DFC_DFTest(dfc, dfc->cDF1, DFB_CDF1, key)))
+	{
+		cand->pos[DFC_CAND_CT2][cand->cnt[DFC_CAND_CT2]++] = pos;
+	}
 
-							tmp = (u32 *)my_realloc((void*)dfc->CompactTable8[crc].array[n].pid, sizeof(u32) * dfc->CompactTable8[crc].array[n].cnt);
-							if (tmp == NULL)
-							{
-								return -1;
-							}
+	if (!guarded || rest_len >= 4)
+	{
+		u32 data = DFC_DFKey(dfc, DFC_Load16(dfc, &buf[pos + 2]));
 
-							dfc->CompactTable8[crc].array[n].pid = tmp;
-							dfc->CompactTable8[crc].array[n].pid[dfc->CompactTable8[crc].array[n].cnt - 1] = plist->iid;
-						}
-					}
-				}
-				else   // If there is no elements in the CT8,
-				{
-					dfc->CompactTable8[crc].cnt = 1;
+		if (unlikely(DFC_DFTest(dfc, dfc->ADD_DF_4_plus, DFB_4_PLUS, data)))
+		{
+			u32 data8;
 
-					dfc->CompactTable8[crc].array = (CT_Type_2_8B_Array *)my_zalloc(sizeof(CT_Type_2_8B_Array));
-					if (dfc->CompactTable8[crc].array == NULL)
-					{
-						printf("Failed to allocate memory for recursive things.\n");
-						return -1;
-					}
+			if (unlikely(DFC_DFTest(dfc, dfc->ADD_DF_4_1, DFB_4_1, data)))
+			{
+				cand->pos[DFC_CAND_CT4][cand->cnt[DFC_CAND_CT4]++] = pos;
+			}
 
-					memset(dfc->CompactTable8[crc].array, 0, sizeof(CT_Type_2_8B_Array));
+			if (guarded && rest_len < 8)
+			{
+				cand->total++;
+				return;
+			}
 
-					dfc->CompactTable8[crc].array[0].pat = fragment_64;
-					dfc->CompactTable8[crc].array[0].cnt = 1;
+			data8 = DFC_DFKey(dfc, DFC_Load16(dfc, &buf[pos + 6]));
 
-					dfc->CompactTable8[crc].array[0].pid = (u32 *)my_zalloc(sizeof(u32));
-					if (dfc->CompactTable8[crc].array[0].pid == NULL)
-					{
-						printf("Failed to allocate memory for recursive things.\n");
-						return -1;
-					}
+			if (unlikely(DFC_DFTest(dfc, dfc->ADD_DF_8_1, DFB_8_1, data8)))
+			{
+				data8 = DFC_DFKey(dfc, DFC_Load16(dfc, &buf[pos + 4]));
 
-					dfc->CompactTable8[crc].array[0].pid[0] = plist->iid;
-					dfc->CompactTable8[crc].array[0].DirectFilter = NULL;
-					dfc->CompactTable8[crc].array[0].CompactTable = NULL;
+				if (unlikely(DFC_DFTest(dfc, dfc->ADD_DF_8_2, DFB_8_2, data8)))
+				{
+					cand->pos[DFC_CAND_CT8][cand->cnt[DFC_CAND_CT8]++] = pos;
 				}
-				alpha_cnt++;
 			}
-			while (alpha_cnt < 256);
 		}
 	}
 
-	//printf("CT Initialization is done.\n");
-
-	/* ####################################################################################### */
+	cand->total++;
+}
 
-	/* ####################################################################################### */
-	/* ###############                   Recursive filtering                  ################ */
-	/* ####################################################################################### */
+/* Phase 2: verify every class in its own loop, then empty the buffer */
+static int DFC_VerifyCandidates(const DFC_STRUCTURE *dfc,
+								DFC_CANDIDATES *cand,
+								unsigned char *buf,
+								int buflen,
+								int matches,
+								DFC_SINK *sink)
+{
+	u32 dist = dfc_prefetch_dist;
+	u32 i, n;
 
-	// Only for CT2 firstly
-	for (i = 0; i < CT2_TABLE_SIZE; i++)
+	for (i = 0; i < cand->cnt[DFC_CAND_CT1]; i++)
 	{
-		for (n = 0; n < dfc->CompactTable2[i].cnt; n++)
-		{
-			/* If the number of PID is bigger than 3, do recursive filtering */
-			if (dfc->CompactTable2[i].array[n].cnt >= RECURSIVE_BOUNDARY)
-			{
-				int temp_cnt = 0; // cnt for 2 byte patterns.
-				u32 *tempPID;
-
-				/* Initialization */
-				dfc->CompactTable2[i].array[n].DirectFilter = (u8*)my_zalloc(sizeof(u8) * DF_SIZE_REAL);
-				if (dfc->CompactTable2[i].array[n].DirectFilter == NULL)
-				{
-					printf("Failed to allocate memory for recursive things.\n");
-					return -1;
-				}
-
-				dfc->CompactTable2[i].array[n].CompactTable = (CT_Type_2_2B*)my_zalloc(sizeof(CT_Type_2_2B) * RECURSIVE_CT_SIZE);
-				if (dfc->CompactTable2[i].array[n].CompactTable == NULL)
-				{
-					printf("Failed to allocate memory for recursive things.\n");
-					return -1;
-				}
+		matches = Verification_CT1(dfc, &buf[cand->pos[DFC_CAND_CT1][i] + 2], matches, sink, buf);
+	}
 
-				tempPID = (u32*)my_zalloc(sizeof(u32) * dfc->CompactTable2[i].array[n].cnt);
-				if (tempPID == NULL)
-				{
-					printf("Failed to allocate memory for recursive things.\n");
-					return -1;
-				}
+	for (i = 0; i < cand->cnt[DFC_CAND_CT2]; i++)
+	{
+		matches = Verification_CT2(dfc, &buf[cand->pos[DFC_CAND_CT2][i] + 2], matches, sink, buf);
+	}
 
-				memcpy(tempPID, dfc->CompactTable2[i].array[n].pid, sizeof(u32) * dfc->CompactTable2[i].array[n].cnt);
+	/* CT4/CT8: hash all candidates up front, then prefetch the bucket
+	 * offset 2 * dist ahead and its entries dist ahead of the one being verified */
+	n = cand->cnt[DFC_CAND_CT4];
+	for (i = 0; i < n; i++)
+	{
+		cand->bucket[i] = DFC_CT4_Bucket(dfc, &buf[cand->pos[DFC_CAND_CT4][i] + 2]);
+	}
 
-				my_free(dfc->CompactTable2[i].array[n].pid);
-				dfc->CompactTable2[i].array[n].pid = NULL;
+	for (i = 0; i < n; i++)
+	{
+		if (dist)
+		{
+			if (i + 2 * dist < n)
+			{
+				__builtin_prefetch(&dfc->CT4.bucket[cand->bucket[i + 2 * dist]]);
+			}
+			if (i + dist < n)
+			{
+				__builtin_prefetch(&dfc->CT4.entry[dfc->CT4.bucket[cand->bucket[i + dist]]]);
+			}
+		}
 
-				for (m = 0; m < dfc->CompactTable2[i].array[n].cnt; m++)
-				{
-					int pat_len = dfc->dfcMatchList[tempPID[m]]->n - 2;
+		matches = Verification_CT4_7_Bucket(dfc, &buf[cand->pos[DFC_CAND_CT4][i] + 2], cand->bucket[i], matches, sink, buf);
+	}
 
-					if (pat_len == 0) /* When pat length is 2 */
-					{
-						u32 *tmp;
-						temp_cnt ++;
+	n = cand->cnt[DFC_CAND_CT8];
+	for (i = 0; i < n; i++)
+	{
+		cand->bucket[i] = DFC_CT8_Bucket(dfc, &buf[cand->pos[DFC_CAND_CT8][i] + 2]);
+	}
 
-						tmp = (u32 *)my_realloc(dfc->CompactTable2[i].array[n].pid, sizeof(u32) * temp_cnt);
-						if (tmp == NULL)
-						{
-							return -1;
-						}
+	for (i = 0; i < n; i++)
+	{
+		if (dist)
+		{
+			if (i + 2 * dist < n)
+			{
+				__builtin_prefetch(&dfc->CT8.bucket[cand->bucket[i + 2 * dist]]);
+			}
+			if (i + dist < n)
+			{
+				__builtin_prefetch(&dfc->CT8.entry[dfc->CT8.bucket[cand->bucket[i + dist]]]);
+			}
+		}
 
-						dfc->CompactTable2[i].array[n].pid = tmp;
-						dfc->CompactTable2[i].array[n].pid[temp_cnt - 1] = tempPID[m];
-					}
-					else if (pat_len == 1)   /* When pat length is 3 */
-					{
-						if (dfc->dfcMatchList[tempPID[m]]->nocase)
-						{
-							temp[1] = tolower(dfc->dfcMatchList[tempPID[m]]->patrn[0]);
-							for (l = 0; l < 256; l++)
-							{
-								temp[0] = l;
+		matches = Verification_CT8_plus_Bucket(dfc, &buf[cand->pos[DFC_CAND_CT8][i] + 2], cand->bucket[i], matches, sink, buf, buf + buflen);
+	}
 
-								fragment_16 = (temp[1] << 8) | temp[0];
-								byteIndex = BINDEX(fragment_16);
-								bitMask = BMASK(fragment_16);
+	memset(cand->cnt, 0, sizeof(cand->cnt));
+	cand->total = 0;
 
-								dfc->CompactTable2[i].array[n].DirectFilter[byteIndex] |= bitMask;
+	return matches;
+}
 
-								Add_PID_to_2B_CT(dfc->CompactTable2[i].array[n].CompactTable, temp,	tempPID[m],
-												 DFC_MEMORY_TYPE__CT2);
-							}
+/*
+*  Two-phase search: filtering first fills a buffer of candidate offsets per
+*  filter class, then each class is verified in its own tight loop.
+*  Reports the same matches as DFC_Search, grouped by class instead of
+*  strictly in buffer order.
+*/
+static int DFC_SearchTwoPhaseSink(const DFC_STRUCTURE *dfc, DFC_CANDIDATES *cand, unsigned char *buf, int buflen, DFC_SINK *sink)
+{
+	const u8 *DirectFilter1 = dfc->DirectFilter1;
 
-							temp[1] = toupper(dfc->dfcMatchList[tempPID[m]]->patrn[0]);
-							for (l = 0; l < 256; l++)
-							{
-								temp[0] = l;
+	int i;
+	int matches = 0;
 
-								fragment_16 = (temp[1] << 8) | temp[0];
-								byteIndex = BINDEX(fragment_16);
-								bitMask = BMASK(fragment_16);
+	if (unlikely(buflen <= 0))
+	{
+		return 0;
+	}
 
-								dfc->CompactTable2[i].array[n].DirectFilter[byteIndex] |= bitMask;
+	memset(cand->cnt, 0, sizeof(cand->cnt));
+	cand->total = 0;
 
-								Add_PID_to_2B_CT(dfc->CompactTable2[i].array[n].CompactTable, temp,	tempPID[m],
-												 DFC_MEMORY_TYPE__CT2);
-							}
-						}
-						else
-						{
-							temp[1] = dfc->dfcMatchList[tempPID[m]]->casepatrn[0];
-							for (l = 0; l < 256; l++)
-							{
-								temp[0] = l;
+	i = 0;
 
-								fragment_16 = (temp[1] << 8) | temp[0];
-								byteIndex = BINDEX(fragment_16);
-								bitMask = BMASK(fragment_16);
+	if (DFC_ScanDF1 != NULL)
+	{
+		for (; i + DFC_SCAN_BLOCK + DFC_TAIL_LEN <= buflen; i += DFC_SCAN_BLOCK)
+		{
+			u32 hits = DFC_ScanDF1(DirectFilter1, &buf[i], dfc->fold, dfc->config.df_bits);
 
-								dfc->CompactTable2[i].array[n].DirectFilter[byteIndex] |= bitMask;
+			while (hits)
+			{
+				int pos = i + __builtin_ctz(hits);
+				u32 data = DFC_DFKey(dfc, DFC_Load16(dfc, &buf[pos]));
 
-								Add_PID_to_2B_CT(dfc->CompactTable2[i].array[n].CompactTable, temp,	tempPID[m],
-												 DFC_MEMORY_TYPE__CT2);
-							}
-						}
-					}
+				DFC_CollectCandidates(dfc, cand, buf, pos, data, buflen - pos, 0);
+				if (unlikely(cand->total == DFC_CAND_MAX))
+				{
+					matches = DFC_VerifyCandidates(dfc, cand, buf, buflen, matches, sink);
 				}
-
-				dfc->CompactTable2[i].array[n].cnt = temp_cnt;
-				my_free(tempPID);
+				hits &= hits - 1;
 			}
 		}
 	}
 
-	// Only for CT4 firstly
-	for (i = 0; i < CT4_TABLE_SIZE; i++)
+	for (; i < buflen - 1; i++)
 	{
-		for (n = 0; n < dfc->CompactTable4[i].cnt; n++)
+		u32 data = DFC_DFKey(dfc, DFC_Load16(dfc, &buf[i]));
+
+		if (unlikely(DFC_DFTest(dfc, DirectFilter1, DFB_DF1, data)))
 		{
-			/* If the number of PID is bigger than 3, do recursive filtering */
-			if (dfc->CompactTable4[i].array[n].cnt >= RECURSIVE_BOUNDARY)
+			if (likely(buflen - i >= DFC_TAIL_LEN))
 			{
-				int temp_cnt = 0; // cnt for 4 byte patterns.
-				u32 *tempPID;
+				DFC_CollectCandidates(dfc, cand, buf, i, data, buflen - i, 0);
+			}
+			else
+			{
+				DFC_CollectCandidates(dfc, cand, buf, i, data, buflen - i, 1);
+			}
+			if (unlikely(cand->total == DFC_CAND_MAX))
+			{
+				matches = DFC_VerifyCandidates(dfc, cand, buf, buflen, matches, sink);
+			}
+		}
+	}
 
-				/* Initialization */
-				dfc->CompactTable4[i].array[n].DirectFilter = (u8*)my_zalloc(sizeof(u8) * DF_SIZE_REAL);
-				if (dfc->CompactTable4[i].array[n].DirectFilter == NULL)
-				{
-					printf("Failed to allocate memory for recursive things.\n");
-					return -1;
-				}
+	matches = DFC_VerifyCandidates(dfc, cand, buf, buflen, matches, sink);
 
-				dfc->CompactTable4[i].array[n].CompactTable = (CT_Type_2_2B*)my_zalloc(sizeof(CT_Type_2_2B) * RECURSIVE_CT_SIZE);
-				if (dfc->CompactTable4[i].array[n].CompactTable == NULL)
-				{
-					printf("Failed to allocate memory for recursive things.\n");
-					return -1;
-				}
+	/* It is needed to check last 1 byte from payload */
+	matches = Verification_LastByte(dfc, buf, buflen, matches, sink);
 
-				tempPID = (u32*)my_zalloc(sizeof(u32) * dfc->CompactTable4[i].array[n].cnt);
-				if (tempPID == NULL)
-				{
-					printf("Failed to allocate memory for recursive things.\n");
-					return -1;
-				}
+	return matches;
+}
 
-				memcpy(tempPID, dfc->CompactTable4[i].array[n].pid, sizeof(u32) * dfc->CompactTable4[i].array[n].cnt);
+int DFC_SearchTwoPhase(const DFC_STRUCTURE *dfc, unsigned char *buf, int buflen, void* r, void (*Match)(void*, unsigned char *, u32 *, u32))
+{
+	DFC_SINK sink = { .Match = Match, .r = r, .buf = buf };
+	DFC_CANDIDATES cand;
 
-				my_free(dfc->CompactTable4[i].array[n].pid);
-				dfc->CompactTable4[i].array[n].pid = NULL;
+	return DFC_SearchTwoPhaseSink(dfc, &cand, buf, buflen, &sink);
+}
 
-				for (m = 0; m < dfc->CompactTable4[i].array[n].cnt; m++)
-				{
-					//DFC_PATTERN *mlist = dfc->dfcMatchList[];
-					int pat_len = dfc->dfcMatchList[tempPID[m]]->n - 4;
+DFC_CONTEXT *DFC_ContextNew(void)
+{
+	DFC_CONTEXT *ctx;
 
-					if (pat_len == 0) /* When pat length is 4 */
-					{
-						u32 *tmp;
-						temp_cnt ++;
+	if (posix_memalign((void **)&ctx, 64, sizeof(DFC_CONTEXT)) != 0)
+	{
+		return NULL;
+	}
 
-						tmp = (u32 *)my_realloc(dfc->CompactTable4[i].array[n].pid, sizeof(u32) * temp_cnt);
-						if (tmp == NULL)
-						{
-							return -1;
-						}
+	memset(ctx, 0, sizeof(DFC_CONTEXT));
 
-						dfc->CompactTable4[i].array[n].pid = tmp;
-						dfc->CompactTable4[i].array[n].pid[temp_cnt - 1] = tempPID[m];
-					}
-					else if (pat_len == 1)   /* When pat length is 5 */
-					{
-						if (dfc->dfcMatchList[tempPID[m]]->nocase)
-						{
-							temp[1] = tolower(dfc->dfcMatchList[tempPID[m]]->patrn[0]);
-							for (l = 0; l < 256; l++)
-							{
-								temp[0] = l;
+	return ctx;
+}
 
-								fragment_16 = (temp[1] << 8) | temp[0];
-								byteIndex = BINDEX(fragment_16);
-								bitMask = BMASK(fragment_16);
+void DFC_ContextFree(DFC_CONTEXT *ctx)
+{
+	free(ctx);
+}
 
-								dfc->CompactTable4[i].array[n].DirectFilter[byteIndex] |= bitMask;
+/*
+*  DFC_Search / DFC_SearchTwoPhase for one thread of many sharing dfc;
+*  ctx belongs to the calling thread and collects its DFC_SEARCH_STATS.
+*/
+int DFC_SearchCtx(const DFC_STRUCTURE *dfc, DFC_CONTEXT *ctx, unsigned char *buf, int buflen, void* r,
+				  void (*Match)(void*, unsigned char *, u32 *, u32))
+{
+	DFC_SINK sink = { .Match = Match, .r = r, .buf = buf };
+	int matches = DFC_SearchSink(dfc, buf, buflen, 0, &sink);
 
-								Add_PID_to_2B_CT(dfc->CompactTable4[i].array[n].CompactTable, temp,	tempPID[m],
-												 DFC_MEMORY_TYPE__CT4);
-							}
+	ctx->stats.searches++;
+	ctx->stats.bytes += buflen > 0 ? buflen : 0;
+	ctx->stats.matches += matches;
 
-							temp[1] = toupper(dfc->dfcMatchList[tempPID[m]]->patrn[0]);
-							for (l = 0; l < 256; l++)
-							{
-								temp[0] = l;
+	return matches;
+}
 
-								fragment_16 = (temp[1] << 8) | temp[0];
-								byteIndex = BINDEX(fragment_16);
-								bitMask = BMASK(fragment_16);
+int DFC_SearchTwoPhaseCtx(const DFC_STRUCTURE *dfc, DFC_CONTEXT *ctx, unsigned char *buf, int buflen, void* r,
+						  void (*Match)(void*, unsigned char *, u32 *, u32))
+{
+	DFC_SINK sink = { .Match = Match, .r = r, .buf = buf };
+	int matches = DFC_SearchTwoPhaseSink(dfc, &ctx->cand, buf, buflen, &sink);
 
-								dfc->CompactTable4[i].array[n].DirectFilter[byteIndex] |= bitMask;
+	ctx->stats.searches++;
+	ctx->stats.bytes += buflen > 0 ? buflen : 0;
+	ctx->stats.matches += matches;
 
-								Add_PID_to_2B_CT(dfc->CompactTable4[i].array[n].CompactTable, temp,	tempPID[m],
-												 DFC_MEMORY_TYPE__CT4);
-							}
-						}
-						else
-						{
-							temp[1] = dfc->dfcMatchList[tempPID[m]]->casepatrn[0];
-							for (l = 0; l < 256; l++)
-							{
-								temp[0] = l;
+	return matches;
+}
 
-								fragment_16 = (temp[1] << 8) | temp[0];
-								byteIndex = BINDEX(fragment_16);
-								bitMask = BMASK(fragment_16);
+/****************************************************/
+/*          Compiled DFC blob                       */
+/****************************************************/
+static inline u64 DFC_BlobAlign(u64 off)
+{
+	return (off + DFC_BLOB_ALIGN - 1) & ~(u64)(DFC_BLOB_ALIGN - 1);
+}
 
-								dfc->CompactTable4[i].array[n].DirectFilter[byteIndex] |= bitMask;
+/* Fills hdr for dfc and returns the blob size */
+static u64 DFC_BlobLayout(const DFC_STRUCTURE *dfc, DFC_BLOB_HEADER *hdr)
+{
+	u64 sizes[DFC_BLOB_SECTIONS];
+	u64 off;
+	int i;
 
-								Add_PID_to_2B_CT(dfc->CompactTable4[i].array[n].CompactTable, temp,	tempPID[m],
-												 DFC_MEMORY_TYPE__CT4);
-							}
-						}
+	memset(hdr, 0, sizeof(*hdr));
+	hdr->magic = DFC_BLOB_MAGIC;
+	hdr->version = DFC_BLOB_VERSION;
+	hdr->byte_order = DFC_BLOB_BYTE_ORDER;
+	hdr->df_size = DF_SIZE_REAL;
+	hdr->df_bits = dfc->config.df_bits;
+	hdr->rec_ct_size = dfc->config.rec_ct_size;
+	hdr->pattern_interval = dfc->config.pattern_interval;
+	hdr->df_interleave = dfc->config.df_interleave;
+	hdr->fold = dfc->fold;
+	hdr->numPatterns = dfc->numPatterns;
+	hdr->maxPatternLen = dfc->maxPatternLen;
+	hdr->ct2_mask = dfc->CT2.mask;
+	hdr->ct4_mask = dfc->CT4.mask;
+	hdr->ct8_mask = dfc->CT8.mask;
+	hdr->ct2_entries = dfc->CT2.entry_cnt;
+	hdr->ct4_entries = dfc->CT4.entry_cnt;
+	hdr->ct8_entries = dfc->CT8.entry_cnt;
+	hdr->rec_cnt = dfc->RecCT.cnt;
+	hdr->rec_entries = dfc->RecCT.entry_cnt;
+	hdr->pid_cnt = dfc->PIDPoolCnt;
+	memcpy(hdr->ct1_start, dfc->CompactTable1.start, sizeof(hdr->ct1_start));
+
+	sizes[DFC_BLOB_FILTERS] = 7 * DF_SIZE_REAL + 256;
+	sizes[DFC_BLOB_CT1_PID] = sizeof(u32) * (u64)dfc->CompactTable1.start[CT1_TABLE_SIZE];
+	sizes[DFC_BLOB_CT2_BUCKET] = sizeof(u32) * ((u64)dfc->CT2.mask + 2);
+	sizes[DFC_BLOB_CT2_ENTRY] = sizeof(CT_Flat_Entry) * (u64)dfc->CT2.entry_cnt;
+	sizes[DFC_BLOB_CT4_BUCKET] = sizeof(u32) * ((u64)dfc->CT4.mask + 2);
+	sizes[DFC_BLOB_CT4_ENTRY] = sizeof(CT_Flat_Entry) * (u64)dfc->CT4.entry_cnt;
+	sizes[DFC_BLOB_CT8_BUCKET] = sizeof(u32) * ((u64)dfc->CT8.mask + 2);
+	sizes[DFC_BLOB_CT8_ENTRY] = sizeof(CT_Flat_8B_Entry) * (u64)dfc->CT8.entry_cnt;
+	sizes[DFC_BLOB_REC_DF] = (u64)DFC_DFBytes(dfc) * dfc->RecCT.cnt;
+	sizes[DFC_BLOB_REC_BUCKET] = sizeof(u32) * ((u64)dfc->config.rec_ct_size + 1) * dfc->RecCT.cnt;
+	sizes[DFC_BLOB_REC_ENTRY] = sizeof(CT_Flat_Entry) * (u64)dfc->RecCT.entry_cnt;
+	sizes[DFC_BLOB_PID_POOL] = sizeof(u32) * (u64)dfc->PIDPoolCnt;
+	sizes[DFC_BLOB_STORE] = dfc->store_size;
+	sizes[DFC_BLOB_STORE_OFF] = sizeof(u32) * ((u64)dfc->numPatterns + 1);
+	sizes[DFC_BLOB_SID_START] = sizeof(u32) * ((u64)dfc->numPatterns + 1);
+	sizes[DFC_BLOB_SID_POOL] = sizeof(u32) * (u64)dfc->sid_start[dfc->numPatterns];
+
+	off = DFC_BlobAlign(sizeof(DFC_BLOB_HEADER));
+	for (i = 0; i < DFC_BLOB_SECTIONS; i++)
+	{
+		hdr->section[i].off = off;
+		hdr->section[i].size = sizes[i];
+		off = DFC_BlobAlign(off + sizes[i]);
+	}
 
-					}
-					else    /* When pat length is 7 (pat_len is equal to 2(6) or 3(7)) */
-					{
-						if (dfc->dfcMatchList[tempPID[m]]->nocase)
-						{
-							alpha_cnt = 0;
-							do
-							{
-								for (l = 1, k = 0; l >= 0; --l, k++)
-								{
-									flag[k] = (alpha_cnt >> l) & 1;
-								}
+	hdr->size = off;
 
-								for (l = pat_len - 2, k = 0; l <= pat_len - 1; l++, k++)
-								{
-									Build_pattern(dfc->dfcMatchList[tempPID[m]], flag, temp, 0, l, k);
-								}
+	return off;
+}
 
-								fragment_16 = (temp[1] << 8) | temp[0];
-								byteIndex = BINDEX(fragment_16);
-								bitMask = BMASK(fragment_16);
+/* Size of the blob DFC_Serialize writes for dfc, 0 if dfc is not compiled */
+size_t DFC_SerializedSize(const DFC_STRUCTURE *dfc)
+{
+	DFC_BLOB_HEADER hdr;
 
-								dfc->CompactTable4[i].array[n].DirectFilter[byteIndex] |= bitMask;
+	if (dfc->init_hash != NULL)
+	{
+		return 0;
+	}
 
-								Add_PID_to_2B_CT(dfc->CompactTable4[i].array[n].CompactTable, temp, tempPID[m],
-												 DFC_MEMORY_TYPE__CT4);
+	return (size_t)DFC_BlobLayout(dfc, &hdr);
+}
 
-								alpha_cnt++;
-							}
-							while (alpha_cnt < 4);
-						}
-						else   /* case sensitive pattern */
-						{
-							temp[0] = dfc->dfcMatchList[tempPID[m]]->casepatrn[pat_len - 2];
-							temp[1] = dfc->dfcMatchList[tempPID[m]]->casepatrn[pat_len - 1];
+/*
+*  Writes compiled dfc into out as a position-independent blob: filters,
+*  flattened CTs, pattern store and sids, with offsets instead of pointers.
+*  The blob uses the host byte order and DF geometry; DFC_Deserialize
+*  rejects blobs from a different one.
+*
+* \param out      Buffer of at least DFC_SerializedSize(dfc) bytes
+* \param out_size Size of out
+*
+* \retval  0 On success.
+* \retval -1 dfc is not compiled or out is too small.
+*/
+int DFC_Serialize(const DFC_STRUCTURE *dfc, void *out, size_t out_size)
+{
+	DFC_BLOB_HEADER hdr;
+	unsigned char *b = (unsigned char *)out;
 
-							fragment_16 = (temp[1] << 8) | temp[0];
-							byteIndex = BINDEX(fragment_16);
-							bitMask = BMASK(fragment_16);
+	if (dfc->init_hash != NULL)
+	{
+		printf("DFC_Serialize: the instance is not compiled.\n");
+		return -1;
+	}
 
-							dfc->CompactTable4[i].array[n].DirectFilter[byteIndex] |= bitMask;
+	if (DFC_BlobLayout(dfc, &hdr) > out_size)
+	{
+		printf("DFC_Serialize: out_size %zu is too small.\n", out_size);
+		return -1;
+	}
 
-							Add_PID_to_2B_CT(dfc->CompactTable4[i].array[n].CompactTable, temp, tempPID[m],
-											 DFC_MEMORY_TYPE__CT4);
-						}
-					}
-				}
+	memset(b, 0, hdr.size);
+	memcpy(b, &hdr, sizeof(hdr));
 
-				dfc->CompactTable4[i].array[n].cnt = temp_cnt;
-				my_free(tempPID);
-			}
-		}
+#define DFC_BLOB_PUT(sec, src)  memcpy(b + hdr.section[sec].off, (src), hdr.section[sec].size)
+	{
+		unsigned char *f = b + hdr.section[DFC_BLOB_FILTERS].off;
+
+		memcpy(f, dfc->DirectFilter1, DF_SIZE_REAL);
+		f += DF_SIZE_REAL;
+		memcpy(f, dfc->cDF0, 256);
+		f += 256;
+		memcpy(f, dfc->cDF1, DF_SIZE_REAL);
+		f += DF_SIZE_REAL;
+		memcpy(f, dfc->cDF2, DF_SIZE_REAL);
+		f += DF_SIZE_REAL;
+		memcpy(f, dfc->ADD_DF_4_plus, DF_SIZE_REAL);
+		f += DF_SIZE_REAL;
+		memcpy(f, dfc->ADD_DF_4_1, DF_SIZE_REAL);
+		f += DF_SIZE_REAL;
+		memcpy(f, dfc->ADD_DF_8_1, DF_SIZE_REAL);
+		f += DF_SIZE_REAL;
+		memcpy(f, dfc->ADD_DF_8_2, DF_SIZE_REAL);
 	}
 
-	/* For CT8 */
-	for (i = 0; i < CT8_TABLE_SIZE; i++)
+	if (hdr.section[DFC_BLOB_CT1_PID].size)
 	{
-		for (n = 0; n < dfc->CompactTable8[i].cnt; n++)
-		{
-			/* If the number of PID is bigger than RECURSIVE_BOUNDARY, do recursive filtering */
-			if (dfc->CompactTable8[i].array[n].cnt >= RECURSIVE_BOUNDARY)
-			{
-				int temp_cnt = 0; // cnt for 8 byte patterns.
-				u32 *tempPID;
+		DFC_BLOB_PUT(DFC_BLOB_CT1_PID, dfc->CompactTable1.pid);
+	}
+	DFC_BLOB_PUT(DFC_BLOB_CT2_BUCKET, dfc->CT2.bucket);
+	DFC_BLOB_PUT(DFC_BLOB_CT2_ENTRY, dfc->CT2.entry);
+	DFC_BLOB_PUT(DFC_BLOB_CT4_BUCKET, dfc->CT4.bucket);
+	DFC_BLOB_PUT(DFC_BLOB_CT4_ENTRY, dfc->CT4.entry);
+	DFC_BLOB_PUT(DFC_BLOB_CT8_BUCKET, dfc->CT8.bucket);
+	DFC_BLOB_PUT(DFC_BLOB_CT8_ENTRY, dfc->CT8.entry);
+	DFC_BLOB_PUT(DFC_BLOB_REC_DF, dfc->RecCT.df);
+	DFC_BLOB_PUT(DFC_BLOB_REC_BUCKET, dfc->RecCT.bucket);
+	DFC_BLOB_PUT(DFC_BLOB_REC_ENTRY, dfc->RecCT.entry);
+	DFC_BLOB_PUT(DFC_BLOB_PID_POOL, dfc->PIDPool);
+	DFC_BLOB_PUT(DFC_BLOB_STORE, dfc->PatternStore);
+	DFC_BLOB_PUT(DFC_BLOB_STORE_OFF, dfc->store_off);
+	DFC_BLOB_PUT(DFC_BLOB_SID_START, dfc->sid_start);
+	DFC_BLOB_PUT(DFC_BLOB_SID_POOL, dfc->SIDPool);
+#undef DFC_BLOB_PUT
 
-				/* Initialization */
-				dfc->CompactTable8[i].array[n].DirectFilter = (u8*)my_zalloc(DF_SIZE_REAL * sizeof(u8));
-				if (dfc->CompactTable8[i].array[n].DirectFilter == NULL)
-				{
-					printf("Failed to allocate memory for recursive things.\n");
-					return -1;
-				}
+	return 0;
+}
 
-				dfc->CompactTable8[i].array[n].CompactTable = (CT_Type_2_2B *)my_zalloc(sizeof(CT_Type_2_2B) * RECURSIVE_CT_SIZE);
-				if (dfc->CompactTable8[i].array[n].CompactTable == NULL)
-				{
-					printf("Failed to allocate memory for recursive things.\n");
-					return -1;
-				}
+/* Range check of a CSR bucket array: monotonic and ending at most at cnt */
+static int DFC_BlobCheckBuckets(const u32 *bucket, u64 n, u32 cnt)
+{
+	u64 i;
 
-				tempPID = (u32*)my_zalloc(sizeof(u32) * dfc->CompactTable8[i].array[n].cnt);
-				if (tempPID == NULL)
-				{
-					printf("Failed to allocate memory for recursive things.\n");
-					return -1;
-				}
+	for (i = 0; i + 1 < n; i++)
+	{
+		if (bucket[i] > bucket[i + 1])
+		{
+			return -1;
+		}
+	}
 
-				memcpy(tempPID, dfc->CompactTable8[i].array[n].pid, sizeof(u32) * dfc->CompactTable8[i].array[n].cnt);
+	return (n == 0 || bucket[n - 1] <= cnt) ? 0 : -1;
+}
 
-				my_free(dfc->CompactTable8[i].array[n].pid);
-				dfc->CompactTable8[i].array[n].pid = NULL;
+static int DFC_BlobCheckEntries(const CT_Flat_Entry *e, u32 n, u32 pids, u32 recs)
+{
+	u32 i;
 
-				for (m = 0; m < dfc->CompactTable8[i].array[n].cnt; m++)
-				{
-					//DFC_PATTERN *mlist = dfc->dfcMatchList[];
-					int pat_len = dfc->dfcMatchList[tempPID[m]]->n - 8;
+	for (i = 0; i < n; i++)
+	{
+		if ((u64)e[i].pid_start + e[i].pid_cnt > pids || e[i].rec > recs)
+		{
+			return -1;
+		}
+	}
 
-					if (pat_len == 0) /* When pat length is 8 */
-					{
-						u32 *tmp;
-						temp_cnt ++;
+	return 0;
+}
 
-						tmp = (u32 *)my_realloc(dfc->CompactTable8[i].array[n].pid, sizeof(u32) * temp_cnt);
-						if (tmp == NULL)
-						{
-							printf("Failed to allocate memory for recursive things.\n");
-							return -1;
-						}
+/* Every record of the pattern store lies inside it and every sid range
+ * inside the SID pool */
+static int DFC_BlobCheckStore(const DFC_BLOB_HEADER *hdr, const unsigned char *b)
+{
+	const u8 *store = b + hdr->section[DFC_BLOB_STORE].off;
+	const u32 *store_off = (const u32 *)(b + hdr->section[DFC_BLOB_STORE_OFF].off);
+	const u32 *sid_start = (const u32 *)(b + hdr->section[DFC_BLOB_SID_START].off);
+	u64 store_size = hdr->section[DFC_BLOB_STORE].size;
+	u32 i;
 
-						dfc->CompactTable8[i].array[n].pid = tmp;
-						dfc->CompactTable8[i].array[n].pid[temp_cnt - 1] = tempPID[m];
-					}
-					else if (pat_len == 1)   /* When pat length is 9 */
-					{
-						if (dfc->dfcMatchList[tempPID[m]]->nocase)
-						{
-							temp[1] = tolower(dfc->dfcMatchList[tempPID[m]]->patrn[0]);
-							for (l = 0; l < 256; l++)
-							{
-								temp[0] = l;
+	if (hdr->section[DFC_BLOB_SID_POOL].size != sizeof(u32) * (u64)sid_start[hdr->numPatterns] ||
+		DFC_BlobCheckBuckets(sid_start, (u64)hdr->numPatterns + 1, sid_start[hdr->numPatterns]) < 0)
+	{
+		return -1;
+	}
 
-								fragment_16 = (temp[1] << 8) | temp[0];
-								byteIndex = BINDEX(fragment_16);
-								bitMask = BMASK(fragment_16);
+	for (i = 0; i < hdr->numPatterns; i++)
+	{
+		const DFC_STORED_PATTERN *rec = (const DFC_STORED_PATTERN *)(store + store_off[i]);
 
-								dfc->CompactTable8[i].array[n].DirectFilter[byteIndex] |= bitMask;
+		if (store_off[i] % sizeof(u32) || store_off[i] + (u64)sizeof(DFC_STORED_PATTERN) > store_size ||
+			rec->n == 0 || rec->n > (u32)hdr->maxPatternLen || rec->n > store_size - store_off[i] - sizeof(DFC_STORED_PATTERN) ||
+			(rec->n >= 8 ? rec->ct8_off > rec->n - 8 : rec->ct8_off != 0))
+		{
+			return -1;
+		}
+	}
 
-								Add_PID_to_2B_CT(dfc->CompactTable8[i].array[n].CompactTable, temp,	tempPID[m],
-												 DFC_MEMORY_TYPE__CT8);
-							}
+	return 0;
+}
 
-							temp[1] = toupper(dfc->dfcMatchList[tempPID[m]]->patrn[0]);
-							for (l = 0; l < 256; l++)
-							{
-								temp[0] = l;
+/* Every offset, count and index the search follows stays inside the blob */
+static int DFC_BlobCheck(const DFC_BLOB_HEADER *hdr, const unsigned char *b, size_t size)
+{
+	const u32 *pool = (const u32 *)(b + hdr->section[DFC_BLOB_PID_POOL].off);
+	const CT_Flat_8B_Entry *e8 = (const CT_Flat_8B_Entry *)(b + hdr->section[DFC_BLOB_CT8_ENTRY].off);
+	u32 i;
 
-								fragment_16 = (temp[1] << 8) | temp[0];
-								byteIndex = BINDEX(fragment_16);
-								bitMask = BMASK(fragment_16);
+	if (hdr->size > size || hdr->numPatterns > INT32_MAX ||
+		((hdr->ct2_mask + 1) & hdr->ct2_mask) || ((hdr->ct4_mask + 1) & hdr->ct4_mask) || ((hdr->ct8_mask + 1) & hdr->ct8_mask))
+	{
+		return -1;
+	}
 
-								dfc->CompactTable8[i].array[n].DirectFilter[byteIndex] |= bitMask;
+	for (i = 0; i < DFC_BLOB_SECTIONS; i++)
+	{
+		if (hdr->section[i].off % DFC_BLOB_ALIGN || hdr->section[i].off > hdr->size ||
+			hdr->section[i].size > hdr->size - hdr->section[i].off)
+		{
+			return -1;
+		}
+	}
 
-								Add_PID_to_2B_CT(dfc->CompactTable8[i].array[n].CompactTable, temp,	tempPID[m],
-												 DFC_MEMORY_TYPE__CT8);
-							}
-						}
-						else
-						{
-							temp[1] = dfc->dfcMatchList[tempPID[m]]->casepatrn[0];
-							for (l = 0; l < 256; l++)
-							{
-								temp[0] = l;
+	/* Section sizes have to match the counts they are indexed with */
+	if (hdr->section[DFC_BLOB_FILTERS].size != 7 * DF_SIZE_REAL + 256 ||
+		hdr->section[DFC_BLOB_CT1_PID].size != sizeof(u32) * (u64)hdr->ct1_start[CT1_TABLE_SIZE] ||
+		hdr->section[DFC_BLOB_CT2_BUCKET].size != sizeof(u32) * ((u64)hdr->ct2_mask + 2) ||
+		hdr->section[DFC_BLOB_CT2_ENTRY].size != sizeof(CT_Flat_Entry) * (u64)hdr->ct2_entries ||
+		hdr->section[DFC_BLOB_CT4_BUCKET].size != sizeof(u32) * ((u64)hdr->ct4_mask + 2) ||
+		hdr->section[DFC_BLOB_CT4_ENTRY].size != sizeof(CT_Flat_Entry) * (u64)hdr->ct4_entries ||
+		hdr->section[DFC_BLOB_CT8_BUCKET].size != sizeof(u32) * ((u64)hdr->ct8_mask + 2) ||
+		hdr->section[DFC_BLOB_CT8_ENTRY].size != sizeof(CT_Flat_8B_Entry) * (u64)hdr->ct8_entries ||
+		hdr->section[DFC_BLOB_REC_DF].size != (u64)(1 << hdr->df_bits) / 8 * hdr->rec_cnt ||
+		hdr->section[DFC_BLOB_REC_BUCKET].size != sizeof(u32) * ((u64)hdr->rec_ct_size + 1) * hdr->rec_cnt ||
+		hdr->section[DFC_BLOB_REC_ENTRY].size != sizeof(CT_Flat_Entry) * (u64)hdr->rec_entries ||
+		hdr->section[DFC_BLOB_PID_POOL].size != sizeof(u32) * (u64)hdr->pid_cnt ||
+		hdr->section[DFC_BLOB_STORE].size > UINT32_MAX ||
+		hdr->section[DFC_BLOB_STORE_OFF].size != sizeof(u32) * ((u64)hdr->numPatterns + 1) ||
+		hdr->section[DFC_BLOB_SID_START].size != sizeof(u32) * ((u64)hdr->numPatterns + 1))
+	{
+		return -1;
+	}
 
-								fragment_16 = (temp[1] << 8) | temp[0];
-								byteIndex = BINDEX(fragment_16);
-								bitMask = BMASK(fragment_16);
+	if (DFC_BlobCheckStore(hdr, b) < 0)
+	{
+		return -1;
+	}
 
-								dfc->CompactTable8[i].array[n].DirectFilter[byteIndex] |= bitMask;
+	if (DFC_BlobCheckBuckets(hdr->ct1_start, CT1_TABLE_SIZE + 1, hdr->ct1_start[CT1_TABLE_SIZE]) < 0 ||
+		DFC_BlobCheckBuckets((const u32 *)(b + hdr->section[DFC_BLOB_CT2_BUCKET].off), (u64)hdr->ct2_mask + 2, hdr->ct2_entries) < 0 ||
+		DFC_BlobCheckBuckets((const u32 *)(b + hdr->section[DFC_BLOB_CT4_BUCKET].off), (u64)hdr->ct4_mask + 2, hdr->ct4_entries) < 0 ||
+		DFC_BlobCheckBuckets((const u32 *)(b + hdr->section[DFC_BLOB_CT8_BUCKET].off), (u64)hdr->ct8_mask + 2, hdr->ct8_entries) < 0 ||
+		DFC_BlobCheckBuckets((const u32 *)(b + hdr->section[DFC_BLOB_REC_BUCKET].off), ((u64)hdr->rec_ct_size + 1) * hdr->rec_cnt, hdr->rec_entries) < 0)
+	{
+		return -1;
+	}
 
-								Add_PID_to_2B_CT(dfc->CompactTable8[i].array[n].CompactTable, temp,	tempPID[m],
-												 DFC_MEMORY_TYPE__CT8);
-							}
-						}
+	if (DFC_BlobCheckEntries((const CT_Flat_Entry *)(b + hdr->section[DFC_BLOB_CT2_ENTRY].off), hdr->ct2_entries, hdr->pid_cnt, hdr->rec_cnt) < 0 ||
+		DFC_BlobCheckEntries((const CT_Flat_Entry *)(b + hdr->section[DFC_BLOB_CT4_ENTRY].off), hdr->ct4_entries, hdr->pid_cnt, hdr->rec_cnt) < 0 ||
+		DFC_BlobCheckEntries((const CT_Flat_Entry *)(b + hdr->section[DFC_BLOB_REC_ENTRY].off), hdr->rec_entries, hdr->pid_cnt, 0) < 0)
+	{
+		return -1;
+	}
 
-					}
-					else    /* longer than or equal to 10 */
-					{
-						if (dfc->dfcMatchList[tempPID[m]]->nocase)
-						{
-							alpha_cnt = 0;
-							do
-							{
-								for (l = 1, k = 0; l >= 0; --l, k++)
-								{
-									flag[k] = (alpha_cnt >> l) & 1;
-								}
+	for (i = 0; i < hdr->ct8_entries; i++)
+	{
+		if ((u64)e8[i].pid_start + e8[i].pid_cnt > hdr->pid_cnt || e8[i].rec > hdr->rec_cnt)
+		{
+			return -1;
+		}
+	}
 
-								for (l = pat_len - 2, k = 0; l <= pat_len - 1; l++, k++)
-								{
-									Build_pattern(dfc->dfcMatchList[tempPID[m]], flag, temp, 0, l, k);
-								}
+	for (i = 0; i < hdr->pid_cnt; i++)
+	{
+		if (pool[i] >= hdr->numPatterns)
+		{
+			return -1;
+		}
+	}
 
-								fragment_16 = (temp[1] << 8) | temp[0];
-								byteIndex = BINDEX(fragment_16);
-								bitMask = BMASK(fragment_16);
+	for (i = 0; i < hdr->ct1_start[CT1_TABLE_SIZE]; i++)
+	{
+		if (((const u32 *)(b + hdr->section[DFC_BLOB_CT1_PID].off))[i] >= hdr->numPatterns)
+		{
+			return -1;
+		}
+	}
 
-								dfc->CompactTable8[i].array[n].DirectFilter[byteIndex] |= bitMask;
+	return 0;
+}
 
-								Add_PID_to_2B_CT(dfc->CompactTable8[i].array[n].CompactTable, temp, tempPID[m],
-												 DFC_MEMORY_TYPE__CT8);
+/*
+*  Creates a searchable instance on top of a blob from DFC_Serialize
+*  without copying the tables or the pattern store: only the filters are
+*  private, DFC_GetPattern builds a DFC_PATTERN when one is asked for.
+*  blob must be 8-byte aligned and stay mapped and unchanged until
+*  DFC_Free; it is only read.
+*
+* \retval NULL The blob is malformed or was written by an incompatible build.
+*/
+DFC_STRUCTURE *DFC_Deserialize(const void *blob, size_t size)
+{
+	const unsigned char *b = (const unsigned char *)blob;
+	const DFC_BLOB_HEADER *hdr = (const DFC_BLOB_HEADER *)blob;
+	const unsigned char *f;
+	DFC_ALLOCATOR a = dfc_libc_allocator;
+	DFC_STRUCTURE *dfc;
 
-								alpha_cnt++;
-							}
-							while (alpha_cnt < 4);
-						}
-						else   /* case sensitive pattern */
-						{
-							temp[0] = dfc->dfcMatchList[tempPID[m]]->casepatrn[pat_len - 2];
-							temp[1] = dfc->dfcMatchList[tempPID[m]]->casepatrn[pat_len - 1];
+	if ((uintptr_t)blob % 8 || size < sizeof(DFC_BLOB_HEADER) ||
+		hdr->magic != DFC_BLOB_MAGIC || hdr->version != DFC_BLOB_VERSION || hdr->byte_order != DFC_BLOB_BYTE_ORDER ||
+		hdr->df_size != DF_SIZE_REAL || hdr->df_bits < DF_BITS_MIN || hdr->df_bits > DF_BITS ||
+		!DFC_IsPow2(hdr->rec_ct_size, 1, RECURSIVE_CT_SIZE_MAX) || hdr->pattern_interval < MIN_PATTERN_INTERVAL ||
+		hdr->df_interleave > 1)
+	{
+		printf("DFC_Deserialize: not a compatible DFC blob.\n");
+		return NULL;
+	}
 
-							fragment_16 = (temp[1] << 8) | temp[0];
-							byteIndex = BINDEX(fragment_16);
-							bitMask = BMASK(fragment_16);
+	if (DFC_BlobCheck(hdr, b, size) < 0)
+	{
+		printf("DFC_Deserialize: the blob is corrupt.\n");
+		return NULL;
+	}
 
-							dfc->CompactTable8[i].array[n].DirectFilter[byteIndex] |= bitMask;
+	pthread_once(&dfc_init_once, DFC_InitGlobals);
 
-							Add_PID_to_2B_CT(dfc->CompactTable8[i].array[n].CompactTable, temp, tempPID[m],
-											 DFC_MEMORY_TYPE__CT8);
-						}
-					}
-				}
+	dfc = (DFC_STRUCTURE *)my_alloc_block(&a, sizeof(DFC_STRUCTURE), DFC_MEMORY_TYPE__DFC);
+	if (dfc == NULL)
+	{
+		return NULL;
+	}
 
-				dfc->CompactTable8[i].array[n].cnt = temp_cnt;
-				my_free(tempPID);
-			}
-		}
+	memset(dfc, 0, sizeof(DFC_STRUCTURE));
+	dfc->allocator = a;
+	my_account(dfc, DFC_MEMORY_TYPE__DFC, sizeof(DFC_STRUCTURE), 1);
+	dfc->blob = blob;
+
+	DFC_ConfigDefault(&dfc->config);
+	dfc->config.df_bits = hdr->df_bits;
+	dfc->config.rec_ct_size = hdr->rec_ct_size;
+	dfc->config.pattern_interval = hdr->pattern_interval;
+	dfc->config.df_interleave = hdr->df_interleave;
+	dfc->df_mask = (1u << hdr->df_bits) - 1;
+	dfc->rec_mask = hdr->rec_ct_size - 1;
+
+	dfc->fold = hdr->fold;
+	dfc->numPatterns = hdr->numPatterns;
+	dfc->maxPatternLen = hdr->maxPatternLen;
+
+	f = b + hdr->section[DFC_BLOB_FILTERS].off;
+	memcpy(dfc->DirectFilter1, f, DF_SIZE_REAL);
+	f += DF_SIZE_REAL;
+	memcpy(dfc->cDF0, f, 256);
+	f += 256;
+	memcpy(dfc->cDF1, f, DF_SIZE_REAL);
+	f += DF_SIZE_REAL;
+	memcpy(dfc->cDF2, f, DF_SIZE_REAL);
+	f += DF_SIZE_REAL;
+	memcpy(dfc->ADD_DF_4_plus, f, DF_SIZE_REAL);
+	f += DF_SIZE_REAL;
+	memcpy(dfc->ADD_DF_4_1, f, DF_SIZE_REAL);
+	f += DF_SIZE_REAL;
+	memcpy(dfc->ADD_DF_8_1, f, DF_SIZE_REAL);
+	f += DF_SIZE_REAL;
+	memcpy(dfc->ADD_DF_8_2, f, DF_SIZE_REAL);
+
+	if (DFC_BuildDFBits(dfc) < 0)
+	{
+		DFC_Free(dfc);
+		return NULL;
 	}
 
-	return 0;
+	/* The search never writes through these, the casts only drop const */
+	memcpy(dfc->CompactTable1.start, hdr->ct1_start, sizeof(hdr->ct1_start));
+	dfc->CompactTable1.pid = (u32 *)(b + hdr->section[DFC_BLOB_CT1_PID].off);
+
+	dfc->CT2.mask = hdr->ct2_mask;
+	dfc->CT2.entry_cnt = hdr->ct2_entries;
+	dfc->CT2.bucket = (u32 *)(b + hdr->section[DFC_BLOB_CT2_BUCKET].off);
+	dfc->CT2.entry = (CT_Flat_Entry *)(b + hdr->section[DFC_BLOB_CT2_ENTRY].off);
+	dfc->CT4.mask = hdr->ct4_mask;
+	dfc->CT4.entry_cnt = hdr->ct4_entries;
+	dfc->CT4.bucket = (u32 *)(b + hdr->section[DFC_BLOB_CT4_BUCKET].off);
+	dfc->CT4.entry = (CT_Flat_Entry *)(b + hdr->section[DFC_BLOB_CT4_ENTRY].off);
+	dfc->CT8.mask = hdr->ct8_mask;
+	dfc->CT8.entry_cnt = hdr->ct8_entries;
+	dfc->CT8.bucket = (u32 *)(b + hdr->section[DFC_BLOB_CT8_BUCKET].off);
+	dfc->CT8.entry = (CT_Flat_8B_Entry *)(b + hdr->section[DFC_BLOB_CT8_ENTRY].off);
+	dfc->RecCT.cnt = hdr->rec_cnt;
+	dfc->RecCT.entry_cnt = hdr->rec_entries;
+	dfc->RecCT.df = (u8 *)(b + hdr->section[DFC_BLOB_REC_DF].off);
+	dfc->RecCT.bucket = (u32 *)(b + hdr->section[DFC_BLOB_REC_BUCKET].off);
+	dfc->RecCT.entry = (CT_Flat_Entry *)(b + hdr->section[DFC_BLOB_REC_ENTRY].off);
+	dfc->PIDPoolCnt = hdr->pid_cnt;
+	dfc->PIDPool = (u32 *)(b + hdr->section[DFC_BLOB_PID_POOL].off);
+
+	dfc->PatternStore = (u8 *)(b + hdr->section[DFC_BLOB_STORE].off);
+	dfc->store_size = (u32)hdr->section[DFC_BLOB_STORE].size;
+	dfc->store_off = (u32 *)(b + hdr->section[DFC_BLOB_STORE_OFF].off);
+	dfc->sid_start = (u32 *)(b + hdr->section[DFC_BLOB_SID_START].off);
+	dfc->SIDPool = (u32 *)(b + hdr->section[DFC_BLOB_SID_POOL].off);
+
+	return dfc;
 }
 
-static int Verification_CT1(DFC_STRUCTURE *dfc,
-							unsigned char *buf,
-							int matches,
-							void* r,
-							void (*Match)(void*, unsigned char *, u32 *, u32),
-							const unsigned char *starting_point)
+/* Writes the blob of dfc to path.tmp and renames it to path, so readers
+ * never map a half-written file */
+int DFC_SaveFile(const DFC_STRUCTURE *dfc, const char *path)
 {
-	int i;
-	for (i = 0; i < dfc->CompactTable1[*(buf - 2)].cnt; i++)
+	size_t size = DFC_SerializedSize(dfc);
+	char tmp[4096];
+	void *blob;
+	FILE *fp;
+	int ret = 0;
+
+	if (size == 0 || snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= (int)sizeof(tmp))
 	{
-		u32 pid = dfc->CompactTable1[*(buf - 2)].pid[i];
-		DFC_PATTERN *mlist = dfc->dfcMatchList[pid];
+		printf("DFC_SaveFile: cannot save %s.\n", path);
+		return -1;
+	}
 
-		Match(r, mlist->casepatrn, mlist->sids, mlist->sids_size);
-		matches += mlist->sids_size;
+	blob = malloc(size);
+	if (blob == NULL)
+	{
+		return -1;
 	}
-	return matches;
-}
 
-static int Verification_CT2(DFC_STRUCTURE *dfc,
-							unsigned char *buf,
-							int matches,
-							void* r,
-							void (*Match)(void*, unsigned char *, u32 *, u32),
-							const unsigned char *starting_point)
-{
-	u32 crc = my_crc32_u16(0, *(u16*)(buf - 2));
-	u32 i;
+	if (DFC_Serialize(dfc, blob, size) < 0)
+	{
+		free(blob);
+		return -1;
+	}
 
-	// 2. calculate index
-	crc &= CT2_TABLE_SIZE_MASK;
+	fp = fopen(tmp, "wb");
+	if (fp == NULL || fwrite(blob, 1, size, fp) != size)
+	{
+		ret = -1;
+	}
 
-	for (i = 0; i < dfc->CompactTable2[crc].cnt; i++)
+	if (fp != NULL && fclose(fp) != 0)
 	{
-		if (dfc->CompactTable2[crc].array[i].pat == *(u16*)(buf - 2))
-		{
-			u32 j;
-			if (dfc->CompactTable2[crc].array[i].DirectFilter == NULL)
-			{
-				for (j = 0; j < dfc->CompactTable2[crc].array[i].cnt; j++)
-				{
-					u32 pid = dfc->CompactTable2[crc].array[i].pid[j];
-					DFC_PATTERN *mlist = dfc->dfcMatchList[pid];
+		ret = -1;
+	}
 
-					if (buf - starting_point >= mlist->n)
-					{
-						if (mlist->nocase)
-						{
-							if (my_strncasecmp(buf - (mlist->n), mlist->casepatrn, mlist->n - 2) == 0)
-							{
-								Match(r, mlist->casepatrn, mlist->sids, mlist->sids_size);
-								matches += mlist->sids_size;
-							}
-						}
-						else
-						{
-							if (my_strncmp(buf - (mlist->n), mlist->casepatrn, mlist->n - 2) == 0)
-							{
-								Match(r, mlist->casepatrn, mlist->sids, mlist->sids_size);
-								matches += mlist->sids_size;
-							}
-						}
-					}
-				}
-			}
-			else
-			{
-				u16 data;
-				BTYPE index;
-				BTYPE mask;
+	if (ret == 0 && rename(tmp, path) != 0)
+	{
+		ret = -1;
+	}
 
-				for (j = 0; j < dfc->CompactTable2[crc].array[i].cnt; j++)
-				{
-					u32 pid = dfc->CompactTable2[crc].array[i].pid[j];
-					DFC_PATTERN *mlist = dfc->dfcMatchList[pid];
+	if (ret < 0)
+	{
+		printf("DFC_SaveFile: cannot write %s.\n", path);
+		remove(tmp);
+	}
 
-					Match(r, mlist->casepatrn, mlist->sids, mlist->sids_size);
-					matches += mlist->sids_size;
-				}
+	free(blob);
+
+	return ret;
+}
 
-				data = *(u16*)(buf - 4);
-				index = BINDEX(data);
-				mask = BMASK(data);
+/* Maps a DFC_SaveFile blob read-only; processes loading the same file
+ * share its pages */
+DFC_STRUCTURE *DFC_LoadFile(const char *path)
+{
+	struct stat st;
+	DFC_STRUCTURE *dfc;
+	void *map;
+	int fd = open(path, O_RDONLY);
 
-				if (dfc->CompactTable2[crc].array[i].DirectFilter[index] & mask)
-				{
-					u32 crc2 = my_crc32_u16(0, data);
-					u32 k;
+	if (fd < 0)
+	{
+		printf("DFC_LoadFile: cannot open %s.\n", path);
+		return NULL;
+	}
 
-					// 2. calculate index
-					crc2 &= CT2_TABLE_SIZE_MASK;
+	if (fstat(fd, &st) != 0 || st.st_size <= 0)
+	{
+		close(fd);
+		return NULL;
+	}
 
-					for (k = 0; k < dfc->CompactTable2[crc].array[i].CompactTable[crc2].cnt; k++)
-					{
-						if (dfc->CompactTable2[crc].array[i].CompactTable[crc2].array[k].pat == data)
-						{
-							u32 l;
-							for (l = 0; l < dfc->CompactTable2[crc].array[i].CompactTable[crc2].array[k].cnt; l++)
-							{
-								u32 pid = dfc->CompactTable2[crc].array[i].CompactTable[crc2].array[k].pid[l];
-								DFC_PATTERN *mlist = dfc->dfcMatchList[pid];
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+	{
+		printf("DFC_LoadFile: cannot map %s.\n", path);
+		return NULL;
+	}
 
-								Match(r, mlist->casepatrn, mlist->sids, mlist->sids_size);
-								matches += mlist->sids_size;
-							}
-							break;
-						}
-					}
-				}
-			}
-			break;
-		}
+	dfc = DFC_Deserialize(map, st.st_size);
+	if (dfc == NULL)
+	{
+		munmap(map, st.st_size);
+		return NULL;
 	}
-	return matches;
-}
 
-static int Verification_CT4_7(DFC_STRUCTURE *dfc,
-							  unsigned char *buf,
-							  int matches,
-							  void* r,
-							  void (*Match)(void*, unsigned char *, u32 *, u32),
-							  const unsigned char *starting_point)
-{
-	// 1. Convert payload to uppercase
-	unsigned char *temp = buf - 2;
-	u32 i;
+	dfc->blob_map_size = st.st_size;
 
-	// 2. calculate crc
-	u32 crc = my_crc32_u32(0, *(u32*)temp);
+	return dfc;
+}
 
-	// 3. calculate index
-	crc &= CT4_TABLE_SIZE_MASK;
+/****************************************************/
+/*          Rule set hot swap (QSBR)                */
+/****************************************************/
+/*
+*  A DFC_HANDLE owns the compiled generation readers search. Each reader
+*  thread registers once, calls DFC_HandleAcquire before a search and
+*  DFC_HandleQuiescent once it holds no pointer from it any more (e.g.
+*  after every packet or batch). Neither takes a lock: the search path
+*  costs one load, the quiescent point one load and one store.
+*
+*  A writer publishes a compiled instance with DFC_HandlePublish, or has
+*  DFC_HandleUpdate compile and publish it in the background. The old
+*  generation is freed once every registered reader has passed a
+*  quiescent point since the swap; the writer waits for that, readers
+*  never do. A registered thread that stops searching for a while must
+*  unregister, or it holds up reclamation. Updates come from one writer
+*  thread, which must not be a registered reader itself.
+*
+* \param dfc  Compiled first generation, or NULL (DFC_HandleAcquire then
+*             returns NULL until the first publish)
+*/
+DFC_HANDLE *DFC_HandleNew(DFC_STRUCTURE *dfc)
+{
+	DFC_HANDLE *h;
 
-	// 4.
-	for (i = 0; i < dfc->CompactTable4[crc].cnt; i++)
+	if (posix_memalign((void **)&h, 64, sizeof(DFC_HANDLE)) != 0)
 	{
-		if (dfc->CompactTable4[crc].array[i].pat == *(u32*)temp)
-		{
-			u32 j;
-			if (dfc->CompactTable4[crc].array[i].DirectFilter == NULL)
-			{
-				for (j = 0; j < dfc->CompactTable4[crc].array[i].cnt; j++)
-				{
-					u32 pid = dfc->CompactTable4[crc].array[i].pid[j];
-					DFC_PATTERN *mlist = dfc->dfcMatchList[pid];
+		return NULL;
+	}
 
-					if (buf - starting_point >= mlist->n - 2)
-					{
-						if (mlist->nocase)
-						{
-							if (my_strncasecmp(buf - (mlist->n - 2), mlist->casepatrn, mlist->n - 4) == 0)
-							{
-								Match(r, mlist->casepatrn, mlist->sids, mlist->sids_size);
-								matches += mlist->sids_size;
-							}
-						}
-						else
-						{
-							if (my_strncmp(buf - (mlist->n - 2), mlist->casepatrn, mlist->n - 4) == 0)
-							{
-								Match(r, mlist->casepatrn, mlist->sids, mlist->sids_size);
-								matches += mlist->sids_size;
-							}
-						}
-					}
-				}
-			}
-			else
-			{
-				u16 data;
-				BTYPE index;
-				BTYPE mask;
+	memset(h, 0, sizeof(DFC_HANDLE));
+	h->current = dfc;
+	h->epoch = 1;
+	pthread_mutex_init(&h->publish_lock, NULL);
 
-				for (j = 0; j < dfc->CompactTable4[crc].array[i].cnt; j++)
-				{
-					u32 pid = dfc->CompactTable4[crc].array[i].pid[j];
-					DFC_PATTERN *mlist = dfc->dfcMatchList[pid];
+	return h;
+}
 
-					Match(r, mlist->casepatrn, mlist->sids, mlist->sids_size);
-					matches += mlist->sids_size;
-				}
+/* Waits for a running update and frees the current generation; no reader
+ * may be registered any more */
+void DFC_HandleFree(DFC_HANDLE *h)
+{
+	DFC_HandleWaitUpdate(h);
 
-				data = *(u16*)(buf - 4);
-				index = BINDEX(data);
-				mask = BMASK(data);
+	if (h->current != NULL)
+	{
+		DFC_Free(h->current);
+	}
 
-				if (dfc->CompactTable4[crc].array[i].DirectFilter[index] & mask)
-				{
-					u32 crc2 = my_crc32_u16(0, data);
-					u32 k;
+	pthread_mutex_destroy(&h->publish_lock);
+	free(h);
+}
 
-					// 2. calculate index
-					crc2 &= CT2_TABLE_SIZE_MASK;
+/*
+*  Registers the calling thread as a reader.
+*
+* \retval slot Reader slot for DFC_HandleQuiescent/DFC_HandleUnregister
+* \retval -1   All DFC_HANDLE_READERS_MAX slots are taken.
+*/
+int DFC_HandleRegister(DFC_HANDLE *h)
+{
+	int i;
 
-					for (k = 0; k < dfc->CompactTable4[crc].array[i].CompactTable[crc2].cnt; k++)
-					{
-						if (dfc->CompactTable4[crc].array[i].CompactTable[crc2].array[k].pat == data)
-						{
-							u32 l;
-							for (l = 0; l < dfc->CompactTable4[crc].array[i].CompactTable[crc2].array[k].cnt; l++)
-							{
-								u32 pid = dfc->CompactTable4[crc].array[i].CompactTable[crc2].array[k].pid[l];
-								DFC_PATTERN *mlist = dfc->dfcMatchList[pid];
+	for (i = 0; i < DFC_HANDLE_READERS_MAX; i++)
+	{
+		u64 expected = 0;
 
-								if (mlist->nocase)
-								{
-									if (my_strncasecmp(buf - (mlist->n - 2), mlist->casepatrn, mlist->n - 6) == 0)
-									{
-										Match(r, mlist->casepatrn, mlist->sids, mlist->sids_size);
-										matches += mlist->sids_size;
-									}
-								}
-								else
-								{
-									if (my_strncmp(buf - (mlist->n - 2), mlist->casepatrn, mlist->n - 6) == 0)
-									{
-										Match(r, mlist->casepatrn, mlist->sids, mlist->sids_size);
-										matches += mlist->sids_size;
-									}
-								}
-							}
-							break;
-						}
-					}
-				}
-			}
-			break;
+		/* The slot is claimed with the current epoch, so a concurrent
+		 * publish either waits for it or happened before it */
+		if (__atomic_compare_exchange_n(&h->reader[i].seen, &expected, __atomic_load_n(&h->epoch, __ATOMIC_SEQ_CST),
+										0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+		{
+			return i;
 		}
 	}
-	return matches;
+
+	printf("DFC_HandleRegister: all %d reader slots are in use.\n", DFC_HANDLE_READERS_MAX);
+	return -1;
 }
 
-static int Verification_CT8_plus(DFC_STRUCTURE *dfc,
-								 unsigned char *buf,
-								 int matches,
-								 void* r,
-								 void (*Match)(void*, unsigned char *, u32 *, u32),
-								 const unsigned char *starting_point)
+/* The thread must not use anything it got from DFC_HandleAcquire after this */
+void DFC_HandleUnregister(DFC_HANDLE *h, int slot)
 {
-	u32 fragment_32;
-	u64 fragment_64;
-	u64 crc;
-	u32 i;
-
-	// 1. Convert payload to uppercase
-	unsigned char temp[8];
-	unsigned char *s = buf - 2;
-	int x;
+	__atomic_store_n(&h->reader[slot].seen, 0, __ATOMIC_RELEASE);
+}
 
-	for (x = 0; x < 8; x++)
-	{
-		temp[x] = xlatcase[ s[x] ];
-	}
+/* Current generation; stays valid until the thread's next DFC_HandleQuiescent */
+const DFC_STRUCTURE *DFC_HandleAcquire(DFC_HANDLE *h)
+{
+	return __atomic_load_n(&h->current, __ATOMIC_ACQUIRE);
+}
 
-	// 2. calculate crc
-	fragment_32 = (temp[7] << 24) | (temp[6] << 16) | (temp[5] << 8) | temp[4];
-	fragment_64 = ((u64)fragment_32 << 32) | (temp[3] << 24) | (temp[2] << 16) | (temp[1] << 8) | temp[0];
-	crc = my_crc32_u64(0, fragment_64);
+void DFC_HandleQuiescent(DFC_HANDLE *h, int slot)
+{
+	__atomic_store_n(&h->reader[slot].seen, __atomic_load_n(&h->epoch, __ATOMIC_SEQ_CST), __ATOMIC_RELEASE);
+}
 
-	// 3. calculate index
-	crc &= CT8_TABLE_SIZE_MASK;
+/* Waits until every registered reader has passed a quiescent point in an
+ * epoch after the current one */
+static void DFC_HandleSynchronize(DFC_HANDLE *h)
+{
+	u64 epoch = __atomic_add_fetch(&h->epoch, 1, __ATOMIC_SEQ_CST);
+	int i;
 
-	for (i = 0; i < dfc->CompactTable8[crc].cnt; i++)
+	for (i = 0; i < DFC_HANDLE_READERS_MAX; i++)
 	{
-		if (dfc->CompactTable8[crc].array[i].pat == fragment_64)
+		for (;;)
 		{
-			//matches++;	break;
+			u64 seen = __atomic_load_n(&h->reader[i].seen, __ATOMIC_ACQUIRE);
 
-			u32 j;
-			if (dfc->CompactTable8[crc].array[i].DirectFilter == NULL)
+			if (seen == 0 || seen >= epoch)
 			{
-				for (j = 0; j < dfc->CompactTable8[crc].array[i].cnt; j++)
-				{
-					u32 pid = dfc->CompactTable8[crc].array[i].pid[j];
-					DFC_PATTERN *mlist = dfc->dfcMatchList[pid];
-
-					int comparison_requirement = min_pattern_interval * (mlist->n - 8) / pattern_interval + 2;
-					if (buf - starting_point >= comparison_requirement)
-					{
-						if (mlist->nocase)
-						{
-							if (my_strncasecmp(buf - comparison_requirement, mlist->casepatrn, mlist->n) == 0)
-							{
-								Match(r, mlist->casepatrn, mlist->sids, mlist->sids_size);
-								matches += mlist->sids_size;
-							}
-						}
-						else
-						{
-							if (my_strncmp(buf - comparison_requirement, mlist->casepatrn, mlist->n) == 0)
-							{
-								Match(r, mlist->casepatrn, mlist->sids, mlist->sids_size);
-								matches += mlist->sids_size;
-							}
-						}
-					}
-				}
-				#if 1
+				break;
 			}
-			else
-			{
-				u16 data;
-				BTYPE index;
-				BTYPE mask;
 
-				for (j = 0; j < dfc->CompactTable8[crc].array[i].cnt; j++)
-				{
-					u32 pid = dfc->CompactTable8[crc].array[i].pid[j];
-					DFC_PATTERN *mlist = dfc->dfcMatchList[pid];
+			nanosleep(&(struct timespec){ 0, 100000 }, NULL);
+		}
+	}
+}
 
-					int comparison_requirement = min_pattern_interval * (mlist->n - 8) / pattern_interval + 2;
-					if (mlist->nocase)
-					{
-						if (my_strncasecmp(buf - comparison_requirement, mlist->casepatrn, mlist->n) == 0)
-						{
-							Match(r, mlist->casepatrn, mlist->sids, mlist->sids_size);
-							matches += mlist->sids_size;
-						}
-					}
-					else
-					{
-						if (my_strncmp(buf - comparison_requirement, mlist->casepatrn, mlist->n) == 0)
-						{
-							Match(r, mlist->casepatrn, mlist->sids, mlist->sids_size);
-							matches += mlist->sids_size;
-						}
-					}
-				}
+/*
+*  Makes next (compiled) the generation readers get and frees the previous
+*  one after the grace period. Blocks the calling writer, not the readers.
+*/
+int DFC_HandlePublish(DFC_HANDLE *h, DFC_STRUCTURE *next)
+{
+	DFC_STRUCTURE *old;
 
-				data = *(u16*)(buf - 4);
-				index = BINDEX(data);
-				mask = BMASK(data);
+	if (next == NULL || next->init_hash != NULL)
+	{
+		printf("DFC_HandlePublish: the instance is not compiled.\n");
+		return -1;
+	}
 
-				if (dfc->CompactTable8[crc].array[i].DirectFilter[index] & mask)
-				{
-					u32 crc2 = my_crc32_u16(0, data);
-					u32 k;
+	pthread_mutex_lock(&h->publish_lock);
 
-					// 2. calculate index
-					crc2 &= CT2_TABLE_SIZE_MASK;
+	old = __atomic_exchange_n(&h->current, next, __ATOMIC_SEQ_CST);
+	if (old != NULL)
+	{
+		DFC_HandleSynchronize(h);
+		DFC_Free(old);
+	}
 
-					for (k = 0; k < dfc->CompactTable8[crc].array[i].CompactTable[crc2].cnt; k++)
-					{
-						if (dfc->CompactTable8[crc].array[i].CompactTable[crc2].array[k].pat == data)
-						{
-							u32 l;
-							for (l = 0; l < dfc->CompactTable8[crc].array[i].CompactTable[crc2].array[k].cnt; l++)
-							{
-								u32 pid = dfc->CompactTable8[crc].array[i].CompactTable[crc2].array[k].pid[l];
-								DFC_PATTERN *mlist = dfc->dfcMatchList[pid];
+	pthread_mutex_unlock(&h->publish_lock);
 
-								int comparison_requirement = min_pattern_interval * (mlist->n - 8) / pattern_interval + 2;
-								if (buf - starting_point >= comparison_requirement)
-								{
-									if (mlist->nocase)
-									{
-										if (my_strncasecmp(buf - comparison_requirement, mlist->casepatrn, mlist->n) == 0)
-										{
-											Match(r, mlist->casepatrn, mlist->sids, mlist->sids_size);
-											matches += mlist->sids_size;
-										}
-									}
-									else
-									{
-										if (my_strncmp(buf - comparison_requirement, mlist->casepatrn, mlist->n) == 0)
-										{
-											Match(r, mlist->casepatrn, mlist->sids, mlist->sids_size);
-											matches += mlist->sids_size;
-										}
-									}
+	return 0;
+}
 
-								}
-							}
-							break;
-						}
-					}
-				}
-			}
-				#endif
-			break;
-		}
+static void *DFC_HandleUpdater(void *arg)
+{
+	DFC_HANDLE *h = (DFC_HANDLE *)arg;
+
+	if (DFC_Compile(h->next) < 0)
+	{
+		DFC_Free(h->next);
+		h->update_ret = -1;
+	}
+	else
+	{
+		h->update_ret = DFC_HandlePublish(h, h->next);
 	}
 
-	return matches;
+	h->next = NULL;
+	__atomic_store_n(&h->update_done, 1, __ATOMIC_RELEASE);
+
+	return NULL;
 }
 
-static inline int Progressive_Filtering(DFC_STRUCTURE *dfc,
-										unsigned char *buf,
-										int matches,
-										BTYPE idx,
-										BTYPE msk,
-										void* r,
-										void (*Match)(void*, unsigned char *, u32 *, u32),
-										const unsigned char *starting_point,
-										int rest_len)
+/*
+*  Compiles next (patterns added, not compiled yet) on a background thread
+*  and publishes it. The handle owns next from here on, also on failure.
+*  A finished update nobody waited for is joined first; its result is lost.
+*
+* \retval  0 The update is running, see DFC_HandleWaitUpdate.
+* \retval -1 Another update is still running or no thread could be started.
+*/
+int DFC_HandleUpdate(DFC_HANDLE *h, DFC_STRUCTURE *next)
 {
-	if (dfc->cDF0[*(buf - 2)])
+	if (h->updating && __atomic_load_n(&h->update_done, __ATOMIC_ACQUIRE))
 	{
-		matches = Verification_CT1(dfc, buf, matches, r, Match, starting_point);
+		DFC_HandleWaitUpdate(h);
 	}
 
-	if (unlikely(dfc->cDF1[idx] & msk))
+	if (h->updating)
 	{
-		matches = Verification_CT2(dfc, buf, matches, r, Match, starting_point);
+		printf("DFC_HandleUpdate: an update is already running.\n");
+		DFC_Free(next);
+		return -1;
 	}
 
-	if (rest_len >= 4)
+	h->next = next;
+	h->update_ret = 0;
+	h->update_done = 0;
+
+	if (pthread_create(&h->updater, NULL, DFC_HandleUpdater, h) != 0)
 	{
-		u16 data = *(u16*)(buf);
-		BTYPE index = BINDEX(data);
-		BTYPE mask = BMASK(data);
+		h->next = NULL;
+		DFC_Free(next);
+		return -1;
+	}
 
-		if (unlikely((mask & dfc->ADD_DF_4_plus[index])))
-		{
-			u16 data8;
-			BTYPE index8;
-			BTYPE mask8;
+	h->updating = 1;
 
-			if (unlikely(mask & dfc->ADD_DF_4_1[index]))
-			{
-				matches = Verification_CT4_7(dfc, buf, matches, r, Match, starting_point);
-			}
+	return 0;
+}
 
-			data8 = *(u16*)(&buf[4]);
-			index8 = BINDEX(data8);
-			mask8 = BMASK(data8);
+/* Waits for the running update; returns its result, 0 if there is none */
+int DFC_HandleWaitUpdate(DFC_HANDLE *h)
+{
+	if (!h->updating)
+	{
+		return 0;
+	}
 
-			if (unlikely(mask8 & dfc->ADD_DF_8_1[index8]))
-			{
-				data8 = *(u16*)(&buf[2]);
-				index8 = BINDEX(data8);
-				mask8 = BMASK(data8);
+	pthread_join(h->updater, NULL);
+	h->updating = 0;
 
-				if (unlikely(mask8 & dfc->ADD_DF_8_2[index8]))
-				{
-					if ((rest_len >= 8))
-					{
-						matches = Verification_CT8_plus(dfc, buf, matches, r, Match, starting_point);
-						//matches ++;
-					}
-				}
-			}
-		}
-	}
+	return h->update_ret;
+}
 
-	return matches;
+#ifndef DFC_NO_MAIN
+static void dfc_rule_match(void* r, unsigned char *casepatrn, u32 *sids, u32 sids_size)
+{
+	int i;
+	int* eval_data = r;
+
+	for (i = 0; i < sids_size; i++)
+	{
+		printf("sid %d\n", sids[i]);
+		(*eval_data) ++;
+	}
 }
 
-int DFC_Search(DFC_STRUCTURE *dfc, unsigned char *buf, int buflen, void* r, void (*Match)(void*, unsigned char *, u32 *, u32))
+static void dfc_count_match(void* r, unsigned char *casepatrn, u32 *sids, u32 sids_size)
 {
-	u8 *DirectFilter1 = dfc->DirectFilter1;
+	(*(int *)r) += sids_size;
+}
 
-	int i;
+/* Long patterns whose CT8 key holds bytes >= 0x80, one nocase and one
+ * case-sensitive; both have to be found */
+static int dfc_check_high_bytes(void)
+{
+	DFC_STRUCTURE *dfc;
+	unsigned char pat[47];
+	unsigned char text[100];
 	int matches = 0;
+	int i;
 
-	if (unlikely(buflen <= 0))
+	for (i = 0; i < 47; i++)
 	{
-		return 0;
+		pat[i] = i % 3 == 0 ? 0xcd : 'a' + i % 20;
 	}
 
-	for (i = 0; i < buflen - 1; i++)
-	{
-		u16 data = *(u16*)(&buf[i]);
-		BTYPE index = BINDEX(data);
-		BTYPE mask = BMASK(data);
+	memset(text, 'x', sizeof(text));
+	memcpy(text + 20, pat, sizeof(pat));
 
-		if (unlikely(DirectFilter1[index] & mask))
-		{
-			matches = Progressive_Filtering(dfc, &buf[i + 2], matches, index, mask, r, Match, buf, buflen - i);
-		}
+	dfc = DFC_New();
+	if (dfc == NULL ||
+		DFC_AddPattern(dfc, pat, sizeof(pat), 1, 1) < 0 ||
+		DFC_AddPattern(dfc, pat + 1, sizeof(pat) - 1, 0, 2) < 0 ||
+		DFC_Compile(dfc) < 0)
+	{
+		printf("DFC error\n");
+		DFC_Free(dfc);
+		return -1;
 	}
 
-	/* It is needed to check last 1 byte from payload */
-	if (dfc->cDF0[buf[buflen - 1]])
-	{
-		for (i = 0; i < dfc->CompactTable1[buf[buflen - 1]].cnt; i++)
-		{
-			u32 pid = dfc->CompactTable1[buf[buflen - 1]].pid[i];
-			DFC_PATTERN *mlist = dfc->dfcMatchList[pid];
+	DFC_Search(dfc, text, sizeof(text), &matches, dfc_count_match);
+	DFC_Free(dfc);
 
-			Match(r, mlist->casepatrn, mlist->sids, mlist->sids_size);
-			matches += mlist->sids_size;
-		}
-	}
+	printf("high byte check, match count %d\n", matches);
 
-	return matches;
+	return matches == 2 ? 0 : -1;
 }
 
-static void dfc_rule_match(void* r, unsigned char *casepatrn, u32 *sids, u32 sids_size)
+/* An empty rule group survives DFC_Serialize and DFC_Deserialize */
+static int dfc_check_empty_blob(void)
 {
-	int i;
-	int* eval_data = r;
+	DFC_STRUCTURE *dfc = DFC_New();
+	DFC_STRUCTURE *loaded = NULL;
+	unsigned char text[100];
+	void *blob = NULL;
+	size_t size = 0;
+	int matches = 0;
+	int ok;
 
-	for (i = 0; i < sids_size; i++)
+	memset(text, 'x', sizeof(text));
+
+	if (dfc != NULL && DFC_Compile(dfc) == 0)
 	{
-		printf("sid %d\n", sids[i]);
-		(*eval_data) ++;
+		size = DFC_SerializedSize(dfc);
+		blob = malloc(size);
+	}
+
+	if (blob != NULL && DFC_Serialize(dfc, blob, size) == 0)
+	{
+		loaded = DFC_Deserialize(blob, size);
+	}
+
+	if (loaded != NULL)
+	{
+		DFC_Search(loaded, text, sizeof(text), &matches, dfc_count_match);
 	}
+
+	ok = loaded != NULL && matches == 0;
+	printf("empty blob check, %s, match count %d\n", loaded != NULL ? "loaded" : "not loaded", matches);
+
+	DFC_Free(loaded);
+	DFC_Free(dfc);
+	free(blob);
+
+	return ok ? 0 : -1;
 }
 
 int main(int argc, char **argv)
@@ -2485,6 +6335,7 @@ int main(int argc, char **argv)
 		{5, 10, "ABCDEFGHIJ"},
 	};
 
+	DFC_MEMORY_STATS mem;
 	int r = 0;
 	int i;
 
@@ -2513,13 +6364,27 @@ int main(int argc, char **argv)
 		goto ERR;
 	}
 
+	DFC_GetMemoryStats(&mem);
+	for (i = 0; i < DFC_MEMORY_TYPE__MAX; i++)
+	{
+		if (mem.allocs[i])
+		{
+			printf("memory %-10s %" PRIu64 " bytes in %" PRIu64 " blocks\n", DFC_MemoryTypeName(i), mem.bytes[i], mem.allocs[i]);
+		}
+	}
+
 	printf("search start\n");
 	DFC_Search(dfc, str, str_len, &eval_data, dfc_rule_match);
 
 	printf("search finish, match count %d\n", eval_data);
 	DFC_Free(dfc);
 
-	return 0;
+	if (dfc_check_high_bytes() < 0)
+	{
+		return -1;
+	}
+
+	return dfc_check_empty_blob();
 
 ERR:
 
@@ -2527,4 +6392,5 @@ ERR:
 	DFC_Free(dfc);
 
 	return 0;
-}
\ No newline at end of file
+}
+#endif /* DFC_NO_MAIN */
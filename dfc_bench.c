@@ -0,0 +1,1667 @@
+/*
+DFC micro benchmarks. Builds dfc.c into the same unit so internal
+tunables can be switched between runs.
+
+Usage: ./dfc_bench <name>   (run without arguments for the list)
+*/
+
+#define DFC_NO_MAIN
+#include "dfc.c"
+
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+
+#define BENCH_TRAFFIC_SIZE    (16 << 20)
+
+/****************************************************/
+/*                  Helpers                         */
+/****************************************************/
+static u64 bench_rnd_state = 0x9e3779b97f4a7c15ULL;
+
+static u32 bench_rnd(void)
+{
+	bench_rnd_state ^= bench_rnd_state << 13;
+	bench_rnd_state ^= bench_rnd_state >> 7;
+	bench_rnd_state ^= bench_rnd_state << 17;
+	return (u32)(bench_rnd_state >> 16);
+}
+
+static double bench_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* Hardware counters; fd is -1 when perf events are not available */
+typedef struct _bench_counter
+{
+	int fd;
+	const char *name;
+} BENCH_COUNTER;
+
+static void bench_counter_open(BENCH_COUNTER *c, const char *name, u32 type, u64 config)
+{
+	c->fd = -1;
+	c->name = name;
+#ifdef __linux__
+	{
+		struct perf_event_attr attr;
+
+		memset(&attr, 0, sizeof(attr));
+		attr.size = sizeof(attr);
+		attr.type = type;
+		attr.config = config;
+		attr.disabled = 1;
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+
+		c->fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+	}
+#endif
+}
+
+static void bench_counter_start(BENCH_COUNTER *c)
+{
+#ifdef __linux__
+	if (c->fd >= 0)
+	{
+		ioctl(c->fd, PERF_EVENT_IOC_RESET, 0);
+		ioctl(c->fd, PERF_EVENT_IOC_ENABLE, 0);
+	}
+#endif
+}
+
+static long long bench_counter_stop(BENCH_COUNTER *c)
+{
+	long long v = -1;
+#ifdef __linux__
+	if (c->fd >= 0)
+	{
+		ioctl(c->fd, PERF_EVENT_IOC_DISABLE, 0);
+		if (read(c->fd, &v, sizeof(v)) != sizeof(v))
+		{
+			v = -1;
+		}
+	}
+#endif
+	return v;
+}
+
+static void bench_counter_close(BENCH_COUNTER *c)
+{
+#ifdef __linux__
+	if (c->fd >= 0)
+	{
+		close(c->fd);
+	}
+#endif
+}
+
+static void bench_print_counter(const BENCH_COUNTER *c, long long v, double bytes)
+{
+	if (v < 0)
+	{
+		printf("  %-16s n/a (perf events unavailable)\n", c->name);
+	}
+	else
+	{
+		printf("  %-16s %lld (%.4f per byte)\n", c->name, v, v / bytes);
+	}
+}
+
+/****************************************************/
+/*        Snort-like rule set and traffic           */
+/****************************************************/
+static const char *bench_tokens[] =
+{
+	"GET ", "POST ", "HTTP/1.", "Host: ", "User-Agent: ", "Content-Type: ", "cmd.exe",
+	"/bin/sh", "SELECT ", "UNION ", "<script", "passwd", ".php?", "admin", "login",
+	"Cookie: ", "\\x90\\x90", "%u9090", "Authorization: ", "../../", "eval(", "base64",
+};
+
+#define BENCH_TOKENS    (sizeof(bench_tokens) / sizeof(bench_tokens[0]))
+
+typedef struct _bench_rule
+{
+	unsigned char content[64];
+	int len;
+	int nocase;
+} BENCH_RULE;
+
+/* Content lengths follow a Snort-like mix: mostly 4-20B, a few 2-3B and some long */
+static void bench_make_rule(BENCH_RULE *rule)
+{
+	u32 r = bench_rnd() % 100;
+	int len, x = 0;
+
+	if (r < 1)
+	{
+		len = 2 + bench_rnd() % 2;
+	}
+	else if (r < 80)
+	{
+		len = 4 + bench_rnd() % 17;
+	}
+	else
+	{
+		len = 21 + bench_rnd() % 40;
+	}
+
+	if (len >= 8 && (bench_rnd() & 1))
+	{
+		const char *tok = bench_tokens[bench_rnd() % BENCH_TOKENS];
+		while (*tok && x < len / 2)
+		{
+			rule->content[x++] = *tok++;
+		}
+	}
+
+	while (x < len)
+	{
+		if (bench_rnd() % 4 == 0)
+		{
+			rule->content[x++] = bench_rnd() & 0xff;
+		}
+		else
+		{
+			rule->content[x++] = 0x21 + bench_rnd() % 94;
+		}
+	}
+
+	rule->len = len;
+	rule->nocase = (bench_rnd() % 10) < 6;
+}
+
+static BENCH_RULE *bench_make_rules(int n)
+{
+	BENCH_RULE *rules = (BENCH_RULE *)malloc(sizeof(BENCH_RULE) * n);
+	int i;
+
+	for (i = 0; rules != NULL && i < n; i++)
+	{
+		bench_make_rule(&rules[i]);
+	}
+
+	return rules;
+}
+
+static DFC_STRUCTURE *bench_build_dfc_with(BENCH_RULE *rules, int n, const DFC_ALLOCATOR *allocator, int fold)
+{
+	DFC_STRUCTURE *dfc = DFC_NewWithAllocator(allocator);
+	int i;
+
+	if (dfc == NULL)
+	{
+		return NULL;
+	}
+
+	if (fold)
+	{
+		DFC_SetNocaseFolding(dfc, 1);
+	}
+
+	for (i = 0; i < n; i++)
+	{
+		if (DFC_AddPattern(dfc, rules[i].content, rules[i].len, rules[i].nocase, i) < 0)
+		{
+			DFC_Free(dfc);
+			return NULL;
+		}
+	}
+
+	if (DFC_Compile(dfc) < 0)
+	{
+		DFC_Free(dfc);
+		return NULL;
+	}
+
+	return dfc;
+}
+
+static DFC_STRUCTURE *bench_build_dfc(BENCH_RULE *rules, int n)
+{
+	return bench_build_dfc_with(rules, n, NULL, 0);
+}
+
+/* HTTP-ish text; roughly one in hit_rate tokens is a rule content */
+static unsigned char *bench_make_traffic(BENCH_RULE *rules, int nrules, int len, int hit_rate)
+{
+	unsigned char *buf = (unsigned char *)malloc(len);
+	int x = 0;
+
+	while (buf != NULL && x < len)
+	{
+		const unsigned char *src;
+		int n;
+
+		if (hit_rate && bench_rnd() % hit_rate == 0)
+		{
+			BENCH_RULE *rule = &rules[bench_rnd() % nrules];
+			src = rule->content;
+			n = rule->len;
+		}
+		else if (bench_rnd() % 3 == 0)
+		{
+			src = (const unsigned char *)bench_tokens[bench_rnd() % BENCH_TOKENS];
+			n = strlen((const char *)src);
+		}
+		else
+		{
+			n = 1 + bench_rnd() % 12;
+			while (n-- && x < len)
+			{
+				buf[x++] = 'a' + bench_rnd() % 26;
+			}
+			continue;
+		}
+
+		while (n-- && x < len)
+		{
+			buf[x++] = *src++;
+		}
+	}
+
+	return buf;
+}
+
+static void bench_count_match(void *r, unsigned char *casepatrn, u32 *sids, u32 sids_size)
+{
+	(*(long *)r) += sids_size;
+}
+
+static void bench_count_stream(void *r, unsigned char *casepatrn, u32 *sids, u32 sids_size, u64 offset, u32 len)
+{
+	(*(long *)r) += sids_size;
+}
+
+/****************************************************/
+/*                  Benchmarks                      */
+/****************************************************/
+
+/* CT4/CT8 bucket prefetching in two-phase verification, 30k rules */
+static int bench_prefetch(void)
+{
+	const int nrules = 30000;
+	const int rounds = 4;
+	BENCH_RULE *rules = bench_make_rules(nrules);
+	DFC_STRUCTURE *dfc = bench_build_dfc(rules, nrules);
+	unsigned char *traffic = bench_make_traffic(rules, nrules, BENCH_TRAFFIC_SIZE, 16);
+	BENCH_COUNTER llc, l1d;
+	u32 dists[2] = { 0, DFC_PREFETCH_DIST };
+	int d, k;
+
+	if (rules == NULL || dfc == NULL || traffic == NULL)
+	{
+		printf("bench_prefetch: setup failed\n");
+		return -1;
+	}
+
+	bench_counter_open(&llc, "cache-misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+	bench_counter_open(&l1d, "L1d-load-misses", PERF_TYPE_HW_CACHE,
+					   PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16));
+
+	printf("prefetch: %d rules, %d MB traffic x %d\n", nrules, BENCH_TRAFFIC_SIZE >> 20, rounds);
+
+	for (d = 0; d < 2; d++)
+	{
+		long matches = 0;
+		long long v_llc, v_l1d;
+		double t;
+
+		dfc_prefetch_dist = dists[d];
+
+		bench_counter_start(&llc);
+		bench_counter_start(&l1d);
+		t = bench_now();
+		for (k = 0; k < rounds; k++)
+		{
+			DFC_SearchTwoPhase(dfc, traffic, BENCH_TRAFFIC_SIZE, &matches, bench_count_match);
+		}
+		t = bench_now() - t;
+		v_l1d = bench_counter_stop(&l1d);
+		v_llc = bench_counter_stop(&llc);
+
+		printf("prefetch distance %u: %.3f s, %.1f MB/s, %ld matches\n", dists[d], t,
+			   (double)BENCH_TRAFFIC_SIZE * rounds / t / (1 << 20), matches);
+		bench_print_counter(&llc, v_llc, (double)BENCH_TRAFFIC_SIZE * rounds);
+		bench_print_counter(&l1d, v_l1d, (double)BENCH_TRAFFIC_SIZE * rounds);
+	}
+
+	dfc_prefetch_dist = DFC_PREFETCH_DIST;
+
+	bench_counter_close(&llc);
+	bench_counter_close(&l1d);
+	free(traffic);
+	free(rules);
+	DFC_Free(dfc);
+
+	return 0;
+}
+
+/* Chunks an arena allocator holds, used or not */
+static double bench_arena_mb(const DFC_ALLOCATOR *arena)
+{
+	const DFC_ARENA_CHUNK *c;
+	size_t bytes = 0;
+
+	for (c = ((const DFC_ARENA *)arena->ctx)->head; c != NULL; c = c->next)
+	{
+		bytes += sizeof(DFC_ARENA_CHUNK) + c->size;
+	}
+
+	return (double)bytes / (1 << 20);
+}
+
+/* Live blocks of an instance, headers included */
+static double bench_live_mb(const DFC_STRUCTURE *dfc)
+{
+	double bytes = 0;
+	int i;
+
+	for (i = 0; i < DFC_MEMORY_TYPE__MAX; i++)
+	{
+		bytes += dfc->mem.bytes[i] + dfc->mem.allocs[i] * sizeof(DFC_MEM_HEADER);
+	}
+
+	return bytes / (1 << 20);
+}
+
+/* Compile and teardown of a 50k rule reload, malloc vs arena allocator */
+static int bench_arena(void)
+{
+	const int nrules = 50000;
+	const int rounds = 3;
+	BENCH_RULE *rules = bench_make_rules(nrules);
+	int a, k;
+
+	if (rules == NULL)
+	{
+		printf("bench_arena: setup failed\n");
+		return -1;
+	}
+
+	printf("arena: %d rules x %d reloads\n", nrules, rounds);
+
+	for (a = 0; a < 2; a++)
+	{
+		double t_build = 0, t_free = 0, t;
+		double arena_mb = 0, live_mb = 0;
+
+		for (k = 0; k < rounds; k++)
+		{
+			DFC_ALLOCATOR arena;
+			DFC_STRUCTURE *dfc;
+
+			if (a == 1 && DFC_ArenaAllocator(&arena, 0) < 0)
+			{
+				printf("bench_arena: setup failed\n");
+				free(rules);
+				return -1;
+			}
+
+			t = bench_now();
+			dfc = bench_build_dfc_with(rules, nrules, a == 1 ? &arena : NULL, 0);
+			t_build += bench_now() - t;
+			if (dfc == NULL)
+			{
+				printf("bench_arena: compile failed\n");
+				free(rules);
+				return -1;
+			}
+
+			live_mb = bench_live_mb(dfc);
+			if (a == 1)
+			{
+				arena_mb = bench_arena_mb(&arena);
+			}
+
+			t = bench_now();
+			DFC_Free(dfc);
+			t_free += bench_now() - t;
+		}
+
+		printf("%-6s add+compile %.3f s, free %.4f s per reload, %.1f MB live", a == 1 ? "arena" : "malloc",
+			   t_build / rounds, t_free / rounds, live_mb);
+		if (a == 1)
+		{
+			printf(", %.1f MB of arena chunks", arena_mb);
+		}
+		printf("\n");
+	}
+
+	free(rules);
+
+	return 0;
+}
+
+/* Fraction of bits set in a direct filter of df_bits */
+static double bench_df_fill_bits(const u8 *df, u32 df_bits)
+{
+	u32 i, bits = 0;
+
+	for (i = 0; i < (1u << df_bits) / 8; i++)
+	{
+		bits += __builtin_popcount(df[i]);
+	}
+
+	return (double)bits / (1u << df_bits);
+}
+
+static double bench_df_fill(const u8 *df)
+{
+	return bench_df_fill_bits(df, DF_BITS);
+}
+
+/* Case-variant expansion vs case-folded keys, 30k rules */
+static int bench_fold(void)
+{
+	const int nrules = 30000;
+	const int rounds = 2;
+	BENCH_RULE *rules = bench_make_rules(nrules);
+	unsigned char *traffic = bench_make_traffic(rules, nrules, BENCH_TRAFFIC_SIZE, 16);
+	int f, k;
+
+	if (rules == NULL || traffic == NULL)
+	{
+		printf("bench_fold: setup failed\n");
+		return -1;
+	}
+
+	printf("fold: %d rules, %d MB traffic x %d\n", nrules, BENCH_TRAFFIC_SIZE >> 20, rounds);
+
+	for (f = 0; f < 2; f++)
+	{
+		DFC_MEMORY_STATS mem;
+		DFC_STRUCTURE *dfc;
+		long matches = 0;
+		double t_compile, t;
+
+		t_compile = bench_now();
+		dfc = bench_build_dfc_with(rules, nrules, NULL, f);
+		t_compile = bench_now() - t_compile;
+		if (dfc == NULL)
+		{
+			printf("bench_fold: compile failed\n");
+			return -1;
+		}
+
+		t = bench_now();
+		for (k = 0; k < rounds; k++)
+		{
+			DFC_Search(dfc, traffic, BENCH_TRAFFIC_SIZE, &matches, bench_count_match);
+		}
+		t = bench_now() - t;
+
+		DFC_GetMemoryStats(&mem);
+		printf("%-8s compile %.3f s, DF1 %.1f%%, DF4 %.1f%%, DF8 %.1f%%, CT %llu entries, %llu KB\n",
+			   f ? "folded" : "variants", t_compile, 100 * bench_df_fill(dfc->DirectFilter1),
+			   100 * bench_df_fill(dfc->ADD_DF_4_plus), 100 * bench_df_fill(dfc->ADD_DF_8_1),
+			   (unsigned long long)(dfc->CT2.entry_cnt + dfc->CT4.entry_cnt + dfc->CT8.entry_cnt),
+			   (unsigned long long)(mem.total_bytes >> 10));
+		printf("%-8s search %.3f s, %.1f MB/s, %ld matches\n", "", t,
+			   (double)BENCH_TRAFFIC_SIZE * rounds / t / (1 << 20), matches);
+
+		DFC_Free(dfc);
+	}
+
+	free(traffic);
+	free(rules);
+
+	return 0;
+}
+
+/* Per-hit Match callbacks vs DFC_SearchBatch records, short noisy rules */
+static int bench_batch(void)
+{
+	const int nrules = 5000;
+	const int rounds = 2;
+	BENCH_RULE *rules = bench_make_rules(nrules);
+	DFC_STRUCTURE *dfc;
+	unsigned char *traffic;
+	DFC_MATCH_RECORD out[4096];
+	long matches = 0;
+	double t;
+	int i, k;
+
+	/* 2-5B contents to get a high hit rate */
+	for (i = 0; rules != NULL && i < nrules; i++)
+	{
+		rules[i].len = 2 + rules[i].len % 4;
+	}
+
+	dfc = bench_build_dfc(rules, nrules);
+	traffic = bench_make_traffic(rules, nrules, BENCH_TRAFFIC_SIZE, 4);
+	if (rules == NULL || dfc == NULL || traffic == NULL)
+	{
+		printf("bench_batch: setup failed\n");
+		return -1;
+	}
+
+	printf("batch: %d short rules, %d MB traffic x %d\n", nrules, BENCH_TRAFFIC_SIZE >> 20, rounds);
+
+	t = bench_now();
+	for (k = 0; k < rounds; k++)
+	{
+		DFC_Search(dfc, traffic, BENCH_TRAFFIC_SIZE, &matches, bench_count_match);
+	}
+	t = bench_now() - t;
+	printf("callback %.3f s, %.1f MB/s, %ld matches\n", t, (double)BENCH_TRAFFIC_SIZE * rounds / t / (1 << 20), matches);
+
+	matches = 0;
+	t = bench_now();
+	for (k = 0; k < rounds; k++)
+	{
+		int pos = 0;
+
+		while (pos < BENCH_TRAFFIC_SIZE)
+		{
+			int n = DFC_SearchBatch(dfc, traffic, BENCH_TRAFFIC_SIZE, &pos, out, 4096);
+
+			if (n < 0)
+			{
+				printf("bench_batch: search failed\n");
+				return -1;
+			}
+
+			for (i = 0; i < n; i++)
+			{
+				matches += DFC_GetPattern(dfc, out[i].iid)->sids_size;
+			}
+		}
+	}
+	t = bench_now() - t;
+	printf("batch    %.3f s, %.1f MB/s, %ld matches\n", t, (double)BENCH_TRAFFIC_SIZE * rounds / t / (1 << 20), matches);
+
+	free(traffic);
+	free(rules);
+	DFC_Free(dfc);
+
+	return 0;
+}
+
+/* 1460B segments: isolated, reassembled with memcpy, and DFC_SearchStream */
+static int bench_stream(void)
+{
+	const int nrules = 30000;
+	const int seg = 1460;
+	BENCH_RULE *rules = bench_make_rules(nrules);
+	DFC_STRUCTURE *dfc = bench_build_dfc(rules, nrules);
+	unsigned char *traffic = bench_make_traffic(rules, nrules, BENCH_TRAFFIC_SIZE, 16);
+	unsigned char *reasm = (unsigned char *)malloc(BENCH_TRAFFIC_SIZE);
+	DFC_STREAM_STATE *state;
+	long matches;
+	double t;
+	int x;
+
+	if (rules == NULL || dfc == NULL || traffic == NULL || reasm == NULL)
+	{
+		printf("bench_stream: setup failed\n");
+		return -1;
+	}
+
+	printf("stream: %d rules, %d MB traffic in %dB segments\n", nrules, BENCH_TRAFFIC_SIZE >> 20, seg);
+
+	matches = 0;
+	t = bench_now();
+	for (x = 0; x < BENCH_TRAFFIC_SIZE; x += seg)
+	{
+		int n = BENCH_TRAFFIC_SIZE - x < seg ? BENCH_TRAFFIC_SIZE - x : seg;
+		DFC_Search(dfc, traffic + x, n, &matches, bench_count_match);
+	}
+	t = bench_now() - t;
+	printf("isolated   %.3f s, %ld matches (boundary matches lost)\n", t, matches);
+
+	matches = 0;
+	t = bench_now();
+	for (x = 0; x < BENCH_TRAFFIC_SIZE; x += seg)
+	{
+		int n = BENCH_TRAFFIC_SIZE - x < seg ? BENCH_TRAFFIC_SIZE - x : seg;
+		memcpy(reasm + x, traffic + x, n);
+	}
+	DFC_Search(dfc, reasm, BENCH_TRAFFIC_SIZE, &matches, bench_count_match);
+	t = bench_now() - t;
+	printf("reassembly %.3f s, %ld matches\n", t, matches);
+
+	state = DFC_StreamNew(dfc);
+	if (state == NULL)
+	{
+		printf("bench_stream: setup failed\n");
+		return -1;
+	}
+
+	matches = 0;
+	t = bench_now();
+	for (x = 0; x < BENCH_TRAFFIC_SIZE; x += seg)
+	{
+		int n = BENCH_TRAFFIC_SIZE - x < seg ? BENCH_TRAFFIC_SIZE - x : seg;
+		DFC_SearchStream(dfc, state, traffic + x, n, &matches, bench_count_stream);
+	}
+	t = bench_now() - t;
+	printf("stream     %.3f s, %ld matches\n", t, matches);
+
+	DFC_StreamFree(state);
+	free(reasm);
+	free(traffic);
+	free(rules);
+	DFC_Free(dfc);
+
+	return 0;
+}
+
+/* Packets of 64..1500B back to back: copied into a bounce buffer vs scanned in place */
+static int bench_ring(void)
+{
+	const int nrules = 30000;
+	BENCH_RULE *rules = bench_make_rules(nrules);
+	DFC_STRUCTURE *dfc = bench_build_dfc(rules, nrules);
+	unsigned char *traffic = bench_make_traffic(rules, nrules, BENCH_TRAFFIC_SIZE, 16);
+	unsigned char *bounce = (unsigned char *)malloc(1500 + 64);
+	int *pkt_len = (int *)malloc((BENCH_TRAFFIC_SIZE / 64 + 1) * sizeof(int));
+	int npkt = 0;
+	long matches;
+	double t;
+	int x, k;
+
+	if (rules == NULL || dfc == NULL || traffic == NULL || bounce == NULL || pkt_len == NULL)
+	{
+		printf("bench_ring: setup failed\n");
+		return -1;
+	}
+
+	for (x = 0; x < BENCH_TRAFFIC_SIZE; x += pkt_len[npkt++])
+	{
+		int n = 64 + bench_rnd() % (1500 - 64 + 1);
+
+		pkt_len[npkt] = BENCH_TRAFFIC_SIZE - x < n ? BENCH_TRAFFIC_SIZE - x : n;
+	}
+
+	printf("ring: %d rules, %d packets, %d MB traffic\n", nrules, npkt, BENCH_TRAFFIC_SIZE >> 20);
+
+	matches = 0;
+	t = bench_now();
+	for (x = 0, k = 0; k < npkt; x += pkt_len[k++])
+	{
+		memcpy(bounce, traffic + x, pkt_len[k]);
+		DFC_Search(dfc, bounce, pkt_len[k], &matches, bench_count_match);
+	}
+	t = bench_now() - t;
+	printf("bounce   %.3f s, %ld matches\n", t, matches);
+
+	matches = 0;
+	t = bench_now();
+	for (x = 0, k = 0; k < npkt; x += pkt_len[k++])
+	{
+		DFC_Search(dfc, traffic + x, pkt_len[k], &matches, bench_count_match);
+	}
+	t = bench_now() - t;
+	printf("in place %.3f s, %ld matches\n", t, matches);
+
+	free(pkt_len);
+	free(bounce);
+	free(traffic);
+	free(rules);
+	DFC_Free(dfc);
+
+	return 0;
+}
+
+/* One worker of bench_threads: 1460B packets through its own context */
+typedef struct _bench_worker
+{
+	const DFC_STRUCTURE *dfc;
+	unsigned char *traffic;
+	DFC_CONTEXT *ctx;
+	double seconds;
+} __attribute__((aligned(64))) BENCH_WORKER;
+
+static void *bench_worker_run(void *arg)
+{
+	BENCH_WORKER *w = (BENCH_WORKER *)arg;
+	long matches = 0;
+	double t = bench_now();
+	int x;
+
+	for (x = 0; x < BENCH_TRAFFIC_SIZE; x += 1460)
+	{
+		int n = BENCH_TRAFFIC_SIZE - x < 1460 ? BENCH_TRAFFIC_SIZE - x : 1460;
+		DFC_SearchCtx(w->dfc, w->ctx, w->traffic + x, n, &matches, bench_count_match);
+	}
+
+	w->seconds = bench_now() - t;
+
+	return NULL;
+}
+
+/* One compiled DFC searched by 1..32 threads, each with its own context */
+static int bench_threads(void)
+{
+	const int nrules = 30000;
+	BENCH_RULE *rules = bench_make_rules(nrules);
+	DFC_STRUCTURE *dfc = bench_build_dfc(rules, nrules);
+	unsigned char *traffic = bench_make_traffic(rules, nrules, BENCH_TRAFFIC_SIZE, 16);
+	BENCH_WORKER workers[32];
+	pthread_t tid[32];
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	double base = 0;
+	int nthreads, k;
+
+	if (rules == NULL || dfc == NULL || traffic == NULL)
+	{
+		printf("bench_threads: setup failed\n");
+		return -1;
+	}
+
+	printf("threads: %d rules, %d MB traffic per thread, %ld cpus\n", nrules, BENCH_TRAFFIC_SIZE >> 20, cpus);
+
+	for (nthreads = 1; nthreads <= 32; nthreads *= 2)
+	{
+		double t, mbps;
+		u64 matches = 0;
+
+		for (k = 0; k < nthreads; k++)
+		{
+			workers[k].dfc = dfc;
+			workers[k].traffic = traffic;
+			workers[k].ctx = DFC_ContextNew();
+			if (workers[k].ctx == NULL)
+			{
+				printf("bench_threads: setup failed\n");
+				return -1;
+			}
+		}
+
+		t = bench_now();
+		for (k = 0; k < nthreads; k++)
+		{
+			pthread_create(&tid[k], NULL, bench_worker_run, &workers[k]);
+		}
+		for (k = 0; k < nthreads; k++)
+		{
+			pthread_join(tid[k], NULL);
+			matches += workers[k].ctx->stats.matches;
+			DFC_ContextFree(workers[k].ctx);
+		}
+		t = bench_now() - t;
+
+		mbps = (double)nthreads * BENCH_TRAFFIC_SIZE / t / (1 << 20);
+		if (nthreads == 1)
+		{
+			base = mbps;
+		}
+
+		printf("%2d threads %8.1f MB/s, x%.2f, %llu matches\n", nthreads, mbps, mbps / base, (unsigned long long)matches);
+
+		if (nthreads >= 2 * cpus)
+		{
+			break;
+		}
+	}
+
+	free(traffic);
+	free(rules);
+	DFC_Free(dfc);
+
+	return 0;
+}
+
+/* DFC_Compile of 100k rules with 1, 2, 4, ... compile threads */
+static int bench_compile(void)
+{
+	const int nrules = 100000;
+	BENCH_RULE *rules = bench_make_rules(nrules);
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	double base = 0;
+	int threads;
+
+	if (rules == NULL)
+	{
+		printf("bench_compile: setup failed\n");
+		return -1;
+	}
+
+	printf("compile: %d rules, %ld cpus\n", nrules, cpus);
+
+	for (threads = 1; threads <= (cpus > 4 ? cpus : 4); threads *= 2)
+	{
+		DFC_STRUCTURE *dfc = DFC_New();
+		double t;
+		int i;
+
+		if (dfc == NULL)
+		{
+			printf("bench_compile: setup failed\n");
+			return -1;
+		}
+
+		DFC_SetCompileThreads(dfc, threads);
+		for (i = 0; i < nrules; i++)
+		{
+			DFC_AddPattern(dfc, rules[i].content, rules[i].len, rules[i].nocase, i);
+		}
+
+		t = bench_now();
+		if (DFC_Compile(dfc) < 0)
+		{
+			printf("bench_compile: compile failed\n");
+			return -1;
+		}
+		t = bench_now() - t;
+
+		if (threads == 1)
+		{
+			base = t;
+		}
+
+		printf("%2d threads %.3f s, x%.2f\n", threads, t, base / t);
+
+		DFC_Free(dfc);
+	}
+
+	free(rules);
+
+	return 0;
+}
+
+/* Reader of bench_swap: 1460B packets, a quiescent point after each */
+typedef struct _bench_swap_reader
+{
+	DFC_HANDLE *h;
+	unsigned char *traffic;
+	int *stop;          // set by the writer, read atomically
+	u32 *lat_ns;        // latency of each packet
+	u32 lat_cnt;
+	u32 lat_max;
+	long matches;
+} __attribute__((aligned(64))) BENCH_SWAP_READER;
+
+static void *bench_swap_reader_run(void *arg)
+{
+	BENCH_SWAP_READER *rd = (BENCH_SWAP_READER *)arg;
+	int slot = DFC_HandleRegister(rd->h);
+	int x = 0;
+
+	while (!__atomic_load_n(rd->stop, __ATOMIC_ACQUIRE) && rd->lat_cnt < rd->lat_max)
+	{
+		double t = bench_now();
+
+		DFC_Search(DFC_HandleAcquire(rd->h), rd->traffic + x, 1460, &rd->matches, bench_count_match);
+		DFC_HandleQuiescent(rd->h, slot);
+
+		rd->lat_ns[rd->lat_cnt++] = (u32)((bench_now() - t) * 1e9);
+		x = x + 2 * 1460 < BENCH_TRAFFIC_SIZE ? x + 1460 : 0;
+	}
+
+	DFC_HandleUnregister(rd->h, slot);
+
+	return NULL;
+}
+
+static int bench_cmp_u32(const void *a, const void *b)
+{
+	u32 x = *(const u32 *)a, y = *(const u32 *)b;
+	return x < y ? -1 : x > y;
+}
+
+/* Per-packet search latency with the rule set swapped every 200 ms vs none */
+static int bench_swap(void)
+{
+	const int nrules = 30000;
+	const double seconds = 3;
+	BENCH_RULE *rules = bench_make_rules(nrules);
+	unsigned char *traffic = bench_make_traffic(rules, nrules, BENCH_TRAFFIC_SIZE, 16);
+	BENCH_SWAP_READER rd;
+	int round;
+
+	if (rules == NULL || traffic == NULL)
+	{
+		printf("bench_swap: setup failed\n");
+		return -1;
+	}
+
+	printf("swap: %d rules (every other one per generation), 1460B packets, %.0f s per run\n", nrules, seconds);
+
+	for (round = 0; round < 2; round++)
+	{
+		int stop = 0;
+		DFC_HANDLE *h = DFC_HandleNew(bench_build_dfc(rules, nrules));
+		pthread_t tid;
+		int swaps = 0;
+		double t;
+
+		memset(&rd, 0, sizeof(rd));
+		rd.h = h;
+		rd.traffic = traffic;
+		rd.stop = &stop;
+		rd.lat_max = 1 << 22;
+		rd.lat_ns = (u32 *)malloc(rd.lat_max * sizeof(u32));
+		if (h == NULL || rd.lat_ns == NULL)
+		{
+			printf("bench_swap: setup failed\n");
+			return -1;
+		}
+
+		pthread_create(&tid, NULL, bench_swap_reader_run, &rd);
+
+		t = bench_now();
+		while (bench_now() - t < seconds)
+		{
+			usleep(200000);
+
+			if (round == 1)
+			{
+				DFC_STRUCTURE *next = DFC_New();
+				int i;
+
+				for (i = swaps & 1; i < nrules; i += 2)
+				{
+					DFC_AddPattern(next, rules[i].content, rules[i].len, rules[i].nocase, i);
+				}
+
+				if (DFC_HandleUpdate(h, next) < 0 || DFC_HandleWaitUpdate(h) < 0)
+				{
+					printf("bench_swap: update failed\n");
+					return -1;
+				}
+				swaps++;
+			}
+		}
+
+		__atomic_store_n(&stop, 1, __ATOMIC_RELEASE);
+		pthread_join(tid, NULL);
+
+		qsort(rd.lat_ns, rd.lat_cnt, sizeof(u32), bench_cmp_u32);
+		printf("%-8s %2d swaps, %u packets, p50 %.1f us, p99 %.1f us, p99.9 %.1f us, max %.1f us\n",
+			   round ? "swapping" : "static", swaps, rd.lat_cnt,
+			   rd.lat_ns[rd.lat_cnt / 2] / 1e3, rd.lat_ns[(u64)rd.lat_cnt * 99 / 100] / 1e3,
+			   rd.lat_ns[(u64)rd.lat_cnt * 999 / 1000] / 1e3, rd.lat_ns[rd.lat_cnt - 1] / 1e3);
+
+		free(rd.lat_ns);
+		DFC_HandleFree(h);
+	}
+
+	free(traffic);
+	free(rules);
+
+	return 0;
+}
+
+/* Startup of a 100k rule set: DFC_Compile vs DFC_LoadFile of its blob */
+static int bench_blob(void)
+{
+	const int nrules = 100000;
+	const char *path = "dfc_bench.blob";
+	BENCH_RULE *rules = bench_make_rules(nrules);
+	unsigned char *traffic = bench_make_traffic(rules, nrules, BENCH_TRAFFIC_SIZE, 16);
+	DFC_STRUCTURE *dfc, *loaded;
+	long matches = 0, loaded_matches = 0;
+	double t_compile, t_load;
+
+	if (rules == NULL || traffic == NULL)
+	{
+		printf("bench_blob: setup failed\n");
+		return -1;
+	}
+
+	t_compile = bench_now();
+	dfc = bench_build_dfc(rules, nrules);
+	t_compile = bench_now() - t_compile;
+
+	if (dfc == NULL || DFC_SaveFile(dfc, path) < 0)
+	{
+		printf("bench_blob: setup failed\n");
+		return -1;
+	}
+
+	t_load = bench_now();
+	loaded = DFC_LoadFile(path);
+	t_load = bench_now() - t_load;
+
+	if (loaded == NULL)
+	{
+		printf("bench_blob: load failed\n");
+		return -1;
+	}
+
+	DFC_Search(dfc, traffic, BENCH_TRAFFIC_SIZE, &matches, bench_count_match);
+	DFC_Search(loaded, traffic, BENCH_TRAFFIC_SIZE, &loaded_matches, bench_count_match);
+
+	printf("blob: %d rules, %.1f MB blob\n", nrules, (double)DFC_SerializedSize(dfc) / (1 << 20));
+	printf("private heap: compiled %.1f MB, loaded %.1f MB\n", bench_live_mb(dfc), bench_live_mb(loaded));
+	printf("compile %.3f s, load %.3f ms, x%.0f\n", t_compile, t_load * 1e3, t_compile / t_load);
+	printf("matches compiled %ld, loaded %ld%s\n", matches, loaded_matches,
+		   matches == loaded_matches ? "" : " MISMATCH");
+
+	DFC_Free(loaded);
+	DFC_Free(dfc);
+	remove(path);
+	free(traffic);
+	free(rules);
+
+	return matches == loaded_matches ? 0 : -1;
+}
+
+static u64 bench_mem_bytes(void)
+{
+	DFC_MEMORY_STATS mem;
+
+	DFC_GetMemoryStats(&mem);
+
+	return mem.total_bytes;
+}
+
+/* Default vs auto DF and recursive table sizes, small and large rule sets */
+static int bench_geometry(void)
+{
+	const int sizes[2] = { 300, 30000 };
+	const int rounds = 2;
+	int s, a, i, k;
+
+	for (s = 0; s < 2; s++)
+	{
+		BENCH_RULE *rules = bench_make_rules(sizes[s]);
+		unsigned char *traffic = bench_make_traffic(rules, sizes[s], BENCH_TRAFFIC_SIZE, 16);
+
+		if (rules == NULL || traffic == NULL)
+		{
+			printf("bench_geometry: setup failed\n");
+			return -1;
+		}
+
+		printf("geometry: %d rules, %d MB traffic x %d\n", sizes[s], BENCH_TRAFFIC_SIZE >> 20, rounds);
+
+		for (a = 0; a < 2; a++)
+		{
+			DFC_CONFIG config;
+			DFC_STRUCTURE *dfc;
+			long matches = 0;
+			double t;
+
+			DFC_ConfigDefault(&config);
+			if (a)
+			{
+				config.df_bits = 0;
+				config.rec_ct_size = 0;
+			}
+
+			dfc = DFC_NewWithConfig(&config, NULL);
+			for (i = 0; dfc != NULL && i < sizes[s]; i++)
+			{
+				DFC_AddPattern(dfc, rules[i].content, rules[i].len, rules[i].nocase, i);
+			}
+
+			if (dfc == NULL || DFC_Compile(dfc) < 0)
+			{
+				printf("bench_geometry: compile failed\n");
+				return -1;
+			}
+
+			t = bench_now();
+			for (k = 0; k < rounds; k++)
+			{
+				DFC_Search(dfc, traffic, BENCH_TRAFFIC_SIZE, &matches, bench_count_match);
+			}
+			t = bench_now() - t;
+
+			printf("%-8s df_bits %u, rec_ct_size %u, DF1 %.1f%%, %llu KB, %.1f MB/s, %ld matches\n",
+				   a ? "auto" : "default", dfc->config.df_bits, dfc->config.rec_ct_size,
+				   100 * bench_df_fill_bits(dfc->DirectFilter1, dfc->config.df_bits),
+				   (unsigned long long)(bench_mem_bytes() >> 10),
+				   (double)BENCH_TRAFFIC_SIZE * rounds / t / (1 << 20), matches);
+
+			DFC_Free(dfc);
+		}
+
+		free(traffic);
+		free(rules);
+	}
+
+	return 0;
+}
+
+/* HTTP request lines; one in hit_rate carries the path of a rule */
+static unsigned char *bench_make_http(BENCH_RULE *rules, int nrules, int len, int hit_rate)
+{
+	static const char *tail = " HTTP/1.1\r\nHost: example.com\r\n\r\n";
+	unsigned char *buf = (unsigned char *)malloc(len);
+	int x = 0;
+
+	while (buf != NULL && x < len)
+	{
+		unsigned char line[128];
+		int n = 0, k;
+
+		n += sprintf((char *)line, "GET ");
+		if (hit_rate && bench_rnd() % hit_rate == 0)
+		{
+			BENCH_RULE *rule = &rules[bench_rnd() % nrules];
+			memcpy(line + n, rule->content, rule->len);
+			n += rule->len;
+		}
+		else
+		{
+			line[n++] = '/';
+			for (k = 4 + bench_rnd() % 17; k > 0; k--)
+			{
+				line[n++] = 'a' + bench_rnd() % 26;
+			}
+			n += sprintf((char *)line + n, "%s", tail);
+		}
+
+		for (k = 0; k < n && x < len; k++)
+		{
+			buf[x++] = line[k];
+		}
+	}
+
+	return buf;
+}
+
+/* Positions of buf that pass DF1, ADD_DF_4_plus and ADD_DF_8_* and go to
+ * CT8 (lookups), and the ones whose 8 bytes are a CT8 key (hits) */
+static void bench_ct8_lookups(const DFC_STRUCTURE *dfc, unsigned char *buf, int buflen, long *lookups, long *hits)
+{
+	const u8 *df[4] = { dfc->DirectFilter1, dfc->ADD_DF_4_plus, dfc->ADD_DF_8_2, dfc->ADD_DF_8_1 };
+	int i, k;
+
+	*lookups = *hits = 0;
+	for (i = 0; i + 8 <= buflen; i++)
+	{
+		u32 crc, e;
+
+		for (k = 0; k < 4; k++)
+		{
+			u32 key = DFC_DFKey(dfc, DFC_Load16(dfc, buf + i + 2 * k));
+
+			if (!(df[k][BINDEX(key)] & BMASK(key)))
+			{
+				break;
+			}
+		}
+
+		if (k < 4)
+		{
+			continue;
+		}
+
+		(*lookups)++;
+		crc = DFC_CT8_Bucket(dfc, buf + i + 2);
+		for (e = dfc->CT8.bucket[crc]; e < dfc->CT8.bucket[crc + 1]; e++)
+		{
+			*hits += dfc->CT8.entry[e].pat == DFC_CT8_Fragment(buf + i + 2);
+		}
+	}
+}
+
+/* Rules ending in " HTTP/1.1" keyed on their last 8 bytes vs on the window
+ * a traffic sample rates rarest */
+static int bench_sample(void)
+{
+	const int nrules = 3000;
+	const int rounds = 2;
+	const int sample_size = 1 << 20;
+	BENCH_RULE *rules = (BENCH_RULE *)malloc(sizeof(BENCH_RULE) * nrules);
+	unsigned char *traffic, *sample;
+	int i, k, s;
+
+	for (i = 0; rules != NULL && i < nrules; i++)
+	{
+		int n = 0;
+
+		rules[i].content[n++] = '/';
+		for (k = 6 + bench_rnd() % 11; k > 0; k--)
+		{
+			rules[i].content[n++] = 'a' + bench_rnd() % 26;
+		}
+		memcpy(rules[i].content + n, " HTTP/1.1", 9);
+		rules[i].len = n + 9;
+		rules[i].nocase = bench_rnd() & 1;
+	}
+
+	sample = bench_make_http(rules, nrules, sample_size, 0);
+	traffic = bench_make_http(rules, nrules, BENCH_TRAFFIC_SIZE, 64);
+	if (rules == NULL || sample == NULL || traffic == NULL)
+	{
+		printf("bench_sample: setup failed\n");
+		return -1;
+	}
+
+	printf("sample: %d rules ending in \" HTTP/1.1\", %d MB HTTP traffic x %d, %d KB sample\n",
+		   nrules, BENCH_TRAFFIC_SIZE >> 20, rounds, sample_size >> 10);
+
+	for (s = 0; s < 2; s++)
+	{
+		DFC_STRUCTURE *dfc = DFC_New();
+		long matches = 0, lookups, hits;
+		double t;
+
+		for (i = 0; dfc != NULL && i < nrules; i++)
+		{
+			DFC_AddPattern(dfc, rules[i].content, rules[i].len, rules[i].nocase, i);
+		}
+
+		if (dfc == NULL || (s && DFC_AddTrafficSample(dfc, sample, sample_size) < 0) || DFC_Compile(dfc) < 0)
+		{
+			printf("bench_sample: compile failed\n");
+			return -1;
+		}
+
+		t = bench_now();
+		for (k = 0; k < rounds; k++)
+		{
+			DFC_Search(dfc, traffic, BENCH_TRAFFIC_SIZE, &matches, bench_count_match);
+		}
+		t = bench_now() - t;
+
+		bench_ct8_lookups(dfc, traffic, BENCH_TRAFFIC_SIZE, &lookups, &hits);
+		printf("%-9s %.1f MB/s, CT8 lookups %ld/MB, hits %ld/MB, %ld matches\n", s ? "sampled" : "default",
+			   (double)BENCH_TRAFFIC_SIZE * rounds / t / (1 << 20),
+			   lookups / (BENCH_TRAFFIC_SIZE >> 20), hits / (BENCH_TRAFFIC_SIZE >> 20), matches);
+
+		DFC_Free(dfc);
+	}
+
+	free(traffic);
+	free(sample);
+	free(rules);
+
+	return 0;
+}
+
+/* DFC_AddPattern cost per pattern as the rule set grows; every rule is
+ * added twice, the second time as a duplicate with another sid */
+static int bench_add(void)
+{
+	const int sizes[3] = { 10000, 100000, 1000000 };
+	int s, i;
+
+	for (s = 0; s < 3; s++)
+	{
+		BENCH_RULE *rules = bench_make_rules(sizes[s]);
+		DFC_STRUCTURE *dfc = DFC_New();
+		double t;
+
+		if (rules == NULL || dfc == NULL)
+		{
+			printf("bench_add: setup failed\n");
+			return -1;
+		}
+
+		t = bench_now();
+		for (i = 0; i < 2 * sizes[s]; i++)
+		{
+			BENCH_RULE *rule = &rules[i % sizes[s]];
+
+			if (DFC_AddPattern(dfc, rule->content, rule->len, rule->nocase, i) < 0)
+			{
+				printf("bench_add: add failed\n");
+				return -1;
+			}
+		}
+		t = bench_now() - t;
+
+		printf("add: %7d rules x 2, %d patterns, %.3f s, %.0f ns/add\n",
+			   sizes[s], dfc->numPatterns, t, t * 1e9 / (2.0 * sizes[s]));
+
+		DFC_Free(dfc);
+		free(rules);
+	}
+
+	return 0;
+}
+
+/* The byte-at-a-time compares the SIMD kernels replaced */
+static int bench_byte_strncmp(const unsigned char *a, const unsigned char *b, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++)
+	{
+		if (a[i] != b[i])
+		{
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+static int bench_byte_strncasecmp(const unsigned char *a, const unsigned char *b, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++)
+	{
+		if (tolower(a[i]) != tolower(b[i]))
+		{
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/* Cost of a full (matching) compare by length: the byte loops vs
+ * my_strncmp/my_strncasecmp with the kernels DFC_InitCompare() picked */
+static int bench_verify(void)
+{
+	const int lens[6] = { 8, 16, 32, 64, 128, 200 };
+	const int reps = 2000000;
+	unsigned char a[256], b[256], c[256];
+	volatile int sink = 0;
+	int i, l, k;
+
+	DFC_Free(DFC_New());    // runs DFC_InitCompare()
+
+	for (i = 0; i < 256; i++)
+	{
+		a[i] = 0x21 + bench_rnd() % 94;
+		b[i] = a[i];
+		c[i] = isalpha(a[i]) && (bench_rnd() & 1) ? a[i] ^ 0x20 : a[i];
+	}
+
+	printf("verify: ns per matching compare\n");
+	printf("%5s %10s %10s %10s %10s\n", "len", "byte", "dfc", "byte/nc", "dfc/nc");
+	for (l = 0; l < 6; l++)
+	{
+		double t[4];
+
+		for (k = 0; k < 4; k++)
+		{
+			t[k] = bench_now();
+			for (i = 0; i < reps; i++)
+			{
+				switch (k)
+				{
+				case 0:
+					sink += bench_byte_strncmp(a, b, lens[l]);
+					break;
+				case 1:
+					sink += my_strncmp(a, b, lens[l]);
+					break;
+				case 2:
+					sink += bench_byte_strncasecmp(a, c, lens[l]);
+					break;
+				default:
+					sink += my_strncasecmp(a, c, lens[l]);
+					break;
+				}
+			}
+			t[k] = (bench_now() - t[k]) * 1e9 / reps;
+		}
+
+		printf("%5d %10.1f %10.1f %10.1f %10.1f\n", lens[l], t[0], t[1], t[2], t[3]);
+	}
+
+	return sink == 0 ? 0 : -1;
+}
+
+#define BENCH_CONFIRMS    (1 << 22)
+
+/* ns per confirmation of a random pid against the first 64KB of traffic,
+ * reading the pattern through list (DFC_PATTERN and casepatrn as
+ * DFC_AddPattern allocated them, what the search read before the store)
+ * or, if list is NULL, from the compiled store of dfc */
+static double bench_confirm(const DFC_STRUCTURE *dfc, DFC_PATTERN **list, const unsigned char *traffic, long *sink)
+{
+	u64 state = bench_rnd_state;
+	double t;
+	int i;
+
+	bench_rnd_state = 0x9e3779b97f4a7c15ULL;
+
+	t = bench_now();
+	for (i = 0; i < BENCH_CONFIRMS; i++)
+	{
+		u32 pid = bench_rnd() % dfc->numPatterns;
+		const unsigned char *text = traffic + (bench_rnd() & 0xffff);
+		const unsigned char *pat;
+		int n, nocase;
+
+		if (list != NULL)
+		{
+			pat = list[pid]->casepatrn;
+			n = list[pid]->n;
+			nocase = list[pid]->nocase;
+		}
+		else
+		{
+			const DFC_STORED_PATTERN *rec = DFC_Stored(dfc, pid);
+
+			pat = rec->casepatrn;
+			n = rec->n;
+			nocase = rec->nocase;
+		}
+
+		if ((nocase ? my_strncasecmp(text, pat, n) : memcmp(text, pat, n)) == 0)
+		{
+			*sink += list != NULL ? list[pid]->sids[0] : dfc->SIDPool[dfc->sid_start[pid]];
+		}
+	}
+	t = bench_now() - t;
+
+	bench_rnd_state = state;
+
+	return t * 1e9 / BENCH_CONFIRMS;
+}
+
+/* Verification-heavy search (one token in 16 a rule) as the rule set
+ * outgrows the caches; shows what confirming a candidate costs, from the
+ * store and through the DFC_PATTERN pointers it replaced */
+static int bench_store(void)
+{
+	const int sizes[2] = { 10000, 200000 };
+	const int rounds = 2;
+	BENCH_COUNTER llc, l1d;
+	int s, k;
+
+	bench_counter_open(&llc, "cache-misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+	bench_counter_open(&l1d, "L1d-load-misses", PERF_TYPE_HW_CACHE,
+					   PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16));
+
+	for (s = 0; s < 2; s++)
+	{
+		BENCH_RULE *rules = (BENCH_RULE *)malloc(sizeof(BENCH_RULE) * sizes[s]);
+		DFC_STRUCTURE *dfc, *added;
+		DFC_PATTERN **list;
+		DFC_PATTERN *p;
+		unsigned char *traffic;
+		long matches = 0, sink = 0;
+		long long v_llc, v_l1d;
+		double t, t_list, t_store;
+		int i;
+
+		/* 4B and longer only: CT1/CT2 hits would be reported without a compare */
+		for (i = 0; rules != NULL && i < sizes[s]; i++)
+		{
+			do
+			{
+				bench_make_rule(&rules[i]);
+			}
+			while (rules[i].len < 4);
+		}
+
+		dfc = rules != NULL ? bench_build_dfc(rules, sizes[s]) : NULL;
+		traffic = rules != NULL ? bench_make_traffic(rules, sizes[s], BENCH_TRAFFIC_SIZE, 16) : NULL;
+		added = DFC_New();
+		list = (DFC_PATTERN **)malloc(sizeof(DFC_PATTERN *) * sizes[s]);
+		if (rules == NULL || dfc == NULL || traffic == NULL || added == NULL || list == NULL)
+		{
+			printf("bench_store: setup failed\n");
+			return -1;
+		}
+
+		/* Same rules, added but not compiled: the patterns keep their own
+		 * casepatrn and sids */
+		for (i = 0; i < sizes[s]; i++)
+		{
+			DFC_AddPattern(added, rules[i].content, rules[i].len, rules[i].nocase, i);
+		}
+		for (p = added->dfcPatterns; p != NULL; p = p->next)
+		{
+			list[p->iid] = p;
+		}
+
+		bench_counter_start(&llc);
+		bench_counter_start(&l1d);
+		t = bench_now();
+		for (k = 0; k < rounds; k++)
+		{
+			DFC_Search(dfc, traffic, BENCH_TRAFFIC_SIZE, &matches, bench_count_match);
+		}
+		t = bench_now() - t;
+		v_l1d = bench_counter_stop(&l1d);
+		v_llc = bench_counter_stop(&llc);
+
+		printf("store: %d rules, %d MB traffic x %d: %.1f MB/s, %ld matches\n", sizes[s],
+			   BENCH_TRAFFIC_SIZE >> 20, rounds, (double)BENCH_TRAFFIC_SIZE * rounds / t / (1 << 20), matches);
+		bench_print_counter(&llc, v_llc, (double)BENCH_TRAFFIC_SIZE * rounds);
+		bench_print_counter(&l1d, v_l1d, (double)BENCH_TRAFFIC_SIZE * rounds);
+
+		t_list = bench_confirm(dfc, list, traffic, &sink);
+		t_store = bench_confirm(dfc, NULL, traffic, &sink);
+		printf("confirm at random pids: DFC_PATTERN %.1f ns, store %.1f ns, x%.2f\n", t_list, t_store, t_list / t_store);
+
+		DFC_Free(added);
+		free(list);
+		DFC_Free(dfc);
+		free(traffic);
+		free(rules);
+	}
+
+	bench_counter_close(&llc);
+	bench_counter_close(&l1d);
+
+	return 0;
+}
+
+/* Split vs interleaved filter layout on mixed traffic, with full-size and
+ * 4K-bit filters: L1d misses per byte and throughput */
+static int bench_interleave(void)
+{
+	const int nrules = 30000;
+	const int rounds = 2;
+	BENCH_RULE *rules = bench_make_rules(nrules);
+	unsigned char *traffic = bench_make_traffic(rules, nrules, BENCH_TRAFFIC_SIZE, 16);
+	const u32 df_bits[2] = { DF_BITS, 12 };
+	BENCH_COUNTER l1d;
+	int a, l, i, k;
+
+	if (rules == NULL || traffic == NULL)
+	{
+		printf("bench_interleave: setup failed\n");
+		return -1;
+	}
+
+	bench_counter_open(&l1d, "L1d-load-misses", PERF_TYPE_HW_CACHE,
+					   PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16));
+
+	printf("interleave: %d rules, %d MB traffic x %d\n", nrules, BENCH_TRAFFIC_SIZE >> 20, rounds);
+
+	for (a = 0; a < 2; a++)
+	{
+		for (l = 0; l < 2; l++)
+		{
+			DFC_CONFIG config;
+			DFC_STRUCTURE *dfc;
+			long matches = 0;
+			long long v_l1d;
+			double t;
+
+			DFC_ConfigDefault(&config);
+			config.df_bits = df_bits[a];
+			config.df_interleave = l;
+
+			dfc = DFC_NewWithConfig(&config, NULL);
+			for (i = 0; dfc != NULL && i < nrules; i++)
+			{
+				DFC_AddPattern(dfc, rules[i].content, rules[i].len, rules[i].nocase, i);
+			}
+
+			if (dfc == NULL || DFC_Compile(dfc) < 0)
+			{
+				printf("bench_interleave: compile failed\n");
+				return -1;
+			}
+
+			bench_counter_start(&l1d);
+			t = bench_now();
+			for (k = 0; k < rounds; k++)
+			{
+				DFC_Search(dfc, traffic, BENCH_TRAFFIC_SIZE, &matches, bench_count_match);
+			}
+			t = bench_now() - t;
+			v_l1d = bench_counter_stop(&l1d);
+
+			printf("df_bits %2u %-11s %.1f MB/s, %ld matches\n", dfc->config.df_bits,
+				   l ? "interleaved" : "split", (double)BENCH_TRAFFIC_SIZE * rounds / t / (1 << 20), matches);
+			bench_print_counter(&l1d, v_l1d, (double)BENCH_TRAFFIC_SIZE * rounds);
+
+			DFC_Free(dfc);
+		}
+	}
+
+	bench_counter_close(&l1d);
+	free(traffic);
+	free(rules);
+
+	return 0;
+}
+
+static const struct
+{
+	const char *name;
+	int (*run)(void);
+} benches[] =
+{
+	{ "prefetch", bench_prefetch },
+	{ "arena", bench_arena },
+	{ "fold", bench_fold },
+	{ "batch", bench_batch },
+	{ "stream", bench_stream },
+	{ "ring", bench_ring },
+	{ "threads", bench_threads },
+	{ "compile", bench_compile },
+	{ "swap", bench_swap },
+	{ "blob", bench_blob },
+	{ "geometry", bench_geometry },
+	{ "sample", bench_sample },
+	{ "add", bench_add },
+	{ "verify", bench_verify },
+	{ "store", bench_store },
+	{ "interleave", bench_interleave },
+};
+
+int main(int argc, char **argv)
+{
+	u32 i;
+
+	if (argc < 2)
+	{
+		printf("usage: %s <bench>\n", argv[0]);
+		for (i = 0; i < sizeof(benches) / sizeof(benches[0]); i++)
+		{
+			printf("  %s\n", benches[i].name);
+		}
+		return 0;
+	}
+
+	for (i = 0; i < sizeof(benches) / sizeof(benches[0]); i++)
+	{
+		if (strcmp(argv[1], benches[i].name) == 0)
+		{
+			return benches[i].run();
+		}
+	}
+
+	printf("unknown bench %s\n", argv[1]);
+	return -1;
+}